@@ -0,0 +1,258 @@
+/* SHA-256 and password KDF benchmark with known answer checks. For every
+ * SHA-256 implementation built in and supported by this CPU: the NIST
+ * known answers, bulk hashing speed (cycles/byte from the TSC on x86) and
+ * the iterated 32 byte hash. Then the KDF at 1 to 10^7 iterations with the
+ * default code and batch KDF throughput per multi-buffer engine.
+ * Results are printed as JSON; the exit status is 1 if any known answer
+ * is wrong. "--kat" only runs the known answer checks. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+#include "sha256.h"
+#include "kdf.h"
+
+#define BULK_SIZE (1 << 20)
+#define BULK_RUNS 16
+#define ITERATE_ROUNDS 200000
+#define BATCH_JOBS 64
+#define BATCH_ITERATIONS 10000
+
+static const char *impls[] = { "generic", "shani", "armv8" };
+static const char *multis[] = { "avx2", "avx512" };
+
+#define NELEM(a) ( sizeof( a ) / sizeof( a[0] ) )
+
+static uint64_t
+now_ns( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( uint64_t ) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t
+cycles( void )
+{
+#ifdef HAVE_TSC
+  return __rdtsc(  );
+#else
+  return 0;
+#endif
+}
+
+static void
+to_hex( const uint8_t *d, char *hex )
+{
+  int           k;
+
+  for( k = 0; k < SHA256_DIGEST_SIZE; k++ )
+    sprintf( hex + 2 * k, "%02x", d[k] );
+}
+
+/* FIPS 180-2 "abc" and one million 'a', fed in uneven pieces */
+static bool
+known_answers( void )
+{
+  static uint8_t buf[1000];
+  struct sha256_state sctx;
+  uint8_t       d[SHA256_DIGEST_SIZE];
+  char          hex[2 * SHA256_DIGEST_SIZE + 1];
+  int           k, done;
+
+  sha256hash( ( const uint8_t * ) "abc", 3, d );
+  to_hex( d, hex );
+  if( strcmp( hex,
+          "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" ) )
+    return false;
+
+  memset( buf, 'a', sizeof( buf ) );
+  sha256_init( &sctx );
+  for( done = 0, k = 0; done < 1000000; k++ )
+  {
+    int           len = 1 + ( k * 131 ) % sizeof( buf );
+
+    if( len > 1000000 - done )
+      len = 1000000 - done;
+    sha256_update( &sctx, buf, len );
+    done += len;
+  }
+  sha256_final( &sctx, d );
+  to_hex( d, hex );
+  return 0 == strcmp( hex,
+      "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" );
+}
+
+static void
+bench_bulk( const char *name, bool *first )
+{
+  uint8_t      *buf = malloc( BULK_SIZE );
+  uint8_t       d[SHA256_DIGEST_SIZE];
+  uint64_t      t0, c0, ns, cyc;
+  double        bytes = ( double ) BULK_SIZE * BULK_RUNS;
+  int           k;
+
+  if( buf == NULL )
+    return;
+  memset( buf, 0x5a, BULK_SIZE );
+  sha256hash( buf, BULK_SIZE, d );        /* warm up */
+  t0 = now_ns(  );
+  c0 = cycles(  );
+  for( k = 0; k < BULK_RUNS; k++ )
+    sha256hash( buf, BULK_SIZE, d );
+  cyc = cycles(  ) - c0;
+  ns = now_ns(  ) - t0;
+  free( buf );
+  printf( "%s\n    {\"impl\": \"%s\", \"bytes\": %.0f, \"ns_per_byte\": %.3f, "
+      "\"cycles_per_byte\": ", *first ? "" : ",", name, bytes, ns / bytes );
+#ifdef HAVE_TSC
+  printf( "%.2f", cyc / bytes );
+#else
+  ( void ) cyc;
+  printf( "null" );
+#endif
+  printf( ", \"mb_per_s\": %.1f}", bytes / ns * 1000 );
+  *first = false;
+}
+
+static void
+bench_iterate( const char *name, bool *first )
+{
+  uint8_t       d[SHA256_DIGEST_SIZE] = { 0 };
+  uint64_t      t0, ns;
+
+  t0 = now_ns(  );
+  sha256_iterate( d, ITERATE_ROUNDS );
+  ns = now_ns(  ) - t0;
+  printf( "%s\n    {\"impl\": \"%s\", \"iterations\": %d, "
+      "\"ns_per_iteration\": %.1f}", *first ? "" : ",", name,
+      ITERATE_ROUNDS, ( double ) ns / ITERATE_ROUNDS );
+  *first = false;
+}
+
+static void
+bench_batch( const char *multi, bool *first )
+{
+  static const uint8_t salt[KDF_SALT_SIZE] = { 'W', 0, 'D', 0, 'x', 0, 'y', 0 };
+  struct kdf_job jobs[BATCH_JOBS];
+  char          passwords[BATCH_JOBS][16];
+  uint64_t      t0, ns;
+  int           k;
+
+  for( k = 0; k < BATCH_JOBS; k++ )
+  {
+    snprintf( passwords[k], sizeof( passwords[k] ), "password%d", k );
+    jobs[k].salt = salt;
+    jobs[k].password = passwords[k];
+    jobs[k].iterations = BATCH_ITERATIONS;
+  }
+  t0 = now_ns(  );
+  kdf_hash_passwords( jobs, BATCH_JOBS );
+  ns = now_ns(  ) - t0;
+  printf( "%s\n    {\"multi\": \"%s\", \"jobs\": %d, \"iterations\": %d, "
+      "\"ms\": %.2f, \"ns_per_chain_iteration\": %.2f}", *first ? "" : ",",
+      multi ? multi : "none", BATCH_JOBS, BATCH_ITERATIONS, ns / 1e6,
+      ( double ) ns / BATCH_JOBS / BATCH_ITERATIONS );
+  *first = false;
+}
+
+int
+main( int argc, char *argv[] )
+{
+  const char   *def_impl, *def_multi;
+  bool          kat_only = argc > 1 && 0 == strcmp( argv[1], "--kat" );
+  long          max_iterations = 10000000;
+  bool          first, ok, all_ok = true;
+  uint8_t       d[KDF_DIGEST_SIZE];
+  static const uint8_t salt[KDF_SALT_SIZE] = { 's', 0, 'a', 0, 'l', 0, 't', 0 };
+  uint64_t      t0, ns;
+  unsigned int  k;
+  long          it;
+  int           ret;
+
+  if( !kat_only && argc > 1 )
+    max_iterations = atol( argv[1] );
+  def_impl = sha256_impl_name(  );
+  def_multi = sha256_multi_name(  );
+
+  printf( "{\n  \"benchmark\": \"crypto\",\n" );
+  printf( "  \"default_impl\": \"%s\",\n  \"default_multi\": %s%s%s,\n",
+      def_impl, def_multi ? "\"" : "", def_multi ? def_multi : "null",
+      def_multi ? "\"" : "" );
+
+  printf( "  \"kat\": [" );
+  first = true;
+  for( k = 0; k < NELEM( impls ); k++ )
+  {
+    ret = sha256_set_impl( impls[k] );
+    if( ret == -1 )
+      continue;
+    ok = ret == 0 && known_answers(  );
+    all_ok &= ok;
+    printf( "%s\n    {\"impl\": \"%s\", \"ok\": %s}", first ? "" : ",",
+        impls[k], ok ? "true" : "false" );
+    first = false;
+  }
+  for( k = 0; k < NELEM( multis ); k++ )
+  {
+    ret = sha256_set_multi( multis[k] );
+    if( ret == -1 )
+      continue;
+    ok = ret == 0;
+    all_ok &= ok;
+    printf( ",\n    {\"multi\": \"%s\", \"ok\": %s}", multis[k],
+        ok ? "true" : "false" );
+  }
+  printf( "\n  ]" );
+  sha256_set_impl( def_impl );
+  sha256_set_multi( def_multi );
+  if( kat_only )
+    goto out;
+
+  printf( ",\n  \"sha256\": [" );
+  first = true;
+  for( k = 0; k < NELEM( impls ); k++ )
+    if( sha256_set_impl( impls[k] ) == 0 )
+      bench_bulk( impls[k], &first );
+  printf( "\n  ],\n  \"iterate\": [" );
+  first = true;
+  for( k = 0; k < NELEM( impls ); k++ )
+    if( sha256_set_impl( impls[k] ) == 0 )
+      bench_iterate( impls[k], &first );
+  sha256_set_impl( def_impl );
+
+  printf( "\n  ],\n  \"kdf\": [" );
+  first = true;
+  for( it = 1; it <= max_iterations; it *= 10 )
+  {
+    t0 = now_ns(  );
+    kdf_hash_password( salt, "benchmark", it, d );
+    ns = now_ns(  ) - t0;
+    printf( "%s\n    {\"impl\": \"%s\", \"iterations\": %ld, \"ns\": %llu, "
+        "\"ns_per_iteration\": %.1f}", first ? "" : ",", def_impl, it,
+        ( unsigned long long ) ns, ( double ) ns / it );
+    first = false;
+  }
+
+  printf( "\n  ],\n  \"kdf_batch\": [" );
+  first = true;
+  sha256_set_multi( NULL );
+  bench_batch( NULL, &first );
+  for( k = 0; k < NELEM( multis ); k++ )
+    if( sha256_set_multi( multis[k] ) == 0 )
+      bench_batch( multis[k], &first );
+  sha256_set_multi( def_multi );
+  printf( "\n  ]" );
+out:
+  printf( ",\n  \"kat_ok\": %s\n}\n", all_ok ? "true" : "false" );
+  return all_ok ? 0 : 1;
+}
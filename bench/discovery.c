@@ -0,0 +1,350 @@
+/* Device node resolution benchmark: time to resolve one major:minor
+ * through /sys/dev DEVNAME against building the /dev index, for /dev
+ * directories of growing size, and time of a full Passport scan over
+ * synthetic sysfs trees with a growing number of LUs, next to the
+ * chdir/getcwd walk the scan replaced. Needs CAP_MKNOD for the synthetic
+ * /dev. Results are printed as JSON. */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+
+#include "lsscsi.h"
+
+#define LOOKUPS 1000
+#define BENCH_MAJOR 240		/* local/experimental use range */
+#define SCAN_RUNS 20
+#define MAX_LUS 1024
+
+static uint64_t
+now_ns( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( uint64_t ) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+make_dev_dir( char *dir, int nodes )
+{
+  char          path[512];
+  int           k;
+
+  for( k = 0; k < nodes; k++ )
+  {
+    snprintf( path, sizeof( path ), "%s/bench%d", dir, k );
+    if( mknod( path, S_IFCHR | 0600,
+	    makedev( BENCH_MAJOR + k / 1000000, k % 1000000 ) ) )
+    {
+      perror( "mknod" );
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static void
+remove_dev_dir( char *dir, int nodes )
+{
+  char          path[512];
+  int           k;
+
+  for( k = 0; k < nodes; k++ )
+  {
+    snprintf( path, sizeof( path ), "%s/bench%d", dir, k );
+    unlink( path );
+  }
+  rmdir( dir );
+}
+
+static int
+write_file( const char *path, const char *value )
+{
+  int           fd, len = strlen( value );
+
+  if( ( fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644 ) ) < 0 )
+    return -1;
+  if( write( fd, value, len ) != len )
+    len = -1;
+  close( fd );
+  return len < 0 ? -1 : 0;
+}
+
+/* Lay out a sysfs look-alike below 'root' with 'lus' SCSI devices, every
+ * fourth one a Passport. Each LU has a tape class device pointing at
+ * /dev/null (1:3) so the node resolution succeeds on any system. */
+static int
+make_sysfs_tree( const char *root, int lus )
+{
+  char          path[512];
+  int           k, err = 0;
+
+  snprintf( path, sizeof( path ), "%s/bus", root );
+  err |= mkdir( path, 0755 );
+  snprintf( path, sizeof( path ), "%s/bus/scsi", root );
+  err |= mkdir( path, 0755 );
+  snprintf( path, sizeof( path ), "%s/bus/scsi/devices", root );
+  err |= mkdir( path, 0755 );
+  snprintf( path, sizeof( path ), "%s/dev", root );
+  err |= mkdir( path, 0755 );
+  snprintf( path, sizeof( path ), "%s/dev/char", root );
+  err |= mkdir( path, 0755 );
+  snprintf( path, sizeof( path ), "%s/dev/char/1:3", root );
+  err |= mkdir( path, 0755 );
+  snprintf( path, sizeof( path ), "%s/dev/char/1:3/uevent", root );
+  err |= write_file( path, "MAJOR=1\nMINOR=3\nDEVNAME=null\n" );
+  for( k = 0; k < lus && !err; k++ )
+  {
+    snprintf( path, sizeof( path ), "%s/bus/scsi/devices/%d:0:0:0", root,
+	k );
+    err |= mkdir( path, 0755 );
+    snprintf( path, sizeof( path ), "%s/bus/scsi/devices/%d:0:0:0/vendor",
+	root, k );
+    err |= write_file( path, k % 4 ? "ATA     \n" : "WD      \n" );
+    snprintf( path, sizeof( path ), "%s/bus/scsi/devices/%d:0:0:0/model",
+	root, k );
+    err |= write_file( path, k % 4 ? "Disk\n" : "My Passport 25E2\n" );
+    snprintf( path, sizeof( path ), "%s/bus/scsi/devices/%d:0:0:0/tape",
+	root, k );
+    err |= mkdir( path, 0755 );
+    snprintf( path, sizeof( path ),
+	"%s/bus/scsi/devices/%d:0:0:0/tape/st%d", root, k, k );
+    err |= mkdir( path, 0755 );
+    snprintf( path, sizeof( path ),
+	"%s/bus/scsi/devices/%d:0:0:0/tape/st%d/dev", root, k, k );
+    err |= write_file( path, "1:3\n" );
+  }
+  return err ? -1 : 0;
+}
+
+/* The scan as it was before the fd-relative walk, kept as the baseline:
+ * scandir() with filters returning through globals, and a chdir() into
+ * each class device to learn its path with getcwd(). Counts the Passports
+ * whose node resolves; the caller's cwd is restored. */
+static struct dirent legacy_class, legacy_first;
+static bool   legacy_hit;
+
+static bool
+legacy_dir_or_link( const struct dirent *s )
+{
+  return ( DT_LNK == s->d_type || DT_DIR == s->d_type ) &&
+      strcmp( s->d_name, "." ) && strcmp( s->d_name, ".." );
+}
+
+static int
+legacy_class_select( const struct dirent *s )
+{
+  if( legacy_hit || !legacy_dir_or_link( s ) )
+    return 0;
+  if( strncmp( "scsi_changer", s->d_name, 12 ) &&
+      strncmp( "block", s->d_name, 5 ) && strcmp( "tape", s->d_name ) &&
+      strncmp( "scsi_tape:st", s->d_name, 12 ) &&
+      strncmp( "onstream_tape:os", s->d_name, 16 ) )
+    return 0;
+  legacy_class = *s;
+  legacy_hit = true;
+  return 1;
+}
+
+static int
+legacy_first_select( const struct dirent *s )
+{
+  if( legacy_hit || !legacy_dir_or_link( s ) )
+    return 0;
+  legacy_first = *s;
+  legacy_hit = true;
+  return 1;
+}
+
+static int
+legacy_scandir( const char *dir, int ( *select ) ( const struct dirent * ) )
+{
+  struct dirent **namelist;
+  int           num, k;
+
+  legacy_hit = false;
+  if( ( num = scandir( dir, &namelist, select, NULL ) ) < 0 )
+    return -1;
+  for( k = 0; k < num; k++ )
+    free( namelist[k] );
+  free( namelist );
+  return num;
+}
+
+static bool
+legacy_value( const char *dir, const char *name, char *value, int len )
+{
+  char          path[1024];
+  FILE         *f;
+
+  snprintf( path, sizeof( path ), "%s/%s", dir, name );
+  if( NULL == ( f = fopen( path, "r" ) ) )
+    return false;
+  if( NULL == fgets( value, len, f ) )
+    value[0] = 0;
+  value[strcspn( value, "\n" )] = 0;
+  fclose( f );
+  return true;
+}
+
+static int
+legacy_scan( const char *root )
+{
+  struct dirent **namelist;
+  char          cwd[1024], devs[1024], lu[1280], wd[1536], path[2048];
+  char          value[256], node[256];
+  unsigned int  maj, min;
+  struct stat   st;
+  int           num, k, found = 0;
+
+  if( NULL == getcwd( cwd, sizeof( cwd ) ) )
+    return -1;
+  snprintf( devs, sizeof( devs ), "%s/bus/scsi/devices", root );
+  if( ( num = scandir( devs, &namelist, NULL, NULL ) ) < 0 )
+    return 0;
+  for( k = 0; k < num; k++ )
+  {
+    snprintf( lu, sizeof( lu ), "%s/%s", devs, namelist[k]->d_name );
+    free( namelist[k] );
+    if( !legacy_value( lu, "vendor", value, sizeof( value ) ) ||
+	strncmp( value, "WD", 2 ) ||
+	!legacy_value( lu, "model", value, sizeof( value ) ) ||
+	NULL == strstr( value, "Passport" ) ||
+	1 != legacy_scandir( lu, legacy_class_select ) )
+      continue;
+    snprintf( wd, sizeof( wd ), "%s/%s", lu, legacy_class.d_name );
+    if( DT_DIR == legacy_class.d_type )
+    {
+      if( 1 != legacy_scandir( wd, legacy_first_select ) )
+	continue;
+      snprintf( path, sizeof( path ), "%s/%s", wd, legacy_first.d_name );
+    }
+    else
+      snprintf( path, sizeof( path ), "%s", wd );
+    if( stat( path, &st ) == 0 && S_ISDIR( st.st_mode ) &&
+	chdir( path ) == 0 && getcwd( path, sizeof( path ) ) == NULL )
+      continue;
+    if( legacy_value( path, "dev", value, sizeof( value ) ) &&
+	2 == sscanf( value, "%u:%u", &maj, &min ) &&
+	sysfs_dev_node( maj, min, false, node, sizeof( node ) ) )
+      found++;
+  }
+  free( namelist );
+  if( chdir( cwd ) )
+    return -1;
+  return found;
+}
+
+static void
+remove_sysfs_tree( const char *root )
+{
+  char          cmd[512];
+
+  snprintf( cmd, sizeof( cmd ), "rm -rf '%s'", root );
+  if( system( cmd ) )
+    fprintf( stderr, "could not remove %s\n", root );
+}
+
+int
+main( int argc, char *argv[] )
+{
+  int           max_nodes = argc > 1 ? atoi( argv[1] ) : 10000;
+  int           nodes, k, first = 1;
+  uint64_t      t0, build_ns, index_ns, sysfs_ns;
+  char          dir[] = "/tmp/wd-bench-dev.XXXXXX";
+  char          node[256];
+  bool          sysfs_ok;
+
+  /* /dev/null (1:3) is present on every system */
+  t0 = now_ns(  );
+  for( k = 0; k < LOOKUPS; k++ )
+    sysfs_ok = sysfs_dev_node( 1, 3, false, node, sizeof( node ) );
+  sysfs_ns = ( now_ns(  ) - t0 ) / LOOKUPS;
+
+  printf( "{\n  \"benchmark\": \"discovery\",\n" );
+  printf( "  \"sysfs_lookup_ns\": %llu,\n  \"sysfs_lookup_ok\": %s,\n",
+      ( unsigned long long ) sysfs_ns, sysfs_ok ? "true" : "false" );
+  printf( "  \"dev_index\": [" );
+  for( nodes = 10; nodes <= max_nodes; nodes *= 10 )
+  {
+    if( NULL == mkdtemp( dir ) )
+    {
+      perror( "mkdtemp" );
+      return 1;
+    }
+    if( make_dev_dir( dir, nodes ) )
+    {
+      remove_dev_dir( dir, nodes );
+      return 1;
+    }
+    t0 = now_ns(  );
+    dev_index_build( dir );
+    build_ns = now_ns(  ) - t0;
+    t0 = now_ns(  );
+    for( k = 0; k < LOOKUPS; k++ )
+      dev_index_lookup( BENCH_MAJOR, k % nodes, false, node,
+	  sizeof( node ) );
+    index_ns = ( now_ns(  ) - t0 ) / LOOKUPS;
+    dev_index_free(  );
+    remove_dev_dir( dir, nodes );
+    strcpy( dir, "/tmp/wd-bench-dev.XXXXXX" );
+    printf( "%s\n    {\"dev_nodes\": %d, \"scan_ns\": %llu, "
+	"\"index_lookup_ns\": %llu}", first ? "" : ",", nodes,
+	( unsigned long long ) build_ns, ( unsigned long long ) index_ns );
+    first = 0;
+  }
+  printf( "\n  ],\n  \"passport_scan\": [" );
+  first = 1;
+  for( nodes = 4; nodes <= MAX_LUS; nodes *= 4 )
+  {
+    char          root[] = "/tmp/wd-bench-sys.XXXXXX";
+    char        **devs;
+    uint64_t      best = UINT64_MAX, legacy_best = UINT64_MAX, t;
+    int           found = 0, legacy_found = 0;
+
+    if( NULL == mkdtemp( root ) )
+    {
+      perror( "mkdtemp" );
+      return 1;
+    }
+    if( make_sysfs_tree( root, nodes ) )
+    {
+      perror( "sysfs tree" );
+      remove_sysfs_tree( root );
+      return 1;
+    }
+    set_sysfsroot( root );
+    for( k = 0; k < SCAN_RUNS; k++ )
+    {
+      t0 = now_ns(  );
+      found = find_passport_devices( &devs );
+      t = now_ns(  ) - t0;
+      free_passport_devices( devs );
+      if( t < best )
+	best = t;
+      t0 = now_ns(  );
+      legacy_found = legacy_scan( root );
+      t = now_ns(  ) - t0;
+      if( t < legacy_best )
+	legacy_best = t;
+    }
+    remove_sysfs_tree( root );
+    printf( "%s\n    {\"lus\": %d, \"passports\": %d, \"scan_ns\": %llu, "
+	"\"chdir_passports\": %d, \"chdir_scan_ns\": %llu}",
+	first ? "" : ",", nodes, found, ( unsigned long long ) best,
+	legacy_found, ( unsigned long long ) legacy_best );
+    first = 0;
+  }
+  set_sysfsroot( "/sys" );
+  printf( "\n  ]\n}\n" );
+  return 0;
+}
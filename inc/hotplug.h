@@ -0,0 +1,51 @@
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <stdbool.h>
+
+#define REG_BUCKETS 64
+
+/* One attached WD Passport, keyed by its SCSI address */
+struct passport_entry
+{
+  char          hctl[32];	/* e.g. "6:0:0:0" */
+  char          sysfs_path[256];	/* /sys/devices/... of the LU */
+  char          block_node[64];	/* /dev/sdX or empty */
+  char          sg_node[64];	/* /dev/sgN or empty */
+  int           security;	/* last SECURITY STATUS, -1 if unknown */
+  unsigned int  scan;		/* last registry scan that found it */
+  void         *priv;		/* the owner's per drive state */
+  struct passport_entry *next;	/* hash chain by hctl */
+  struct passport_entry *next_node;	/* hash chain by block node */
+};
+
+struct passport_registry
+{
+  struct passport_entry *by_hctl[REG_BUCKETS];
+  struct passport_entry *by_node[REG_BUCKETS];
+  int           count;
+  unsigned int  scan;		/* registry scans so far */
+  int           nl_fd;		/* uevent netlink socket, -1 if closed */
+};
+
+enum hotplug_event
+{ HOTPLUG_ADD, HOTPLUG_CHANGE, HOTPLUG_REMOVE };
+
+/* Called after the registry was updated. On HOTPLUG_REMOVE the entry is
+ * released once the callback returns. */
+typedef void  ( *hotplug_fn ) ( struct passport_registry * reg,
+                                struct passport_entry * ent,
+                                enum hotplug_event ev, void *arg );
+
+void          registry_init( struct passport_registry *reg );
+void          registry_free( struct passport_registry *reg );
+int           registry_scan( struct passport_registry *reg );
+struct passport_entry *registry_lookup( struct passport_registry *reg,
+                                        const char *hctl );
+struct passport_entry *registry_lookup_node( struct passport_registry *reg,
+                                             const char *block_node );
+int           hotplug_open( struct passport_registry *reg );
+int           hotplug_process( struct passport_registry *reg,
+                               hotplug_fn fn, void *arg );
+
+#endif				/* end of HOTPLUG_H */
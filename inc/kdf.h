@@ -0,0 +1,68 @@
+#ifndef KDF_H
+#define KDF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define KDF_SALT_SIZE   8               /* UCS-2 salt of handy store block 1 */
+#define KDF_MAX_PASSWD  64
+#define KDF_DIGEST_SIZE 32
+
+/* Optional KDF record in the reserved bytes of handy store block 1:
+ * "LXKD", algorithm, log2(N), r, p and a 16 byte salt. Without it the
+ * drive uses the WD scheme of iterations and UCS-2 salt at bytes 8-19. */
+#define KDF_PARAMS_OFFSET 226
+#define KDF_PARAMS_MAGIC  "LXKD"
+#define KDF_PARAMS_SIZE   24
+#define KDF_SCRYPT_SALT   16
+
+#define KDF_SCRYPT_LOG2N  16            /* 64 MiB per lane with r = 8 */
+#define KDF_SCRYPT_R      8
+#define KDF_SCRYPT_P      4
+
+enum kdf_algo
+{ KDF_WD = 0, KDF_SCRYPT = 1 };
+
+struct kdf_params
+{
+  enum kdf_algo algo;
+  /* WD scheme */
+  uint32_t      iterations;
+  uint8_t       wd_salt[KDF_SALT_SIZE];
+  /* scrypt */
+  uint8_t       log2_n, r, p;
+  uint8_t       salt[KDF_SCRYPT_SALT];
+};
+
+/* One password to derive in a batch */
+struct kdf_job
+{
+  const uint8_t *salt;
+  const char   *password;
+  int           iterations;
+  uint8_t       digest[KDF_DIGEST_SIZE];        /* result */
+};
+
+uint8_t      *kdf_hash_password( const uint8_t * salt, const char *password,
+                                 int iterations, uint8_t * digest );
+void          kdf_hash_passwords( struct kdf_job *jobs, int njobs );
+int           kdf_scrypt( const uint8_t * passwd, size_t passwd_len,
+                          const uint8_t * salt, size_t salt_len,
+                          unsigned int log2_n, unsigned int r,
+                          unsigned int p, uint8_t * out, size_t out_len );
+
+void          kdf_params_read( const uint8_t * block1,
+                               struct kdf_params *kp );
+void          kdf_params_write( const struct kdf_params *kp,
+                                uint8_t * block1 );
+int           kdf_params_parse( const char *arg, struct kdf_params *kp );
+int           kdf_params_new_salt( struct kdf_params *kp );
+const char   *kdf_params_str( const struct kdf_params *kp, char *buf,
+                              int len );
+uint8_t      *kdf_derive( const struct kdf_params *kp, const char *password,
+                          uint8_t * digest );
+uint64_t      kdf_time_ns( const struct kdf_params *kp );
+int           kdf_calibrate( struct kdf_params *kp, unsigned int target_ms,
+                             uint64_t * ns );
+
+#endif				/* end of KDF_H */
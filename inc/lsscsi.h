@@ -0,0 +1,24 @@
+#ifndef LSSCSI_H
+#define LSSCSI_H
+
+#include <stdbool.h>
+
+char         *find_passport_device( void );
+int           find_passport_devices( char ***devices );
+void          free_passport_devices( char **devices );
+int           dev_index_build( const char *dir );
+void          dev_index_free( void );
+bool          dev_index_lookup( unsigned int maj, unsigned int min,
+                                bool block, char *node, int max_len );
+bool          sysfs_dev_node( unsigned int maj, unsigned int min,
+                              bool block, char *node, int max_len );
+bool          find_sg_node( const char *dev_node, char *sg_node,
+                            int max_len );
+bool          sysfs_is_passport( const char *lu_path );
+bool          sysfs_child_node( const char *lu_path, const char *sub,
+                                char *node, int max_len );
+void          set_sysfsroot( const char *root );
+const char   *get_sysfsroot( void );
+const char   *get_dev_dir( void );
+
+#endif				/* end of LSSCSI_H */
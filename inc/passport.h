@@ -0,0 +1,25 @@
+#ifndef PASSPORT_H
+#define PASSPORT_H
+
+#include "sg_pt_linux.h"
+
+/* Security operations of CHANGE PASSWORD (C1h E2h) */
+enum pass_xchg
+{ CHANGE_PASSWD, SET_PASSWD, DISABLE_ENCRYPTION = 16 };
+
+/* Drive operations of wd-passport.c, shared with the daemon. Those that
+ * check the lock state expect the encryption status in op->reply. */
+char         *sec_status_to_str( int security_status );
+char         *cipher_id_to_str( int cipher_id );
+int           get_encryption_status( struct scsi_op_t *op );
+int           unlock_drive( struct scsi_op_t *op, char *passwd );
+int           change_password_to( struct scsi_op_t *op, int security,
+                                  char *old_passwd, char *new_passwd );
+char         *read_handy_store_block1( struct scsi_op_t *op, char *hint );
+char         *read_handy_store_block2( struct scsi_op_t *op, char *label );
+void          handy_cache_drop( struct scsi_op_t *op );
+
+/* wd-passportd.c */
+int           daemon_main( const char *socket_path );
+
+#endif				/* end of PASSPORT_H */
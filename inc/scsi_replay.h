@@ -0,0 +1,61 @@
+#ifndef SCSI_REPLAY_H
+#define SCSI_REPLAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SCSI_REPLAY_MAGIC "WDPSGIO1"	/* first 8 bytes of a recording */
+#define SCSI_REPLAY_ALIGN 8		/* records start on this boundary */
+#define SCSI_REPLAY_MAX_DEVICES 65536
+
+enum
+{
+  SCSI_REPLAY_DEVICE = 1,	/* names device index 'device' */
+  SCSI_REPLAY_COMMAND = 2	/* one command of device 'device' */
+};
+
+/* A recording is the magic followed by records in host byte order. Each
+ * is this header, then cdb_len CDB bytes, sense_len sense bytes, out_len
+ * data-out and in_len data-in bytes (the name for a device record), then
+ * zeros up to the next SCSI_REPLAY_ALIGN boundary. */
+struct scsi_replay_rec
+{
+  uint8_t       type;		/* SCSI_REPLAY_* */
+  uint8_t       dir_out;	/* 1 for data-out */
+  uint8_t       cdb_len;
+  uint8_t       sense_len;
+  uint8_t       status;		/* SCSI status byte */
+  uint8_t       transport_err;	/* host status, see DID_* */
+  uint16_t      device;
+  uint32_t      size;		/* of the whole record, padding included */
+  int32_t       ret;		/* what do_scsi_pt() returned */
+  int32_t       data_len;	/* bytes requested */
+  int32_t       resid;
+  uint32_t      out_len;
+  uint32_t      in_len;
+  uint64_t      submit_ns;	/* since the recording started */
+  uint64_t      xfer_ns;	/* wall time of the command */
+  uint64_t      device_ns;	/* driver reported time */
+};
+
+struct scsi_op_t;
+
+/* --record: every command completed by scsi_xfer_complete() is appended
+ * to the recording with what the device returned */
+int           scsi_record_open( const char *path );
+void          scsi_record_close( void );
+void          scsi_record_add( struct scsi_op_t *op, int ret );
+
+/* --replay: sessions are served from a recording instead of a device,
+ * command by command in the order recorded for each device */
+int           scsi_replay_load( const char *spec );
+bool          scsi_replay_active( void );
+int           scsi_replay_devices( char ***devices );
+char         *scsi_replay_device( int index );
+int           scsi_replay_open( struct scsi_op_t *op );
+void          scsi_replay_close( struct scsi_op_t *op );
+int           scsi_replay_xfer( struct scsi_op_t *op );
+int           scsi_replay_submit( struct scsi_op_t *op );
+int           scsi_replay_receive( struct scsi_op_t *op );
+
+#endif				/* end of SCSI_REPLAY_H */
@@ -0,0 +1,38 @@
+#ifndef SCSI_TRACE_H
+#define SCSI_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define SCSI_TRACE_RECORDS 1024	/* a power of two */
+#define SCSI_TRACE_CDB 16	/* CDB bytes kept per record */
+
+/* One completed command. Records are filled by scsi_xfer_complete() from
+ * any thread without locking and decoded only when the ring is dumped. */
+struct scsi_trace_rec
+{
+  uint64_t      seq;		/* 1 + sequence number, 0 while written */
+  uint64_t      submit_ns;	/* scsi_clock_ns() when issued */
+  uint64_t      xfer_ns;	/* wall time of the command */
+  uint64_t      device_ns;	/* get_pt_duration_ns() */
+  uint32_t      data_len;	/* bytes requested */
+  int32_t       resid;
+  int32_t       fd;		/* sg_fd of the session */
+  int16_t       result;		/* 0 or a SG_LIB_CAT_* value */
+  uint8_t       category;	/* SCSI_PT_RESULT_* or SCSI_STATS_NOT_ISSUED */
+  uint8_t       dir_out;	/* 1 for data-out */
+  uint8_t       status;		/* SCSI status byte */
+  uint8_t       sense_key;
+  uint8_t       asc;
+  uint8_t       ascq;
+  uint8_t       cdb_len;
+  uint8_t       cdb[SCSI_TRACE_CDB];
+};
+
+struct scsi_op_t;
+
+void          scsi_trace_add( const struct scsi_op_t *op, int category,
+                              int status, int result, int resid );
+int           scsi_trace_dump( FILE *f );
+
+#endif				/* end of SCSI_TRACE_H */
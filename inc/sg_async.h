@@ -0,0 +1,41 @@
+#ifndef SG_ASYNC_H
+#define SG_ASYNC_H
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "sg_pt_linux.h"
+
+struct sg_async_work;
+
+/* One epoll instance driving the open sessions of any number of devices.
+ * Each device context has at most one command in flight; its done
+ * callback runs from sg_async_run() and may submit the next command. */
+struct sg_async_loop
+{
+  int           epfd;
+  int           inflight;	/* submitted and not yet completed */
+  /* workers of sg_async_defer(), one per CPU, started on first use */
+  pthread_t    *workers;
+  int           nworkers;
+  pthread_mutex_t lock;		/* guards the lists and stop */
+  pthread_cond_t queued;
+  struct sg_async_work *queue, **queue_tail;	/* not yet started */
+  struct sg_async_work *finished;	/* not yet passed to done */
+  bool          stop;
+  int           wake_fd[2];	/* a worker finished a job */
+};
+
+/* CPU bound step of a device context, e.g. a key derivation */
+typedef int   ( *sg_async_work_fn ) ( struct scsi_op_t * op );
+
+int           sg_async_init( struct sg_async_loop *loop );
+void          sg_async_fini( struct sg_async_loop *loop );
+int           sg_async_add( struct sg_async_loop *loop, struct scsi_op_t *op );
+int           scsi_xfer_submit( struct sg_async_loop *loop,
+                                struct scsi_op_t *op, scsi_done_fn done );
+void          sg_async_defer( struct sg_async_loop *loop,
+                              struct scsi_op_t *op, sg_async_work_fn work,
+                              scsi_done_fn done );
+int           sg_async_run( struct sg_async_loop *loop, int timeout_ms );
+
+#endif				/* end of SG_ASYNC_H */
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include <scsi/sg.h>
 #include <scsi/scsi.h>
 
@@ -14,13 +15,114 @@
 #define MIN_SCSI_CDBSZ 6
 #define MAX_SCSI_CDBSZ 260
 #define MAX_SCSI_XFER 512
+#define SENSE_LENGTH 32
 #define SCSI_TIMEOUT 20
 
+/* Timing of a device session, all values in nanoseconds */
+struct scsi_timing_t
+{
+  uint64_t      open_ns;	/* open() plus pass-through object setup */
+  uint64_t      close_ns;	/* object teardown plus close() */
+  uint64_t      submit_ns;	/* when the last command was issued */
+  uint64_t      xfer_ns;	/* wall time of the last command */
+  uint64_t      device_ns;	/* driver reported time of the last command */
+  uint64_t      total_xfer_ns;	/* wall time of all commands */
+  uint64_t      kdf_ns;		/* key derivations for this session */
+  unsigned int  commands;	/* commands issued in this session */
+};
+
+/* One recorded command of a session, see scsi_op_t.cmd_log */
+struct scsi_cmd_time_t
+{
+  uint8_t       opcode;
+  uint8_t       action;		/* cdb[1]: service action or page */
+  int           result;		/* 0 or a SG_LIB_CAT_* value */
+  uint64_t      xfer_ns;
+  uint64_t      device_ns;
+};
+
+/* Command counters, see scsi_op_t.stats */
+#define SCSI_STATS_OPCODES 16
+#define SCSI_STATS_RESULTS 6	/* SCSI_PT_RESULT_*, then "not issued" */
+#define SCSI_STATS_NOT_ISSUED 5
+#define SCSI_STATS_BUCKETS 14	/* finite latency buckets, then +Inf */
+/* HDR style latency histogram in microseconds: exact below 2 * SUB, then
+ * SUB slots per power of two, so every slot is within 1/SUB of its value */
+#define SCSI_HIST_SUB_BITS 4
+#define SCSI_HIST_SUB ( 1 << SCSI_HIST_SUB_BITS )
+#define SCSI_HIST_MAX_BITS 31	/* longer commands count as 2^31 us */
+#define SCSI_HIST_SLOTS ( ( SCSI_HIST_MAX_BITS - SCSI_HIST_SUB_BITS + 1 ) * \
+                          SCSI_HIST_SUB )
+
+extern const uint64_t scsi_stats_bounds_ns[SCSI_STATS_BUCKETS];
+
+/* The commands of one opcode and action (cdb[1]) */
+struct scsi_opcode_stats_t
+{
+  uint8_t       opcode;
+  uint8_t       action;
+  uint64_t      results[SCSI_STATS_RESULTS];	/* by result category */
+  uint64_t      buckets[SCSI_STATS_BUCKETS + 1];	/* not cumulative */
+  uint64_t      count;
+  uint64_t      sum_ns;
+  uint64_t      min_ns;
+  uint64_t      max_ns;
+  uint32_t      hist[SCSI_HIST_SLOTS];
+};
+
+/* May be shared by the sessions of several threads */
+struct scsi_stats_t
+{
+  pthread_mutex_t lock;
+  struct scsi_opcode_stats_t op[SCSI_STATS_OPCODES];
+  unsigned int  nops;		/* keys seen, later ones are dropped */
+};
+
+/* Handy store geometry from READ HANDY CAPACITY */
+struct handy_capacity_t
+{
+  uint32_t      last_block;	/* address of the last handy block */
+  uint32_t      block_len;	/* bytes per block, zero until read */
+  uint32_t      max_xfer;	/* blocks per READ/WRITE HANDY STORE */
+};
+
+/* Handy store blocks seen in this session, kept in step with the drive */
+struct handy_cache_t
+{
+  uint8_t      *data;		/* block k at data + k * MAX_SCSI_XFER */
+  uint8_t      *valid;		/* one flag per block */
+  uint32_t      nblocks;	/* blocks allocated */
+  unsigned int  hits;		/* blocks served without a command */
+};
+
+/* Per device command context. Every buffer belongs to this context only,
+ * so each thread can drive its own device without any shared state. */
+struct scsi_op_t;
+typedef void  ( *scsi_done_fn ) ( struct scsi_op_t * op, int ret );
+
 struct scsi_op_t
 {
   bool          dir_inout;
   int           data_len;
   char         *device_name;
+  uint8_t      *cdb;
+  uint8_t      *cmdout;		/* data-out, page aligned */
+  uint8_t      *reply;		/* data-in, page aligned */
+  int           buf_len;	/* size of cmdout and of reply */
+  uint8_t      *sense;
+  int           sg_fd;
+  struct sg_pt_base *ptvp;	/* not NULL while a session is open */
+  struct scsi_timing_t timing;
+  struct handy_capacity_t handy;
+  struct handy_cache_t handy_cache;
+  struct scsi_cmd_time_t *cmd_log;	/* if set, the first cmd_log_size */
+  unsigned int  cmd_log_size;	/* commands are recorded here */
+  struct scsi_stats_t *stats;	/* if set, every command is counted here */
+  void         *emu;		/* emulated drive session, see wd_emu.h */
+  void         *replay;		/* replayed session, see scsi_replay.h */
+  int           record_dev;	/* 1 + device index in the recording */
+  scsi_done_fn  done;		/* completion of an asynchronous command */
+  void         *priv;		/* owner of the context */
 };
 
 struct sg_sntl_dev_state_t
@@ -115,14 +217,30 @@ extern bool   sg_bsg_nvme_char_major_checked;
 extern int    sg_bsg_major;
 extern volatile int sg_nvme_char_major;
 extern long   sg_lin_page_size;
-extern uint8_t  cdb[CDB_LENGTH];
-extern uint8_t  cmdout[MAX_SCSI_XFER];
-extern uint8_t  reply[MAX_SCSI_XFER];
 
 void          sg_find_bsg_nvme_char_major( int verbose );
 int           sg_do_nvme_pt( struct sg_pt_base *vp, int fd, 
                              int time_secs, int vb );
 int           sg_linux_get_sg_version( const struct sg_pt_base *vp );
+int           do_scsi_pt_submit( struct sg_pt_base *vp, int time_secs,
+                                 int verbose );
+int           do_scsi_pt_receive( struct sg_pt_base *vp, int verbose );
+void          set_scsi_pt_emulated( struct sg_pt_base *vp, int status,
+                                    int transport_err, int sense_len,
+                                    int resid, int os_err, uint64_t ns );
+uint64_t      scsi_clock_ns( void );
+int           scsi_op_init( struct scsi_op_t *op, char *device_name );
+void          scsi_op_free( struct scsi_op_t *op );
+int           scsi_op_reserve( struct scsi_op_t *op, int len );
+int           scsi_session_open( struct scsi_op_t *op );
+void          scsi_session_close( struct scsi_op_t *op );
+void          scsi_xfer_prepare( struct scsi_op_t *op );
+int           scsi_xfer_complete( struct scsi_op_t *op, int ret );
 int           scsi_xfer( struct scsi_op_t *op );
+void          scsi_stats_init( struct scsi_stats_t *st );
+void          scsi_stats_add( struct scsi_stats_t *st, const uint8_t *cdb,
+                              int category, uint64_t ns );
+uint64_t      scsi_stats_percentile( const struct scsi_opcode_stats_t *os,
+                                     double pct );
 
 #endif				/* end of SG_PT_LINUX_H */
@@ -0,0 +1,56 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+
+#define SHA256_DIGEST_SIZE 32
+#define SHA256_BLOCK_SIZE  64
+#define SHA256_MAX_LANES   16
+
+struct sha256_state
+{
+  uint32_t      state[SHA256_DIGEST_SIZE / 4];
+  uint32_t      count;
+  uint8_t       buf[SHA256_BLOCK_SIZE];
+};
+
+extern const uint32_t SHA256_IV[8];
+extern const uint32_t SHA256_K[64];
+
+/* Compress 'blocks' consecutive 64 byte blocks of 'data' into 'state' */
+typedef void  ( *sha256_block_fn ) ( uint32_t * state, const uint8_t * data,
+                                     unsigned int blocks );
+/* Hash the 32 byte message 'words' (host order) 'iterations' times over */
+typedef void  ( *sha256_iterate_fn ) ( uint32_t * words,
+                                       unsigned long iterations );
+
+void          sha256_init( struct sha256_state *sctx );
+void          sha256_update( struct sha256_state *sctx, const uint8_t * data,
+                             unsigned int len );
+void          sha256_final( struct sha256_state *sctx, uint8_t * out );
+void          sha256hash( const uint8_t * data, unsigned int len,
+                          uint8_t * out );
+void          sha256_iterate( uint8_t * digest, unsigned long iterations );
+void          sha256_iterate_many( uint8_t * digests,
+                                   const unsigned long *iterations, int n );
+const char   *sha256_impl_name( void );
+const char   *sha256_multi_name( void );
+int           sha256_set_impl( const char *name );
+int           sha256_set_multi( const char *name );
+
+/* CPU specific block functions, only built on their architecture */
+void          sha256_blocks_shani( uint32_t * state, const uint8_t * data,
+                                   unsigned int blocks );
+void          sha256_blocks_armv8( uint32_t * state, const uint8_t * data,
+                                   unsigned int blocks );
+void          sha256_iterate_shani( uint32_t * words,
+                                    unsigned long iterations );
+void          sha256_iterate_armv8( uint32_t * words,
+                                    unsigned long iterations );
+/* 'words' holds word j of lane l at words[j * lanes + l] */
+void          sha256_iterate_x8_avx2( uint32_t * words,
+                                      unsigned long iterations );
+void          sha256_iterate_x16_avx512( uint32_t * words,
+                                         unsigned long iterations );
+
+#endif				/* end of SHA256_H */
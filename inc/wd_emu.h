@@ -0,0 +1,25 @@
+#ifndef WD_EMU_H
+#define WD_EMU_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define WD_EMU_PREFIX     "emu:"	/* device names of emulated drives */
+#define WD_EMU_PASSWORD   "passport"	/* initial password of every drive */
+#define WD_EMU_MAX_DRIVES 65536
+
+struct scsi_op_t;
+
+/* A software WD Passport behind the pass-through layer: sessions opened on
+ * "emu:N" run their commands here instead of in the sg driver. */
+int           wd_emu_configure( const char *spec );
+int           wd_emu_count( void );
+int           wd_emu_devices( char ***devices );
+bool          wd_emu_device( const char *device_name );
+int           wd_emu_open( struct scsi_op_t *op );
+void          wd_emu_close( struct scsi_op_t *op );
+int           wd_emu_xfer( struct scsi_op_t *op );
+int           wd_emu_submit( struct scsi_op_t *op );
+int           wd_emu_receive( struct scsi_op_t *op );
+
+#endif				/* end of WD_EMU_H */
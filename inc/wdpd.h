@@ -0,0 +1,71 @@
+#ifndef WDPD_H
+#define WDPD_H
+
+#include <stdint.h>
+
+/* Protocol of wd-passportd. The daemon listens on a SOCK_SEQPACKET UNIX
+ * socket; every request and every reply is one packet holding one of the
+ * structures below, integers in host byte order. WDPD_LIST is answered
+ * with one reply per drive followed by a reply with result WDPD_END, any
+ * other request with a single reply. A connection may carry any number
+ * of requests. */
+
+#define WDPD_SOCKET  "/run/wd-passportd.sock"
+#define WDPD_MAGIC   0x57445044	/* "WDPD" */
+#define WDPD_VERSION 1
+
+enum wdpd_request_op
+{
+  WDPD_LIST = 1,		/* status of every drive */
+  WDPD_STATUS,			/* status of one drive */
+  WDPD_LABEL,			/* disk label (handy block 2) */
+  WDPD_HINT,			/* password hint (handy block 1) */
+  WDPD_UNLOCK,			/* unlock with passwd */
+  WDPD_CHANGE_PASSWD		/* change passwd to new_passwd */
+};
+
+/* Read the drive rather than answer from what the daemon last saw */
+#define WDPD_REFRESH 1
+/* The daemon rereads the status of every idle drive this often, as a direct
+ * wd-passport run or another host may change it; WDPD_STATUS and WDPD_LIST
+ * answer from the last reread */
+#define WDPD_POLL_MS 1000
+
+enum wdpd_result
+{
+  WDPD_OK = 0,
+  WDPD_END = 1,			/* no more drives in a WDPD_LIST answer */
+  WDPD_E_PROTO = -1,		/* malformed request */
+  WDPD_E_NODEV = -2,		/* no such drive */
+  WDPD_E_IO = -3,		/* the drive did not answer */
+  WDPD_E_FAILED = -4,		/* the drive refused the operation */
+  WDPD_E_BUSY = -5		/* an unlock or password change is running */
+};
+
+struct wdpd_request
+{
+  uint32_t      magic;
+  uint16_t      version;
+  uint16_t      op;		/* enum wdpd_request_op */
+  uint32_t      flags;		/* WDPD_REFRESH */
+  char          device[64];	/* HCTL or block node, "" for any drive */
+  char          passwd[65];
+  char          new_passwd[65];
+};
+
+struct wdpd_reply
+{
+  uint32_t      magic;
+  uint16_t      version;
+  int16_t       result;		/* enum wdpd_result */
+  char          hctl[32];
+  char          block_node[64];
+  int32_t       security;	/* SECURITY STATUS, -1 if unknown */
+  uint8_t       cipher;		/* CIPHER ID */
+  uint8_t       reserved;
+  uint16_t      pwblen;		/* PASSWORD LENGTH */
+  uint32_t      status_age_ms;	/* since the status was read */
+  char          text[128];	/* label, hint or security status text */
+};
+
+#endif				/* end of WDPD_H */
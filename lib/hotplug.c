@@ -0,0 +1,400 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "hotplug.h"
+#include "lsscsi.h"
+#include "sg_pr2serr.h"
+
+#define UEVENT_BUFFER_SIZE 8192
+
+static const char *bus_scsi_devs = "/bus/scsi/devices";
+
+static unsigned int
+name_hash( const char *s )
+{
+  unsigned int  h = 5381;
+
+  while( *s )
+    h = h * 33 + ( unsigned char ) *s++;
+  return h % REG_BUCKETS;
+}
+
+void
+registry_init( struct passport_registry *reg )
+{
+  memset( reg, 0, sizeof( *reg ) );
+  reg->nl_fd = -1;
+}
+
+struct passport_entry *
+registry_lookup( struct passport_registry *reg, const char *hctl )
+{
+  struct passport_entry *ent;
+
+  for( ent = reg->by_hctl[name_hash( hctl )]; ent; ent = ent->next )
+    if( 0 == strcmp( ent->hctl, hctl ) )
+      return ent;
+  return NULL;
+}
+
+struct passport_entry *
+registry_lookup_node( struct passport_registry *reg, const char *block_node )
+{
+  struct passport_entry *ent;
+
+  for( ent = reg->by_node[name_hash( block_node )]; ent;
+      ent = ent->next_node )
+    if( 0 == strcmp( ent->block_node, block_node ) )
+      return ent;
+  return NULL;
+}
+
+static void
+unlink_node( struct passport_registry *reg, struct passport_entry *ent )
+{
+  struct passport_entry **pp;
+
+  if( !ent->block_node[0] )
+    return;
+  for( pp = &reg->by_node[name_hash( ent->block_node )]; *pp;
+      pp = &( *pp )->next_node )
+  {
+    if( *pp == ent )
+    {
+      *pp = ent->next_node;
+      break;
+    }
+  }
+  ent->block_node[0] = '\0';
+}
+
+static void
+set_block_node( struct passport_registry *reg, struct passport_entry *ent,
+    const char *node )
+{
+  unsigned int  h;
+
+  unlink_node( reg, ent );
+  if( !node[0] )
+    return;
+  snprintf( ent->block_node, sizeof( ent->block_node ), "%s", node );
+  h = name_hash( ent->block_node );
+  ent->next_node = reg->by_node[h];
+  reg->by_node[h] = ent;
+}
+
+static struct passport_entry *
+registry_add( struct passport_registry *reg, const char *hctl,
+    const char *lu_path )
+{
+  struct passport_entry *ent;
+  unsigned int  h;
+
+  if( ( ent = registry_lookup( reg, hctl ) ) )
+    return ent;
+  if( NULL == ( ent = calloc( 1, sizeof( *ent ) ) ) )
+    return NULL;
+  strncpy( ent->hctl, hctl, sizeof( ent->hctl ) - 1 );
+  strncpy( ent->sysfs_path, lu_path, sizeof( ent->sysfs_path ) - 1 );
+  ent->security = -1;
+  h = name_hash( hctl );
+  ent->next = reg->by_hctl[h];
+  reg->by_hctl[h] = ent;
+  reg->count++;
+  return ent;
+}
+
+static void
+registry_remove( struct passport_registry *reg, struct passport_entry *ent )
+{
+  struct passport_entry **pp;
+
+  unlink_node( reg, ent );
+  for( pp = &reg->by_hctl[name_hash( ent->hctl )]; *pp; pp = &( *pp )->next )
+  {
+    if( *pp == ent )
+    {
+      *pp = ent->next;
+      reg->count--;
+      break;
+    }
+  }
+  free( ent );
+}
+
+void
+registry_free( struct passport_registry *reg )
+{
+  struct passport_entry *ent, *next;
+  int           k;
+
+  for( k = 0; k < REG_BUCKETS; k++ )
+  {
+    for( ent = reg->by_hctl[k]; ent; ent = next )
+    {
+      next = ent->next;
+      free( ent );
+    }
+  }
+  if( reg->nl_fd >= 0 )
+    close( reg->nl_fd );
+  registry_init( reg );
+}
+
+/* Brings the registry in line with /sys/bus/scsi/devices and reports
+ * every difference to fn: new LUs, changed device nodes and, after the
+ * entries are marked by this scan, the ones that are gone. Only the LU
+ * directories themselves are visited, device nodes are derived from
+ * their block and scsi_generic children. Returns the number of entries. */
+static int
+registry_sync( struct passport_registry *reg, hotplug_fn fn, void *arg )
+{
+  char          b[PATH_MAX], lu_path[PATH_MAX], node[64], sg_node[64];
+  struct passport_entry *ent, *next;
+  enum hotplug_event ev;
+  struct dirent *dep;
+  DIR          *dirp;
+  int           k;
+
+  snprintf( b, sizeof( b ), "%s%s", get_sysfsroot(  ), bus_scsi_devs );
+  if( NULL == ( dirp = opendir( b ) ) )
+    return reg->count;
+  reg->scan++;
+  while( ( dep = readdir( dirp ) ) )
+  {
+    if( NULL == strchr( dep->d_name, ':' ) )	/* hosts and targets */
+      continue;
+    snprintf( b, sizeof( b ), "%s%s/%s", get_sysfsroot(  ), bus_scsi_devs,
+	dep->d_name );
+    if( NULL == realpath( b, lu_path ) || !sysfs_is_passport( lu_path ) )
+      continue;
+    ev = ( ent = registry_lookup( reg, dep->d_name ) ) ? HOTPLUG_CHANGE :
+	HOTPLUG_ADD;
+    if( NULL == ( ent = registry_add( reg, dep->d_name, lu_path ) ) )
+      continue;
+    ent->scan = reg->scan;
+    sysfs_child_node( lu_path, "block", node, sizeof( node ) );
+    sysfs_child_node( lu_path, "scsi_generic", sg_node, sizeof( sg_node ) );
+    if( ev == HOTPLUG_CHANGE && 0 == strcmp( node, ent->block_node ) &&
+	0 == strcmp( sg_node, ent->sg_node ) )
+      continue;
+    set_block_node( reg, ent, node );
+    snprintf( ent->sg_node, sizeof( ent->sg_node ), "%s", sg_node );
+    if( fn )
+      fn( reg, ent, ev, arg );
+  }
+  closedir( dirp );
+  for( k = 0; k < REG_BUCKETS; k++ )
+  {
+    for( ent = reg->by_hctl[k]; ent; ent = next )
+    {
+      next = ent->next;
+      if( ent->scan == reg->scan )
+	continue;
+      if( fn )
+	fn( reg, ent, HOTPLUG_REMOVE, arg );
+      registry_remove( reg, ent );
+    }
+  }
+  return reg->count;
+}
+
+/* Fills the registry from /sys/bus/scsi/devices. Returns the number of
+ * entries. */
+int
+registry_scan( struct passport_registry *reg )
+{
+  return registry_sync( reg, NULL, NULL );
+}
+
+/* Subscribes to kernel uevents. Returns 0 on success, -1 on error. */
+int
+hotplug_open( struct passport_registry *reg )
+{
+  struct sockaddr_nl addr;
+  int           rcvbuf = 1024 * 1024;
+
+  reg->nl_fd = socket( AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC |
+      SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT );
+  if( reg->nl_fd < 0 )
+  {
+    pr2serr( "uevent socket: %s\n", strerror( errno ) );
+    return -1;
+  }
+  setsockopt( reg->nl_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof( rcvbuf ) );
+  memset( &addr, 0, sizeof( addr ) );
+  addr.nl_family = AF_NETLINK;
+  addr.nl_groups = 1;		/* kernel events */
+  if( bind( reg->nl_fd, ( struct sockaddr * ) &addr, sizeof( addr ) ) < 0 )
+  {
+    pr2serr( "uevent bind: %s\n", strerror( errno ) );
+    close( reg->nl_fd );
+    reg->nl_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+/* Splits DEVPATH into the LU path and its SCSI address. 'child' is the
+ * class directory below the LU ("block", "scsi_generic") or NULL when
+ * devpath is the LU itself. */
+static bool
+devpath_to_lu( const char *devpath, const char *child, char *lu_path,
+    int max_len, char *hctl, int hctl_len )
+{
+  char          pat[32];
+  const char   *end, *start;
+
+  if( child )
+  {
+    snprintf( pat, sizeof( pat ), "/%s/", child );
+    if( NULL == ( end = strstr( devpath, pat ) ) )
+      return false;
+  }
+  else
+    end = devpath + strlen( devpath );
+  for( start = end; start > devpath && start[-1] != '/'; start-- )
+    ;
+  if( end - start >= hctl_len || NULL == memchr( start, ':', end - start ) )
+    return false;
+  memcpy( hctl, start, end - start );
+  hctl[end - start] = '\0';
+  snprintf( lu_path, max_len, "%s%.*s", get_sysfsroot(  ),
+      ( int ) ( end - devpath ), devpath );
+  return true;
+}
+
+static void
+handle_uevent( struct passport_registry *reg, char *msg, int len,
+    hotplug_fn fn, void *arg )
+{
+  const char   *action = NULL, *devpath = NULL, *subsystem = NULL;
+  const char   *devtype = "", *devname = NULL, *child;
+  char          lu_path[PATH_MAX], hctl[32], node[64];
+  struct passport_entry *ent;
+  enum hotplug_event ev = HOTPLUG_CHANGE;
+  char         *p;
+
+  for( p = msg + strlen( msg ) + 1; p < msg + len; p += strlen( p ) + 1 )
+  {
+    if( 0 == strncmp( p, "ACTION=", 7 ) )
+      action = p + 7;
+    else if( 0 == strncmp( p, "DEVPATH=", 8 ) )
+      devpath = p + 8;
+    else if( 0 == strncmp( p, "SUBSYSTEM=", 10 ) )
+      subsystem = p + 10;
+    else if( 0 == strncmp( p, "DEVTYPE=", 8 ) )
+      devtype = p + 8;
+    else if( 0 == strncmp( p, "DEVNAME=", 8 ) )
+      devname = p + 8;
+  }
+  if( !action || !devpath || !subsystem )
+    return;
+  if( 0 == strcmp( subsystem, "scsi" ) &&
+      0 == strcmp( devtype, "scsi_device" ) )
+    child = NULL;
+  else if( 0 == strcmp( subsystem, "block" ) &&
+      0 == strcmp( devtype, "disk" ) )
+    child = "block";
+  else if( 0 == strcmp( subsystem, "scsi_generic" ) )
+    child = "scsi_generic";
+  else
+    return;
+  if( !devpath_to_lu( devpath, child, lu_path, sizeof( lu_path ), hctl,
+	  sizeof( hctl ) ) )
+    return;
+  ent = registry_lookup( reg, hctl );
+
+  if( 0 == strcmp( action, "add" ) )
+  {
+    if( ent == NULL )
+    {
+      if( !sysfs_is_passport( lu_path ) ||
+	  NULL == ( ent = registry_add( reg, hctl, lu_path ) ) )
+	return;
+      ent->scan = reg->scan;
+      ev = HOTPLUG_ADD;
+    }
+    if( child && devname )
+    {
+      snprintf( node, sizeof( node ), "%s/%s", get_dev_dir(  ), devname );
+      if( 'b' == child[0] )
+	set_block_node( reg, ent, node );
+      else
+	snprintf( ent->sg_node, sizeof( ent->sg_node ), "%s", node );
+    }
+  }
+  else if( 0 == strcmp( action, "remove" ) )
+  {
+    if( ent == NULL )
+      return;
+    if( child == NULL )
+      ev = HOTPLUG_REMOVE;
+    else if( 'b' == child[0] )
+    {
+      unlink_node( reg, ent );
+      ent->security = -1;
+    }
+    else
+      ent->sg_node[0] = '\0';
+  }
+  else if( ent == NULL )
+    return;
+  if( fn )
+    fn( reg, ent, ev, arg );
+  if( ev == HOTPLUG_REMOVE )
+    registry_remove( reg, ent );
+}
+
+/* Applies every pending uevent to the registry and reports each change
+ * to fn. Returns the number of events read or -1 on error. */
+int
+hotplug_process( struct passport_registry *reg, hotplug_fn fn, void *arg )
+{
+  char          buf[UEVENT_BUFFER_SIZE];
+  struct sockaddr_nl from;
+  socklen_t     from_len;
+  int           len, n = 0;
+
+  while( 1 )
+  {
+    from_len = sizeof( from );
+    len = recvfrom( reg->nl_fd, buf, sizeof( buf ) - 1, 0,
+	( struct sockaddr * ) &from, &from_len );
+    if( len < 0 )
+    {
+      if( EINTR == errno )
+	continue;
+      if( EAGAIN == errno )
+	return n;
+      if( ENOBUFS == errno )	/* overrun, events were lost */
+      {
+	pr2serr( "uevent queue overrun, rescanning\n" );
+	registry_sync( reg, fn, arg );
+	continue;
+      }
+      pr2serr( "uevent recv: %s\n", strerror( errno ) );
+      return -1;
+    }
+    buf[len] = '\0';
+    /* only the kernel (port 0) is trusted, any process can send to the
+     * group */
+    if( from_len != sizeof( from ) || from.nl_pid != 0 ||
+	NULL == memchr( buf, '@', len ) )
+      continue;
+    handle_uevent( reg, buf, len, fn, arg );
+    n++;
+  }
+}
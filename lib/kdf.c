@@ -0,0 +1,663 @@
+/* Password hashing of the WD encryption API: SHA-256 over the UCS-2 salt
+ * and password, then over the previous digest for the remaining
+ * iterations. A batch of passwords is spread over threads, and each thread
+ * runs its chains on the SIMD lanes of sha256_iterate_many().
+ * Optionally scrypt instead, with its parameters kept in handy block 1. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "sha256.h"
+#include "kdf.h"
+
+#define KDF_MAX_THREADS 64
+/* fewer chains per thread would leave AVX-512 lanes idle */
+#define KDF_MIN_PER_THREAD SHA256_MAX_LANES
+
+struct kdf_slice
+{
+  struct kdf_job *jobs;
+  int           njobs;
+};
+
+/* First round: the UCS-2 salt followed by the password as UCS-2 */
+static void
+kdf_first_round( const uint8_t *salt, const char *password, uint8_t *digest )
+{
+  uint8_t       salt_passwd[KDF_SALT_SIZE + 2 * KDF_MAX_PASSWD + 2];
+  int           i;
+
+  memset( salt_passwd, 0, sizeof( salt_passwd ) );
+  memcpy( salt_passwd, salt, KDF_SALT_SIZE );
+  for( i = 0; i < KDF_MAX_PASSWD; i++ )
+  {
+    if( password[i] < ' ' )
+      break;
+    salt_passwd[KDF_SALT_SIZE + 2 * i] = password[i];
+  }
+  sha256hash( salt_passwd, KDF_SALT_SIZE + 2 * i, digest );
+  memset( salt_passwd, 0, sizeof( salt_passwd ) );
+}
+
+/* 'salt' is the 8 byte UCS-2 salt of handy store block 1. Returns digest,
+ * all zero if iterations is not positive. */
+uint8_t      *
+kdf_hash_password( const uint8_t *salt, const char *password, int iterations,
+    uint8_t *digest )
+{
+  memset( digest, 0, KDF_DIGEST_SIZE );
+  if( iterations > 0 )
+  {
+    kdf_first_round( salt, password, digest );
+    sha256_iterate( digest, iterations - 1 );
+  }
+  return digest;
+}
+
+static void  *
+kdf_slice_worker( void *arg )
+{
+  struct kdf_slice *slice = arg;
+  struct kdf_job *job;
+  unsigned long *iterations;
+  uint8_t      *digests;
+  int           k;
+
+  digests = malloc( slice->njobs * KDF_DIGEST_SIZE );
+  iterations = malloc( slice->njobs * sizeof( *iterations ) );
+  if( digests == NULL || iterations == NULL )
+  {
+    for( k = 0; k < slice->njobs; k++ )
+    {
+      job = &slice->jobs[k];
+      kdf_hash_password( job->salt, job->password, job->iterations,
+          job->digest );
+    }
+    free( digests );
+    free( iterations );
+    return NULL;
+  }
+
+  for( k = 0; k < slice->njobs; k++ )
+  {
+    job = &slice->jobs[k];
+    memset( digests + k * KDF_DIGEST_SIZE, 0, KDF_DIGEST_SIZE );
+    iterations[k] = 0;
+    if( job->iterations > 0 )
+    {
+      kdf_first_round( job->salt, job->password,
+          digests + k * KDF_DIGEST_SIZE );
+      iterations[k] = job->iterations - 1;
+    }
+  }
+  sha256_iterate_many( digests, iterations, slice->njobs );
+  for( k = 0; k < slice->njobs; k++ )
+    memcpy( slice->jobs[k].digest, digests + k * KDF_DIGEST_SIZE,
+        KDF_DIGEST_SIZE );
+
+  memset( digests, 0, slice->njobs * KDF_DIGEST_SIZE );
+  free( digests );
+  free( iterations );
+  return NULL;
+}
+
+/* Derive the digest of every job, same as kdf_hash_password() on each. */
+void
+kdf_hash_passwords( struct kdf_job *jobs, int njobs )
+{
+  struct kdf_slice slices[KDF_MAX_THREADS];
+  pthread_t     tids[KDF_MAX_THREADS];
+  long          ncpu = sysconf( _SC_NPROCESSORS_ONLN );
+  int           nthreads, k, first, started[KDF_MAX_THREADS];
+
+  if( njobs <= 0 )
+    return;
+  nthreads = ( njobs + KDF_MIN_PER_THREAD - 1 ) / KDF_MIN_PER_THREAD;
+  if( nthreads > ncpu )
+    nthreads = ncpu;
+  if( nthreads > KDF_MAX_THREADS )
+    nthreads = KDF_MAX_THREADS;
+  if( nthreads < 1 )
+    nthreads = 1;
+
+  for( k = 0, first = 0; k < nthreads; k++ )
+  {
+    slices[k].jobs = jobs + first;
+    slices[k].njobs = njobs / nthreads + ( k < njobs % nthreads );
+    first += slices[k].njobs;
+  }
+  /* slice 0 runs on the calling thread, as do slices whose thread
+   * could not be started */
+  for( k = 1; k < nthreads; k++ )
+    started[k] = !pthread_create( &tids[k], NULL, kdf_slice_worker,
+        &slices[k] );
+  kdf_slice_worker( &slices[0] );
+  for( k = 1; k < nthreads; k++ )
+  {
+    if( started[k] )
+      pthread_join( tids[k], NULL );
+    else
+      kdf_slice_worker( &slices[k] );
+  }
+}
+
+/* HMAC-SHA256 (RFC 2104) */
+struct hmac_sha256
+{
+  struct sha256_state inner, outer;
+};
+
+static void
+hmac_sha256_init( struct hmac_sha256 *h, const uint8_t *key, size_t len )
+{
+  uint8_t       pad[SHA256_BLOCK_SIZE], khash[SHA256_DIGEST_SIZE];
+  int           i;
+
+  if( len > SHA256_BLOCK_SIZE )
+  {
+    sha256hash( key, len, khash );
+    key = khash;
+    len = SHA256_DIGEST_SIZE;
+  }
+  memset( pad, 0x36, sizeof( pad ) );
+  for( i = 0; i < len; i++ )
+    pad[i] ^= key[i];
+  sha256_init( &h->inner );
+  sha256_update( &h->inner, pad, SHA256_BLOCK_SIZE );
+  for( i = 0; i < SHA256_BLOCK_SIZE; i++ )
+    pad[i] ^= 0x36 ^ 0x5c;
+  sha256_init( &h->outer );
+  sha256_update( &h->outer, pad, SHA256_BLOCK_SIZE );
+  memset( pad, 0, sizeof( pad ) );
+  memset( khash, 0, sizeof( khash ) );
+}
+
+static void
+hmac_sha256_final( struct hmac_sha256 *h, uint8_t *out )
+{
+  uint8_t       ihash[SHA256_DIGEST_SIZE];
+
+  sha256_final( &h->inner, ihash );
+  sha256_update( &h->outer, ihash, SHA256_DIGEST_SIZE );
+  sha256_final( &h->outer, out );
+  memset( ihash, 0, sizeof( ihash ) );
+}
+
+/* PBKDF2-HMAC-SHA256 with one iteration, all scrypt needs */
+static void
+pbkdf2_sha256_1( const uint8_t *passwd, size_t passwd_len,
+    const uint8_t *salt, size_t salt_len, uint8_t *out, size_t out_len )
+{
+  struct hmac_sha256 base, h;
+  uint8_t       ctr[4], t[SHA256_DIGEST_SIZE];
+  uint32_t      i;
+  size_t        n;
+
+  hmac_sha256_init( &base, passwd, passwd_len );
+  sha256_update( &base.inner, salt, salt_len );
+  for( i = 1; out_len; i++ )
+  {
+    h = base;
+    ctr[0] = i >> 24;
+    ctr[1] = i >> 16;
+    ctr[2] = i >> 8;
+    ctr[3] = i;
+    sha256_update( &h.inner, ctr, 4 );
+    hmac_sha256_final( &h, t );
+    n = out_len < SHA256_DIGEST_SIZE ? out_len : SHA256_DIGEST_SIZE;
+    memcpy( out, t, n );
+    out += n;
+    out_len -= n;
+  }
+  memset( &base, 0, sizeof( base ) );
+  memset( &h, 0, sizeof( h ) );
+  memset( t, 0, sizeof( t ) );
+}
+
+#define R32(a, b) ( ( (a) << (b) ) | ( (a) >> ( 32 - (b) ) ) )
+
+/* Salsa20/8 core on 16 little endian words, result xored into B */
+static void
+salsa20_8( uint32_t B[16] )
+{
+  uint32_t      x[16];
+  int           i;
+
+  memcpy( x, B, sizeof( x ) );
+  for( i = 0; i < 8; i += 2 )
+  {
+    x[4] ^= R32( x[0] + x[12], 7 );
+    x[8] ^= R32( x[4] + x[0], 9 );
+    x[12] ^= R32( x[8] + x[4], 13 );
+    x[0] ^= R32( x[12] + x[8], 18 );
+    x[9] ^= R32( x[5] + x[1], 7 );
+    x[13] ^= R32( x[9] + x[5], 9 );
+    x[1] ^= R32( x[13] + x[9], 13 );
+    x[5] ^= R32( x[1] + x[13], 18 );
+    x[14] ^= R32( x[10] + x[6], 7 );
+    x[2] ^= R32( x[14] + x[10], 9 );
+    x[6] ^= R32( x[2] + x[14], 13 );
+    x[10] ^= R32( x[6] + x[2], 18 );
+    x[3] ^= R32( x[15] + x[11], 7 );
+    x[7] ^= R32( x[3] + x[15], 9 );
+    x[11] ^= R32( x[7] + x[3], 13 );
+    x[15] ^= R32( x[11] + x[7], 18 );
+    x[1] ^= R32( x[0] + x[3], 7 );
+    x[2] ^= R32( x[1] + x[0], 9 );
+    x[3] ^= R32( x[2] + x[1], 13 );
+    x[0] ^= R32( x[3] + x[2], 18 );
+    x[6] ^= R32( x[5] + x[4], 7 );
+    x[7] ^= R32( x[6] + x[5], 9 );
+    x[4] ^= R32( x[7] + x[6], 13 );
+    x[5] ^= R32( x[4] + x[7], 18 );
+    x[11] ^= R32( x[10] + x[9], 7 );
+    x[8] ^= R32( x[11] + x[10], 9 );
+    x[9] ^= R32( x[8] + x[11], 13 );
+    x[10] ^= R32( x[9] + x[8], 18 );
+    x[12] ^= R32( x[15] + x[14], 7 );
+    x[13] ^= R32( x[12] + x[15], 9 );
+    x[14] ^= R32( x[13] + x[12], 13 );
+    x[15] ^= R32( x[14] + x[13], 18 );
+  }
+  for( i = 0; i < 16; i++ )
+    B[i] += x[i];
+}
+
+/* scryptBlockMix: B (2r blocks of 16 words) -> Y, even blocks first */
+static void
+blockmix_salsa8( const uint32_t *B, uint32_t *Y, unsigned int r )
+{
+  uint32_t      X[16];
+  unsigned int  i, k;
+
+  memcpy( X, &B[( 2 * r - 1 ) * 16], sizeof( X ) );
+  for( i = 0; i < 2 * r; i++ )
+  {
+    for( k = 0; k < 16; k++ )
+      X[k] ^= B[i * 16 + k];
+    salsa20_8( X );
+    memcpy( &Y[( ( i & 1 ) * r + i / 2 ) * 16], X, sizeof( X ) );
+  }
+}
+
+/* scryptROMix on one lane of 128 * r bytes, V holding N * 32 * r words.
+ * Returns 0 or -1, the lane left unmixed, if memory is short. */
+static int
+romix( uint8_t *lane, unsigned int r, uint64_t N, uint32_t *V )
+{
+  size_t        words = 32 * r;
+  uint32_t     *X, *Y;
+  uint64_t      i, j;
+  size_t        k;
+
+  X = malloc( 2 * words * sizeof( uint32_t ) );
+  if( X == NULL )
+    return -1;
+  Y = X + words;
+  for( k = 0; k < words; k++ )
+    X[k] = lane[4 * k] | lane[4 * k + 1] << 8 | lane[4 * k + 2] << 16 |
+        ( uint32_t ) lane[4 * k + 3] << 24;
+  for( i = 0; i < N; i += 2 )
+  {
+    memcpy( &V[i * words], X, words * sizeof( uint32_t ) );
+    blockmix_salsa8( X, Y, r );
+    memcpy( &V[( i + 1 ) * words], Y, words * sizeof( uint32_t ) );
+    blockmix_salsa8( Y, X, r );
+  }
+  for( i = 0; i < N; i += 2 )
+  {
+    j = X[( 2 * r - 1 ) * 16] & ( N - 1 );
+    for( k = 0; k < words; k++ )
+      X[k] ^= V[j * words + k];
+    blockmix_salsa8( X, Y, r );
+    j = Y[( 2 * r - 1 ) * 16] & ( N - 1 );
+    for( k = 0; k < words; k++ )
+      Y[k] ^= V[j * words + k];
+    blockmix_salsa8( Y, X, r );
+  }
+  for( k = 0; k < words; k++ )
+  {
+    lane[4 * k] = X[k];
+    lane[4 * k + 1] = X[k] >> 8;
+    lane[4 * k + 2] = X[k] >> 16;
+    lane[4 * k + 3] = X[k] >> 24;
+  }
+  memset( X, 0, 2 * words * sizeof( uint32_t ) );
+  free( X );
+  return 0;
+}
+
+/* Concurrent scrypt derivations, e.g. with --all or from the async
+ * callbacks, share a budget of the memory free at the first one: a
+ * derivation waits until its ROMix arrays fit, and runs alone if they
+ * are larger than the whole budget. */
+static struct
+{
+  pthread_once_t once;
+  pthread_mutex_t lock;
+  pthread_cond_t freed;
+  uint64_t      avail;		/* bytes not held by a derivation */
+  uint64_t      budget;
+} scrypt_mem = { PTHREAD_ONCE_INIT, PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER, 0, 0 };
+
+static void
+scrypt_mem_init( void )
+{
+  long          pages = sysconf( _SC_AVPHYS_PAGES );
+  long          page_size = sysconf( _SC_PAGESIZE );
+
+  if( pages > 0 && page_size > 0 )
+    scrypt_mem.budget = ( uint64_t ) pages * page_size;
+  else
+    scrypt_mem.budget = ( uint64_t ) 1 << 30;
+  scrypt_mem.avail = scrypt_mem.budget;
+}
+
+/* Takes size bytes of the budget, waiting for other derivations to free
+ * them. Returns what was taken, to be given back by scrypt_mem_put(). */
+static uint64_t
+scrypt_mem_get( uint64_t size )
+{
+  pthread_once( &scrypt_mem.once, scrypt_mem_init );
+  if( size > scrypt_mem.budget )
+    size = scrypt_mem.budget;
+  pthread_mutex_lock( &scrypt_mem.lock );
+  while( scrypt_mem.avail < size )
+    pthread_cond_wait( &scrypt_mem.freed, &scrypt_mem.lock );
+  scrypt_mem.avail -= size;
+  pthread_mutex_unlock( &scrypt_mem.lock );
+  return size;
+}
+
+static void
+scrypt_mem_put( uint64_t size )
+{
+  pthread_mutex_lock( &scrypt_mem.lock );
+  scrypt_mem.avail += size;
+  pthread_cond_broadcast( &scrypt_mem.freed );
+  pthread_mutex_unlock( &scrypt_mem.lock );
+}
+
+struct scrypt_lane
+{
+  uint8_t      *lane;
+  unsigned int  r;
+  uint64_t      N;
+  int           ret;
+};
+
+static void  *
+scrypt_lane_worker( void *arg )
+{
+  struct scrypt_lane *sl = arg;
+  size_t        vsize = ( size_t ) sl->N * 128 * sl->r;
+  uint32_t     *V = malloc( vsize );
+
+  sl->ret = -1;
+  if( V == NULL )
+    return NULL;
+  sl->ret = romix( sl->lane, sl->r, sl->N, V );
+  free( V );
+  return NULL;
+}
+
+/* scrypt (RFC 7914) with each of the p lanes of ROMix on its own thread.
+ * Needs p * 128 * r * 2^log2_n bytes, taken from the shared budget first.
+ * Returns 0 or -1 if the parameters are out of range or memory is short. */
+int
+kdf_scrypt( const uint8_t *passwd, size_t passwd_len, const uint8_t *salt,
+    size_t salt_len, unsigned int log2_n, unsigned int r, unsigned int p,
+    uint8_t *out, size_t out_len )
+{
+  struct scrypt_lane lanes[255];
+  pthread_t     tids[255];
+  bool          started[255];
+  uint8_t      *B;
+  size_t        lane_size = 128 * r;
+  uint64_t      mem;
+  unsigned int  k;
+  int           ret = 0;
+
+  if( log2_n < 1 || log2_n > 30 || r < 1 || r > 255 || p < 1 || p > 255 )
+    return -1;
+  /* V and the two X blocks of every lane, and B */
+  mem = scrypt_mem_get( ( uint64_t ) p * ( ( lane_size << log2_n ) +
+          3 * lane_size ) );
+  B = malloc( p * lane_size );
+  if( B == NULL )
+  {
+    scrypt_mem_put( mem );
+    return -1;
+  }
+  pbkdf2_sha256_1( passwd, passwd_len, salt, salt_len, B, p * lane_size );
+  for( k = 0; k < p; k++ )
+  {
+    lanes[k].lane = B + k * lane_size;
+    lanes[k].r = r;
+    lanes[k].N = ( uint64_t ) 1 << log2_n;
+    started[k] = k > 0 && !pthread_create( &tids[k], NULL,
+        scrypt_lane_worker, &lanes[k] );
+  }
+  scrypt_lane_worker( &lanes[0] );
+  for( k = 1; k < p; k++ )
+  {
+    if( started[k] )
+      pthread_join( tids[k], NULL );
+    else
+      scrypt_lane_worker( &lanes[k] );
+  }
+  for( k = 0; k < p; k++ )
+    ret |= lanes[k].ret;
+  if( ret == 0 )
+    pbkdf2_sha256_1( passwd, passwd_len, B, p * lane_size, out, out_len );
+  memset( B, 0, p * lane_size );
+  free( B );
+  scrypt_mem_put( mem );
+  return ret;
+}
+
+/* Reads the KDF of the security block 'block1' (already checked) */
+void
+kdf_params_read( const uint8_t *block1, struct kdf_params *kp )
+{
+  const uint8_t *rec = block1 + KDF_PARAMS_OFFSET;
+
+  memset( kp, 0, sizeof( *kp ) );
+  kp->algo = KDF_WD;
+  kp->iterations = ( uint32_t ) block1[8] << 24 | block1[9] << 16 |
+      block1[10] << 8 | block1[11];
+  memcpy( kp->wd_salt, block1 + 12, KDF_SALT_SIZE );
+  if( memcmp( rec, KDF_PARAMS_MAGIC, 4 ) || rec[4] != KDF_SCRYPT )
+    return;
+  kp->algo = KDF_SCRYPT;
+  kp->log2_n = rec[5];
+  kp->r = rec[6];
+  kp->p = rec[7];
+  memcpy( kp->salt, rec + 8, KDF_SCRYPT_SALT );
+}
+
+/* Stores the WD iteration count and the KDF record in 'block1', or clears
+ * the record for the WD scheme. The WD salt is left alone; the caller
+ * fixes the checksum. */
+void
+kdf_params_write( const struct kdf_params *kp, uint8_t *block1 )
+{
+  uint8_t      *rec = block1 + KDF_PARAMS_OFFSET;
+
+  block1[8] = kp->iterations >> 24;
+  block1[9] = kp->iterations >> 16;
+  block1[10] = kp->iterations >> 8;
+  block1[11] = kp->iterations;
+  memset( rec, 0, KDF_PARAMS_SIZE );
+  if( kp->algo != KDF_SCRYPT )
+    return;
+  memcpy( rec, KDF_PARAMS_MAGIC, 4 );
+  rec[4] = KDF_SCRYPT;
+  rec[5] = kp->log2_n;
+  rec[6] = kp->r;
+  rec[7] = kp->p;
+  memcpy( rec + 8, kp->salt, KDF_SCRYPT_SALT );
+}
+
+/* Parses "wd" or "scrypt[,LOG2N[,R[,P]]]" into kp. Returns 0 or -1. */
+int
+kdf_params_parse( const char *arg, struct kdf_params *kp )
+{
+  unsigned int  log2_n = KDF_SCRYPT_LOG2N, r = KDF_SCRYPT_R;
+  unsigned int  p = KDF_SCRYPT_P;
+
+  memset( kp, 0, sizeof( *kp ) );
+  if( 0 == strcmp( arg, "wd" ) )
+  {
+    kp->algo = KDF_WD;
+    return 0;
+  }
+  if( strncmp( arg, "scrypt", 6 ) || ( arg[6] && arg[6] != ',' ) )
+    return -1;
+  if( arg[6] && sscanf( arg + 7, "%u,%u,%u", &log2_n, &r, &p ) < 1 )
+    return -1;
+  if( log2_n < 10 || log2_n > 24 || r < 1 || r > 32 || p < 1 || p > 16 )
+    return -1;
+  /* at most 1 GiB per lane */
+  if( ( ( uint64_t ) 128 * r << log2_n ) > ( ( uint64_t ) 1 << 30 ) )
+    return -1;
+  kp->algo = KDF_SCRYPT;
+  kp->log2_n = log2_n;
+  kp->r = r;
+  kp->p = p;
+  return 0;
+}
+
+/* Fresh random scrypt salt. Returns 0 or -1. */
+int
+kdf_params_new_salt( struct kdf_params *kp )
+{
+  int           frnd = open( "/dev/urandom", O_RDONLY );
+  int           ret = -1;
+
+  if( frnd < 0 )
+    return -1;
+  if( read( frnd, kp->salt, KDF_SCRYPT_SALT ) == KDF_SCRYPT_SALT )
+    ret = 0;
+  close( frnd );
+  return ret;
+}
+
+const char   *
+kdf_params_str( const struct kdf_params *kp, char *buf, int len )
+{
+  if( kp->algo == KDF_SCRYPT )
+    snprintf( buf, len, "scrypt N=2^%u r=%u p=%u (%u MiB)", kp->log2_n,
+        kp->r, kp->p,
+        ( unsigned int ) ( ( ( uint64_t ) kp->p * 128 * kp->r <<
+                kp->log2_n ) >> 20 ) );
+  else
+    snprintf( buf, len, "WD SHA-256 %u iterations", kp->iterations );
+  return buf;
+}
+
+static uint64_t
+kdf_clock_ns( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( uint64_t ) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Time of one derivation with kp on this host, 0 on error */
+uint64_t
+kdf_time_ns( const struct kdf_params *kp )
+{
+  uint8_t       digest[KDF_DIGEST_SIZE];
+  uint64_t      t0 = kdf_clock_ns(  );
+
+  if( kdf_derive( kp, "calibration", digest ) == NULL )
+    return 0;
+  return kdf_clock_ns(  ) - t0;
+}
+
+/* Sets the work factor of kp, the WD iteration count or scrypt's N, to the
+ * largest value whose derivation takes at most target_ms here. The cost
+ * is linear in either, so it is measured on a fraction of the target and
+ * scaled; the time so expected is stored in *ns unless NULL. Returns 0 or
+ * -1. */
+int
+kdf_calibrate( struct kdf_params *kp, unsigned int target_ms,
+    uint64_t *ns )
+{
+  uint64_t      target = ( uint64_t ) target_ms * 1000000, t;
+  uint64_t      iterations, trial;
+  unsigned int  log2_n;
+
+  if( kp->algo == KDF_SCRYPT )
+  {
+    /* time a small N, then double it while the estimate fits */
+    kp->log2_n = 12;
+    if( ( t = kdf_time_ns( kp ) ) == 0 )
+      return -1;
+    for( log2_n = 12; t > target && log2_n > 10; log2_n-- )
+      t /= 2;
+    while( t * 2 <= target && log2_n < 24 &&
+        ( ( uint64_t ) 128 * kp->r << ( log2_n + 1 ) ) <=
+        ( ( uint64_t ) 1 << 30 ) )
+    {
+      t *= 2;
+      log2_n++;
+    }
+    kp->log2_n = log2_n;
+    if( ns )
+      *ns = t;
+    return 0;
+  }
+
+  /* grow a trial run until it is long enough to time reliably */
+  for( iterations = 1024; ; iterations *= 4 )
+  {
+    kp->iterations = iterations;
+    t = kdf_time_ns( kp );
+    if( t > target / 8 || t > 50000000 || iterations >= 1 << 28 )
+      break;
+  }
+  if( t == 0 )
+    t = 1;
+  /* 2% headroom for noise, and at least the WD minimum of one round */
+  trial = iterations;
+  iterations = iterations * target / t * 98 / 100;
+  if( iterations < 1 )
+    iterations = 1;
+  if( iterations > INT_MAX )
+    iterations = INT_MAX;
+  kp->iterations = iterations;
+  if( ns )
+    *ns = t * iterations / trial;
+  return 0;
+}
+
+/* Derives the password blob the drive expects. Returns digest or NULL. */
+uint8_t      *
+kdf_derive( const struct kdf_params *kp, const char *password,
+    uint8_t *digest )
+{
+  int           len;
+
+  if( kp->algo == KDF_WD )
+    return kdf_hash_password( kp->wd_salt, password, kp->iterations,
+        digest );
+  for( len = 0; len < KDF_MAX_PASSWD && password[len] >= ' '; len++ )
+    ;
+  if( kdf_scrypt( ( const uint8_t * ) password, len, kp->salt,
+          KDF_SCRYPT_SALT, kp->log2_n, kp->r, kp->p, digest,
+          KDF_DIGEST_SIZE ) )
+    return NULL;
+  return digest;
+}
@@ -12,11 +12,14 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <time.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>
 
 #include "sg_unaligned.h"
+#include "lsscsi.h"
 
 #define FT_OTHER 0
 #define FT_BLOCK 1
@@ -59,27 +62,22 @@ struct addr_hctl
 
 struct addr_hctl filter;
 
-/* Device node list: contains the information needed to match a node with a
- * sysfs class device. */
-#define DEV_NODE_LIST_ENTRIES 16
+/* Device node index: maps major/minor/type to the newest node in /dev.
+ * Only built when the sysfs DEVNAME lookup cannot resolve a node. */
+#define DEV_INDEX_BUCKETS 1024
 enum dev_type
 { BLK_DEV, CHR_DEV };
 
 struct dev_node_entry
 {
+  struct dev_node_entry *next;
   unsigned int  maj, min;
   enum dev_type type;
   time_t        mtime;
-  char          name[LMAX_DEVPATH];
+  char          name[];
 };
 
-struct dev_node_list
-{
-  struct dev_node_list *next;
-  unsigned int  count;
-  struct dev_node_entry nodes[DEV_NODE_LIST_ENTRIES];
-};
-static struct dev_node_list *dev_node_listhead = NULL;
+static struct dev_node_entry **dev_index = NULL;
 
 struct item_t
 {
@@ -88,8 +86,13 @@ struct item_t
   int           d_type;
 };
 
-static struct item_t non_sg;
-static struct item_t aa_first;
+typedef bool  ( *item_select_fn ) ( const struct dirent *, struct item_t * );
+
+/* Below this many LUs the per-device scan stays on the calling thread */
+#define PARALLEL_SCAN_MIN 16
+#define MAX_SCAN_THREADS 16
+
+static pthread_mutex_t dev_index_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Returns true if dirent entry is either a symlink or a directory
  * starting_with given name. If starting_with is NULL choose all that are
@@ -134,205 +137,141 @@ enum string_size_units
   STRING_UNITS_2,               /* use binary powers of 2^10 */
 };
 
-/* Return 1 for directory entry that is link or directory (other than
- * a directory name starting with dot). Else return 0.	*/
-static int
-first_dir_scan_select( const struct dirent *s )
+/* Accept the first directory entry that is a link or directory. */
+static bool
+first_dir_select( const struct dirent *s, struct item_t *it )
 {
-  if( FT_OTHER != aa_first.ft )
-    return 0;
   if( !dir_or_link( s, NULL ) )
-    return 0;
-  strncpy( aa_first.name, s->d_name, LMAX_NAME );
-  aa_first.ft = FT_CHAR;        /* dummy */
-  aa_first.d_type = s->d_type;
-  return 1;
-}
-
-typedef int   ( *dirent_select_fn ) ( const struct dirent * );
-
-/* scan for directory entry that is either a symlink or a directory. Returns
- * number found or -1 for error. */
-static int
-scan_for_first( const char *dir_name )
-{
-  int           num, k;
-  struct dirent **namelist;
-
-  aa_first.ft = FT_OTHER;
-  num = scandir( dir_name, &namelist, first_dir_scan_select, NULL );
-  if( num < 0 )
-  {
-    return -1;
-  }
-  for( k = 0; k < num; ++k )
-    free( namelist[k] );
-  free( namelist );
-  return num;
+    return false;
+  snprintf( it->name, sizeof( it->name ), "%s", s->d_name );
+  it->ft = FT_CHAR;             /* dummy */
+  it->d_type = s->d_type;
+  return true;
 }
 
-static int
-non_sg_dir_scan_select( const struct dirent *s )
+/* Accept the class device entry (block, tape, changer) of a LU. */
+static bool
+non_sg_select( const struct dirent *s, struct item_t *it )
 {
-  int           len;
+  int           len, ft = FT_OTHER;
 
-  if( FT_OTHER != non_sg.ft )
-    return 0;
   if( !dir_or_link( s, NULL ) )
-    return 0;
+    return false;
   if( 0 == strncmp( "scsi_changer", s->d_name, 12 ) )
-  {
-    strncpy( non_sg.name, s->d_name, LMAX_NAME );
-    non_sg.ft = FT_CHAR;
-    non_sg.d_type = s->d_type;
-    return 1;
-  }
+    ft = FT_CHAR;
   else if( 0 == strncmp( "block", s->d_name, 5 ) )
-  {
-    strncpy( non_sg.name, s->d_name, LMAX_NAME );
-    non_sg.ft = FT_BLOCK;
-    non_sg.d_type = s->d_type;
-    return 1;
-  }
+    ft = FT_BLOCK;
   else if( 0 == strcmp( "tape", s->d_name ) )
-  {
-    strncpy( non_sg.name, s->d_name, LMAX_NAME );
-    non_sg.ft = FT_CHAR;
-    non_sg.d_type = s->d_type;
-    return 1;
-  }
+    ft = FT_CHAR;
   else if( 0 == strncmp( "scsi_tape:st", s->d_name, 12 ) )
   {
     len = strlen( s->d_name );
+    /* want 'st<num>' symlink only */
     if( isdigit( s->d_name[len - 1] ) )
-    {
-      /* want 'st<num>' symlink only */
-      strncpy( non_sg.name, s->d_name, LMAX_NAME );
-      non_sg.ft = FT_CHAR;
-      non_sg.d_type = s->d_type;
-      return 1;
-    }
-    else
-      return 0;
+      ft = FT_CHAR;
   }
   else if( 0 == strncmp( "onstream_tape:os", s->d_name, 16 ) )
-  {
-    strncpy( non_sg.name, s->d_name, LMAX_NAME );
-    non_sg.ft = FT_CHAR;
-    non_sg.d_type = s->d_type;
-    return 1;
-  }
-  else
-    return 0;
+    ft = FT_CHAR;
+  if( FT_OTHER == ft )
+    return false;
+  snprintf( it->name, sizeof( it->name ), "%s", s->d_name );
+  it->ft = ft;
+  it->d_type = s->d_type;
+  return true;
 }
 
-/* Returns number found or -1 for error */
-static int
-non_sg_scan( const char *dir_name )
+/* Scan the directory open at 'dfd' in readdir order and store the first
+ * entry accepted by 'select' in 'it'. 'dfd' stays open. Returns true if an
+ * entry was found. */
+static bool
+scan_dir_at( int dfd, item_select_fn select, struct item_t *it )
 {
-  int           num, k;
-  struct dirent **namelist;
+  struct dirent *dep;
+  DIR          *dirp;
+  int           fd;
+  bool          found = false;
 
-  non_sg.ft = FT_OTHER;
-  num = scandir( dir_name, &namelist, non_sg_dir_scan_select, NULL );
-  if( num < 0 )
+  /* fdopendir() takes over the descriptor, so give it its own */
+  if( ( fd = openat( dfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC ) ) < 0 )
+    return false;
+  if( NULL == ( dirp = fdopendir( fd ) ) )
   {
-    return -1;
+    close( fd );
+    return false;
   }
-  for( k = 0; k < num; ++k )
-    free( namelist[k] );
-  free( namelist );
-  return num;
+  while( !found && ( dep = readdir( dirp ) ) )
+    found = select( dep, it );
+  closedir( dirp );
+  return found;
 }
 
-/* If 'dir_name'/'base_name' is a directory chdir to it. If that is successful
-   return true, else false */
-static bool
-if_directory_chdir( const char *dir_name, const char *base_name )
+/* Open 'name' below the directory 'dfd' as a directory. */
+static int
+open_dir_at( int dfd, const char *name )
 {
-  char          b[2*LMAX_PATH];
-  struct stat   a_stat;
-
-  snprintf( b, sizeof( b ), "%s/%s", dir_name, base_name );
-  if( stat( b, &a_stat ) < 0 )
-    return false;
-  if( S_ISDIR( a_stat.st_mode ) )
-  {
-    if( chdir( b ) < 0 )
-      return false;
-    return true;
-  }
-  return false;
+  return openat( dfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
 }
 
-/* If 'dir_name'/'base_name' is found places corresponding value in 'value'
- * and returns true . Else returns false.
+/* If 'base_name' below the directory 'dfd' is found places the first line
+ * of it in 'value' and returns true . Else returns false.
  */
 static bool
-get_value( const char *dir_name, const char *base_name, char *value,
+get_value_at( int dfd, const char *base_name, char *value,
     int max_value_len )
 {
-  int           len;
-  FILE         *f;
-  char          b[LMAX_PATH];
+  int           fd;
+  ssize_t       len;
+  char         *nl;
 
-  snprintf( b, sizeof( b ), "%s/%s", dir_name, base_name );
-  if( NULL == ( f = fopen( b, "r" ) ) )
-  {
+  if( ( fd = openat( dfd, base_name, O_RDONLY | O_CLOEXEC ) ) < 0 )
     return false;
-  }
-  if( NULL == fgets( value, max_value_len, f ) )
-  {
-    /* assume empty */
-    value[0] = '\0';
-    fclose( f );
-    return true;
-  }
-  len = strlen( value );
-  if( ( len > 0 ) && ( value[len - 1] == '\n' ) )
-    value[len - 1] = '\0';
-  fclose( f );
+  len = read( fd, value, max_value_len - 1 );
+  close( fd );
+  if( len < 0 )
+    return false;
+  value[len] = '\0';
+  if( ( nl = strchr( value, '\n' ) ) )
+    *nl = '\0';
   return true;
 }
 
-/* Allocate dev_node_list and collect info on every char and block devices
- * in /dev but not its subdirectories. This list excludes symlinks, even if
- * they are to devices. */
-static void
-collect_dev_nodes( void )
+static unsigned int
+dev_index_hash( unsigned int maj, unsigned int min, enum dev_type type )
+{
+  return ( ( maj * 31 + min ) * 2 + type ) % DEV_INDEX_BUCKETS;
+}
+
+/* Build the hashed index of every char and block device in 'dir' but not
+ * its subdirectories. Symlinks are excluded, even if they are to devices.
+ * Returns the number of nodes indexed or -1 on error. */
+int
+dev_index_build( const char *dir )
 {
-  size_t        dnl_sz = sizeof( struct dev_node_list );
   struct dirent *dep;
   DIR          *dirp;
-  struct dev_node_list *cur_list, *prev_list;
-  struct dev_node_entry *cur_ent;
+  struct dev_node_entry *ent;
   char          device_path[LMAX_DEVPATH];
   struct stat   stats;
+  unsigned int  h;
+  int           count = 0;
 
-  if( dev_node_listhead )
-    return;                     /* already collected nodes */
-
-  dev_node_listhead = ( struct dev_node_list * ) calloc( 1, dnl_sz );
-  if( !dev_node_listhead )
-    return;
-
-  cur_list = dev_node_listhead;
-  cur_list->next = NULL;
-  cur_list->count = 0;
+  dev_index_free(  );
+  dev_index = calloc( DEV_INDEX_BUCKETS, sizeof( *dev_index ) );
+  if( !dev_index )
+    return -1;
 
-  dirp = opendir( dev_dir );
+  dirp = opendir( dir );
   if( dirp == NULL )
-    return;
-
-  while( 1 )
   {
-    dep = readdir( dirp );
-    if( dep == NULL )
-      break;
+    /* leave no empty index behind: get_dev_node() only builds it once */
+    dev_index_free(  );
+    return -1;
+  }
 
+  while( ( dep = readdir( dirp ) ) )
+  {
     snprintf( device_path, sizeof( device_path ), "%s/%s",
-        dev_dir, dep->d_name );
-    /* device_path[LMAX_PATH] = '\0'; */
+        dir, dep->d_name );
 
     /* This will bypass all symlinks in /dev */
     if( lstat( device_path, &stats ) )
@@ -342,115 +281,146 @@ collect_dev_nodes( void )
     if( ( !S_ISBLK( stats.st_mode ) ) && ( !S_ISCHR( stats.st_mode ) ) )
       continue;
 
-    /* Add to the list. */
-    if( cur_list->count >= DEV_NODE_LIST_ENTRIES )
-    {
-      prev_list = cur_list;
-      cur_list = ( struct dev_node_list * ) calloc( 1, dnl_sz );
-      if( !cur_list )
-        break;
-      prev_list->next = cur_list;
-      cur_list->next = NULL;
-      cur_list->count = 0;
-    }
-
-    cur_ent = &cur_list->nodes[cur_list->count];
-    cur_ent->maj = major( stats.st_rdev );
-    cur_ent->min = minor( stats.st_rdev );
-    if( S_ISBLK( stats.st_mode ) )
-      cur_ent->type = BLK_DEV;
-    else if( S_ISCHR( stats.st_mode ) )
-      cur_ent->type = CHR_DEV;
-    cur_ent->mtime = stats.st_mtime;
-    strncpy( cur_ent->name, device_path, sizeof( cur_ent->name ) );
-
-    cur_list->count++;
+    ent = malloc( sizeof( *ent ) + strlen( device_path ) + 1 );
+    if( !ent )
+      break;
+    ent->maj = major( stats.st_rdev );
+    ent->min = minor( stats.st_rdev );
+    ent->type = S_ISBLK( stats.st_mode ) ? BLK_DEV : CHR_DEV;
+    ent->mtime = stats.st_mtime;
+    strcpy( ent->name, device_path );
+    h = dev_index_hash( ent->maj, ent->min, ent->type );
+    ent->next = dev_index[h];
+    dev_index[h] = ent;
+    count++;
   }
   closedir( dirp );
+  return count;
 }
 
-/* Free dev_node_list. */
-static void
-free_dev_node_list( void )
+/* Free the device node index. */
+void
+dev_index_free( void )
 {
-  if( dev_node_listhead )
-  {
-    struct dev_node_list *cur_list, *next_list;
+  struct dev_node_entry *ent, *next;
+  int           k;
 
-    cur_list = dev_node_listhead;
-    while( cur_list )
+  if( dev_index == NULL )
+    return;
+  for( k = 0; k < DEV_INDEX_BUCKETS; k++ )
+  {
+    for( ent = dev_index[k]; ent; ent = next )
     {
-      next_list = cur_list->next;
-      free( cur_list );
-      cur_list = next_list;
+      next = ent->next;
+      free( ent );
     }
-
-    dev_node_listhead = NULL;
   }
+  free( dev_index );
+  dev_index = NULL;
 }
 
-/* Given a path to a class device, find the most recent device node with
- * matching major/minor and type. Outputs to node which is assumed to be at
- * least LMAX_NAME bytes long. Returns true if match found, false
- * otherwise. */
-static bool
-get_dev_node( const char *wd, char *node, enum dev_type type )
+/* Find the most recent indexed node with matching major/minor and type.
+ * Returns true if one was found. */
+bool
+dev_index_lookup( unsigned int maj, unsigned int min, bool block, char *node,
+    int max_len )
 {
   bool          match_found = false;
-  unsigned int  k = 0;
-  unsigned int  maj, min;
   time_t        newest_mtime = 0;
-  struct dev_node_entry *cur_ent;
-  struct dev_node_list *cur_list;
-  char          value[LMAX_NAME];
-
-  /* assume 'node' is at least 2 bytes long */
-  memcpy( node, "-", 2 );
-  if( dev_node_listhead == NULL )
-  {
-    collect_dev_nodes(  );
-    if( dev_node_listhead == NULL )
-      goto exit;
-  }
+  enum dev_type type = block ? BLK_DEV : CHR_DEV;
+  struct dev_node_entry *ent;
 
-  /* Get the major/minor for this device. */
-  if( !get_value( wd, "dev", value, LMAX_NAME ) )
-    goto exit;
-  sscanf( value, "%u:%u", &maj, &min );
-
-  /* Search the node list for the newest match on this major/minor. */
-  cur_list = dev_node_listhead;
-
-  while( 1 )
+  if( dev_index == NULL )
+    return false;
+  for( ent = dev_index[dev_index_hash( maj, min, type )]; ent;
+      ent = ent->next )
   {
-    if( k >= cur_list->count )
-    {
-      cur_list = cur_list->next;
-      if( !cur_list )
-        break;
-      k = 0;
-    }
-
-    cur_ent = &cur_list->nodes[k];
-    k++;
-
-    if( ( maj == cur_ent->maj ) &&
-        ( min == cur_ent->min ) && ( type == cur_ent->type ) )
+    if( ( maj == ent->maj ) && ( min == ent->min ) && ( type == ent->type ) )
     {
       if( ( !match_found ) ||
-          ( difftime( cur_ent->mtime, newest_mtime ) > 0 ) )
+          ( difftime( ent->mtime, newest_mtime ) > 0 ) )
       {
-        newest_mtime = cur_ent->mtime;
-        strncpy( node, cur_ent->name, LMAX_NAME - 1 );
+        newest_mtime = ent->mtime;
+        snprintf( node, max_len, "%s", ent->name );
       }
       match_found = true;
     }
   }
-
-exit:
   return match_found;
 }
 
+/* Resolve major/minor through /sys/dev/{block,char}/MAJ:MIN/uevent, whose
+ * DEVNAME gives the node name below /dev. The node is checked to really
+ * be that device. Returns true on success. */
+bool
+sysfs_dev_node( unsigned int maj, unsigned int min, bool block, char *node,
+    int max_len )
+{
+  char          path[LMAX_PATH];
+  char          line[LMAX_NAME + 8];
+  struct stat   stats;
+  FILE         *f;
+  int           len;
+  bool          found = false;
+
+  snprintf( path, sizeof( path ), "%s/dev/%s/%u:%u/uevent", sysfsroot,
+      block ? "block" : "char", maj, min );
+  if( NULL == ( f = fopen( path, "r" ) ) )
+    return false;
+  while( fgets( line, sizeof( line ), f ) )
+  {
+    if( strncmp( line, "DEVNAME=", 8 ) )
+      continue;
+    len = strlen( line );
+    if( ( len > 0 ) && ( line[len - 1] == '\n' ) )
+      line[len - 1] = '\0';
+    snprintf( path, sizeof( path ), "%s/%s", dev_dir, line + 8 );
+    found = true;
+    break;
+  }
+  fclose( f );
+  if( !found || stat( path, &stats ) )
+    return false;
+  if( block ? !S_ISBLK( stats.st_mode ) : !S_ISCHR( stats.st_mode ) )
+    return false;
+  if( major( stats.st_rdev ) != maj || minor( stats.st_rdev ) != min )
+    return false;
+  snprintf( node, max_len, "%s", path );
+  return true;
+}
+
+
+/* Given the directory of a class device open at 'dfd', find the device
+ * node with matching major/minor and type. Outputs to node which is assumed
+ * to be at least LMAX_NAME bytes long. Returns true if match found, false
+ * otherwise. */
+static bool
+get_dev_node( int dfd, char *node, enum dev_type type )
+{
+  unsigned int  maj, min;
+  char          value[LMAX_NAME];
+  bool          found = false;
+
+  /* assume 'node' is at least 2 bytes long */
+  memcpy( node, "-", 2 );
+
+  /* Get the major/minor for this device. */
+  if( !get_value_at( dfd, "dev", value, LMAX_NAME ) )
+    return false;
+  if( 2 != sscanf( value, "%u:%u", &maj, &min ) )
+    return false;
+
+  if( sysfs_dev_node( maj, min, BLK_DEV == type, node, LMAX_NAME ) )
+    return true;
+  /* no DEVNAME (or udev renamed the node): fall back to the /dev index,
+   * which is shared by the scan threads */
+  pthread_mutex_lock( &dev_index_lock );
+  if( dev_index != NULL || dev_index_build( dev_dir ) >= 0 )
+    found = dev_index_lookup( maj, min, BLK_DEV == type, node, LMAX_NAME );
+  pthread_mutex_unlock( &dev_index_lock );
+  return found;
+}
+
 /* Return true for direct access, cd/dvd, rbc and host managed zbc */
 static inline bool
 is_direct_access_dev( int pdt )
@@ -459,95 +429,311 @@ is_direct_access_dev( int pdt )
       ( 0x14 == pdt ) );
 }
 
-/* List one SCSI device (LU) */
-static char *
-one_sdev_entry( const char *dir_name, const char *devname )
+/* True if the LU directory open at 'lu_fd' is a WD Passport: vendor "WD",
+ * model containing "Passport" */
+static bool
+is_passport_at( int lu_fd )
 {
-  int           vlen;
-  char          buff[LMAX_DEVPATH];
-  char          extra[LMAX_DEVPATH];
   char          value[LMAX_NAME];
-  char          wd[LMAX_PATH];
-  static char   dev_node[LMAX_NAME] = "";
-  enum dev_type typ;
 
-  vlen = sizeof( value );
-  snprintf( buff, sizeof( buff ), "%s/%s", dir_name, devname );
-  if( !get_value( buff, "vendor", value, vlen ) )
-    return NULL;
-  if( strncmp( value, "WD", 2 ) )
-    return NULL;
-  if( !get_value( buff, "model", value, vlen ) )
-    return NULL;
-  if( strstr( value, "Passport" ) == NULL )
-    return NULL;
+  if( !get_value_at( lu_fd, "vendor", value, sizeof( value ) ) ||
+      strncmp( value, "WD", 2 ) )
+    return false;
+  return get_value_at( lu_fd, "model", value, sizeof( value ) ) &&
+      strstr( value, "Passport" ) != NULL;
+}
 
-  if( 1 != non_sg_scan( buff ) )
-    return NULL;
+/* Check one SCSI device (LU) below the directory 'scsi_dfd'. If it is a WD
+ * Passport its device node is stored in 'dev_node' (LMAX_NAME bytes) and
+ * true is returned. Only touches its own descriptors and buffers so it can
+ * run on several threads at once. */
+static bool
+one_sdev_entry( int scsi_dfd, const char *devname, char *dev_node )
+{
+  struct item_t non_sg, first;
+  int           lu_fd, cls_fd, base_fd = -1;
+  bool          found = false;
+
+  if( ( lu_fd = open_dir_at( scsi_dfd, devname ) ) < 0 )
+    return false;
+  if( !is_passport_at( lu_fd ) )
+    goto out;
+
+  if( !scan_dir_at( lu_fd, non_sg_select, &non_sg ) )
+    goto out;
   if( DT_DIR == non_sg.d_type )
   {
-    snprintf( wd, sizeof( wd ), "%s/%s", buff, non_sg.name );
-    if( 1 == scan_for_first( wd ) )
-      strncpy( extra, aa_first.name, sizeof( extra ) );
-    else
-      return NULL;
+    if( ( base_fd = open_dir_at( lu_fd, non_sg.name ) ) < 0 )
+      goto out;
+    if( !scan_dir_at( base_fd, first_dir_select, &first ) )
+      goto out;
+    cls_fd = open_dir_at( base_fd, first.name );
   }
   else
+    cls_fd = open_dir_at( lu_fd, non_sg.name );
+  if( cls_fd >= 0 )
   {
-    strncpy( wd, buff, sizeof( wd ) );
-    strncpy( extra, non_sg.name, sizeof( extra ) );
+    found = get_dev_node( cls_fd, dev_node,
+        ( FT_BLOCK == non_sg.ft ) ? BLK_DEV : CHR_DEV );
+    close( cls_fd );
   }
-  if( ( if_directory_chdir( wd, extra ) ) )
+  else                          /* not a directory: look where we are */
+    found = get_dev_node( base_fd >= 0 ? base_fd : lu_fd, dev_node,
+        ( FT_BLOCK == non_sg.ft ) ? BLK_DEV : CHR_DEV );
+out:
+  if( base_fd >= 0 )
+    close( base_fd );
+  close( lu_fd );
+  return found;
+}
+
+struct sdev_scan
+{
+  int           dfd;            /* sysfs bus/scsi/devices */
+  struct dirent **namelist;
+  char        **nodes;          /* per LU result, NULL if not a Passport */
+  int           num;
+  int           next;           /* next LU to check, taken atomically */
+};
+
+static void  *
+sdev_scan_worker( void *arg )
+{
+  struct sdev_scan *scan = arg;
+  char          dev_node[LMAX_NAME];
+  int           k;
+
+  while( ( k = __atomic_fetch_add( &scan->next, 1, __ATOMIC_RELAXED ) ) <
+      scan->num )
   {
-    if( NULL == getcwd( wd, sizeof( wd ) ) )
-      return NULL;
+    if( '.' == scan->namelist[k]->d_name[0] )
+      continue;
+    if( one_sdev_entry( scan->dfd, scan->namelist[k]->d_name, dev_node ) )
+      scan->nodes[k] = strdup( dev_node );
   }
-  typ = ( FT_BLOCK == non_sg.ft ) ? BLK_DEV : CHR_DEV;
-  if( !get_dev_node( wd, dev_node, typ ) )
-    return NULL;
-  return dev_node;
+  return NULL;
 }
 
-/* List SCSI devices (LUs). */
-static char  *
-list_sdevices( void )
+/* Check every LU of the scan, on a few threads when there are many. The
+ * calling thread always takes part, so a failed pthread_create() only
+ * costs parallelism. */
+static void
+sdev_scan_parallel( struct sdev_scan *scan )
 {
-  int           num, k, blen, nlen;
-  struct dirent **namelist;
-  char          buff[LMAX_DEVPATH];
-  char          name[LMAX_NAME];
-  char         *wd_pass_dev = NULL;
+  pthread_t     tids[MAX_SCAN_THREADS];
+  long          ncpu = sysconf( _SC_NPROCESSORS_ONLN );
+  int           nthreads, k, started = 0;
+
+  nthreads = scan->num / ( PARALLEL_SCAN_MIN / 2 );
+  if( nthreads > ncpu )
+    nthreads = ncpu;
+  if( nthreads > MAX_SCAN_THREADS )
+    nthreads = MAX_SCAN_THREADS;
+  for( k = 1; k < nthreads; k++ )
+    if( 0 == pthread_create( &tids[started], NULL, sdev_scan_worker, scan ) )
+      started++;
+  sdev_scan_worker( scan );
+  for( k = 0; k < started; k++ )
+    pthread_join( tids[k], NULL );
+}
 
-  blen = sizeof( buff );
-  nlen = sizeof( name );
-  snprintf( buff, blen, "%s%s", sysfsroot, bus_scsi_devs );
+/* List SCSI devices (LUs). Appends the device node of every WD Passport
+ * to *devs (grown as needed) and returns how many were found. If
+ * first_only is set the scan stops at the first match. */
+static int
+list_sdevices( char ***devs, bool first_only )
+{
+  struct sdev_scan scan = { 0 };
+  char          buff[LMAX_DEVPATH];
+  char          dev_node[LMAX_NAME];
+  char        **tmp;
+  int           k, ndevs = 0;
 
-  num = scandir( buff, &namelist, NULL, NULL );
-  if( num < 0 )
+  snprintf( buff, sizeof( buff ), "%s%s", sysfsroot, bus_scsi_devs );
+  if( ( scan.dfd = open_dir_at( AT_FDCWD, buff ) ) < 0 )
   {                             /* scsi mid level may not be loaded */
-    return NULL;
+    return 0;
+  }
+  scan.num = scandirat( scan.dfd, ".", &scan.namelist, NULL, NULL );
+  if( scan.num < 0 )
+  {
+    close( scan.dfd );
+    return 0;
   }
+  scan.nodes = calloc( scan.num ? scan.num : 1, sizeof( char * ) );
+  if( scan.nodes == NULL )
+    scan.num = 0;
 
-  for( k = 0; k < num; ++k )
+  if( first_only )
   {
-    strncpy( name, namelist[k]->d_name, nlen );
-    if( wd_pass_dev == NULL )
-      wd_pass_dev = one_sdev_entry( buff, name );
-    free( namelist[k] );
+    for( k = 0; k < scan.num; k++ )
+    {
+      if( '.' != scan.namelist[k]->d_name[0] &&
+          one_sdev_entry( scan.dfd, scan.namelist[k]->d_name, dev_node ) )
+      {
+        scan.nodes[k] = strdup( dev_node );
+        break;
+      }
+    }
   }
-  free( namelist );
-  return wd_pass_dev;
+  else if( scan.num < PARALLEL_SCAN_MIN )
+    sdev_scan_worker( &scan );
+  else
+    sdev_scan_parallel( &scan );
+
+  /* collect in directory order, as a sequential scan would */
+  for( k = 0; k < scan.num; k++ )
+  {
+    if( scan.nodes[k] )
+    {
+      tmp = realloc( *devs, ( ndevs + 2 ) * sizeof( char * ) );
+      if( tmp )
+      {
+        *devs = tmp;
+        tmp[ndevs++] = scan.nodes[k];
+        tmp[ndevs] = NULL;
+      }
+      else
+        free( scan.nodes[k] );
+    }
+    free( scan.namelist[k] );
+  }
+  free( scan.nodes );
+  free( scan.namelist );
+  close( scan.dfd );
+  return ndevs;
+}
+
+/* Returns the number of WD Passport devices found and stores a NULL
+ * terminated array of their device nodes in *devices. Release it with
+ * free_passport_devices(). */
+int
+find_passport_devices( char ***devices )
+{
+  int           ndevs;
+
+  *devices = NULL;
+  ndevs = list_sdevices( devices, false );
+  dev_index_free(  );
+  return ndevs;
+}
+
+void
+free_passport_devices( char **devices )
+{
+  char        **d;
+
+  if( devices == NULL )
+    return;
+  for( d = devices; *d; d++ )
+    free( *d );
+  free( devices );
 }
 
 char         *
 find_passport_device( void )
 {
-  char         path[1024];
-  char         *wd_pass_dev;
+  static char   dev_node[LMAX_NAME];
+  char        **devs = NULL;
+
+  list_sdevices( &devs, true );
+  dev_index_free(  );
+  if( devs == NULL )
+    return NULL;
+  strncpy( dev_node, devs[0], LMAX_NAME - 1 );
+  free_passport_devices( devs );
+  return dev_node;
+}
+
+/* Look for devices below 'root' instead of /sys, like lsscsi --sysfsroot.
+ * Mainly useful to run the discovery against a copy of a sysfs tree. */
+void
+set_sysfsroot( const char *root )
+{
+  sysfsroot = root;
+}
 
-  getcwd( path, 1024 );
-  wd_pass_dev = list_sdevices(  );
-  free_dev_node_list(  );
-  chdir( path );
-  return wd_pass_dev;
+/* The sysfs root and device directory the discovery uses, for the other
+ * sysfs walkers (the hotplug registry) to follow */
+const char   *
+get_sysfsroot( void )
+{
+  return sysfsroot;
+}
+
+const char   *
+get_dev_dir( void )
+{
+  return dev_dir;
+}
+
+/* Given a device node such as /dev/sdb, stores the node of the matching
+ * SCSI generic device (e.g. /dev/sg2) in sg_node. Returns true if the
+ * sg driver provides one. */
+bool
+find_sg_node( const char *dev_node, char *sg_node, int max_len )
+{
+  const char   *base = strrchr( dev_node, '/' );
+  char          buff[LMAX_PATH];
+  struct dirent *dep;
+  DIR          *dirp;
+  bool          found = false;
+
+  base = base ? base + 1 : dev_node;
+  snprintf( buff, sizeof( buff ), "%s/class/block/%s/device/scsi_generic",
+      sysfsroot, base );
+  if( NULL == ( dirp = opendir( buff ) ) )
+    return false;
+  while( ( dep = readdir( dirp ) ) )
+  {
+    if( '.' == dep->d_name[0] )
+      continue;
+    snprintf( sg_node, max_len, "%s/%s", dev_dir, dep->d_name );
+    found = true;
+    break;
+  }
+  closedir( dirp );
+  return found;
+}
+
+/* Same test as the device scan for the LU directory 'lu_path', e.g. a
+ * /sys/devices/... path taken from a uevent */
+bool
+sysfs_is_passport( const char *lu_path )
+{
+  int           lu_fd;
+  bool          found;
+
+  if( ( lu_fd = open( lu_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC ) ) < 0 )
+    return false;
+  found = is_passport_at( lu_fd );
+  close( lu_fd );
+  return found;
+}
+
+/* Stores /dev/<first entry of 'lu_path'/'sub'> in node, e.g. the block
+ * device for sub "block". Returns false, node empty, if there is none. */
+bool
+sysfs_child_node( const char *lu_path, const char *sub, char *node,
+    int max_len )
+{
+  struct item_t it;
+  int           lu_fd, sub_fd;
+  bool          found = false;
+
+  node[0] = '\0';
+  if( ( lu_fd = open( lu_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC ) ) < 0 )
+    return false;
+  if( ( sub_fd = open_dir_at( lu_fd, sub ) ) >= 0 )
+  {
+    if( scan_dir_at( sub_fd, first_dir_select, &it ) &&
+        strlen( dev_dir ) + strlen( it.name ) + 2 <= ( size_t ) max_len )
+    {
+      snprintf( node, max_len, "%s/%s", dev_dir, it.name );
+      found = true;
+    }
+    close( sub_fd );
+  }
+  close( lu_fd );
+  return found;
 }
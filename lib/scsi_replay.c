@@ -0,0 +1,513 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include "sg_lib.h"
+#include "sg_pt.h"
+#include "sg_pt_linux.h"
+#include "sg_pr2serr.h"
+#include "scsi_replay.h"
+
+extern struct switches
+{
+  unsigned int  verbose:3;
+} sw;
+
+/* The recording being written. Records of all threads go through one
+ * buffered stream, so the lock is held for a few memcpy()s per command. */
+static struct
+{
+  pthread_mutex_t lock;
+  FILE         *f;
+  const char   *path;
+  uint64_t      t0;
+  int           ndevices;
+} rec = { PTHREAD_MUTEX_INITIALIZER, NULL, NULL, 0, 0 };
+
+/* A device of the recording: its commands in the order they were issued */
+struct replay_device
+{
+  pthread_mutex_t lock;
+  char         *name;
+  const struct scsi_replay_rec **cmds;
+  unsigned int  ncmds;
+  unsigned int  alloc;
+  unsigned int  next;		/* first command not yet replayed */
+};
+
+/* One open session: the timerfd stands in for the sg file descriptor */
+struct replay_session
+{
+  struct replay_device *dev;
+  const struct scsi_replay_rec *cmd;	/* submitted, not yet received */
+};
+
+static struct
+{
+  uint8_t      *map;		/* the recording, mapped read only */
+  size_t        len;
+  bool          realtime;	/* take as long as the recorded command */
+  struct replay_device *devices;
+  int           ndevices;
+} replay;
+
+/* CDB bytes recorded and compared for the command in op->cdb */
+static int
+cdb_size( const uint8_t *cdb )
+{
+  int           len = sg_get_command_size( cdb[0] );
+
+  return len > CDB_LENGTH ? CDB_LENGTH : len;
+}
+
+/* Creates path (mode 0600, data-out may hold password blobs) and starts
+ * recording into it. Returns 0 or -1. */
+int
+scsi_record_open( const char *path )
+{
+  int           fd;
+
+  fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600 );
+  if( fd < 0 || NULL == ( rec.f = fdopen( fd, "w" ) ) )
+  {
+    pr2serr( "cannot write %s: %s\n", path, safe_strerror( errno ) );
+    if( fd >= 0 )
+      close( fd );
+    return -1;
+  }
+  setvbuf( rec.f, NULL, _IOFBF, 1 << 20 );
+  fwrite( SCSI_REPLAY_MAGIC, 1, sizeof( SCSI_REPLAY_MAGIC ) - 1, rec.f );
+  rec.path = path;
+  rec.t0 = scsi_clock_ns(  );
+  return 0;
+}
+
+void
+scsi_record_close( void )
+{
+  pthread_mutex_lock( &rec.lock );
+  if( rec.f && ( ferror( rec.f ) | fclose( rec.f ) ) )
+    pr2serr( "%s: write error, the recording is incomplete\n", rec.path );
+  rec.f = NULL;
+  pthread_mutex_unlock( &rec.lock );
+}
+
+/* Appends header r and its payload parts, padded to SCSI_REPLAY_ALIGN */
+static void
+record_write( struct scsi_replay_rec *r, const void *cdb, const void *sense,
+    const void *out, const void *in )
+{
+  static const uint8_t zeros[SCSI_REPLAY_ALIGN];
+  size_t        len;
+
+  len = sizeof( *r ) + r->cdb_len + r->sense_len + r->out_len + r->in_len;
+  r->size = ( len + SCSI_REPLAY_ALIGN - 1 ) & ~( SCSI_REPLAY_ALIGN - 1 );
+  fwrite( r, sizeof( *r ), 1, rec.f );
+  if( r->cdb_len )
+    fwrite( cdb, 1, r->cdb_len, rec.f );
+  if( r->sense_len )
+    fwrite( sense, 1, r->sense_len, rec.f );
+  if( r->out_len )
+    fwrite( out, 1, r->out_len, rec.f );
+  if( r->in_len )
+    fwrite( in, 1, r->in_len, rec.f );
+  fwrite( zeros, 1, r->size - len, rec.f );
+}
+
+/* Records the command of op, ret being what do_scsi_pt() returned, with
+ * everything the device sent back. A no-op unless recording. */
+void
+scsi_record_add( struct scsi_op_t *op, int ret )
+{
+  struct scsi_replay_rec r, name;
+  int           len;
+
+  if( rec.f == NULL )
+    return;
+  memset( &r, 0, sizeof( r ) );
+  r.type = SCSI_REPLAY_COMMAND;
+  r.dir_out = op->dir_inout;
+  r.cdb_len = cdb_size( op->cdb );
+  r.ret = ret;
+  r.data_len = op->data_len;
+  if( 0 == ret )
+  {
+    r.status = get_scsi_pt_status_response( op->ptvp );
+    r.transport_err = get_scsi_pt_transport_err( op->ptvp );
+    len = get_scsi_pt_sense_len( op->ptvp );
+    r.sense_len = len > SENSE_LENGTH ? SENSE_LENGTH : len;
+    r.resid = get_scsi_pt_resid( op->ptvp );
+    len = op->data_len - r.resid;
+    if( !op->dir_inout && len > 0 )
+      r.in_len = len > op->data_len ? op->data_len : len;
+  }
+  if( op->dir_inout )
+    r.out_len = op->data_len;
+  if( op->timing.submit_ns > rec.t0 )
+    r.submit_ns = op->timing.submit_ns - rec.t0;
+  r.xfer_ns = op->timing.xfer_ns;
+  r.device_ns = op->timing.device_ns;
+
+  pthread_mutex_lock( &rec.lock );
+  if( rec.f && 0 == op->record_dev && rec.ndevices < SCSI_REPLAY_MAX_DEVICES )
+  {
+    memset( &name, 0, sizeof( name ) );
+    name.type = SCSI_REPLAY_DEVICE;
+    name.device = rec.ndevices;
+    name.in_len = strlen( op->device_name );
+    record_write( &name, NULL, NULL, NULL, op->device_name );
+    op->record_dev = ++rec.ndevices;
+  }
+  if( rec.f && op->record_dev )
+  {
+    r.device = op->record_dev - 1;
+    record_write( &r, op->cdb, op->sense, op->cmdout, op->reply );
+  }
+  pthread_mutex_unlock( &rec.lock );
+}
+
+/* Index of the device of the recording called name, added if new; -1 if
+ * out of memory */
+static int
+replay_device_get( const char *name, size_t len )
+{
+  struct replay_device *d;
+  int           k;
+
+  for( k = 0; k < replay.ndevices; k++ )
+    if( strlen( replay.devices[k].name ) == len &&
+	0 == memcmp( replay.devices[k].name, name, len ) )
+      return k;
+  d = realloc( replay.devices, ( k + 1 ) * sizeof( *d ) );
+  if( d == NULL )
+    return -1;
+  replay.devices = d;
+  memset( &d[k], 0, sizeof( *d ) );
+  if( NULL == ( d[k].name = strndup( name, len ) ) )
+    return -1;
+  replay.ndevices++;
+  return k;
+}
+
+/* Indexes the records of the mapped recording. Returns 0, or -1 with the
+ * offset of the first bad record in *bad. */
+static int
+replay_index( size_t *bad )
+{
+  const struct scsi_replay_rec *r;
+  struct replay_device *d;
+  const struct scsi_replay_rec **cmds;
+  int          *index = NULL, *grown, k;
+  size_t        off = sizeof( SCSI_REPLAY_MAGIC ) - 1;
+  uint64_t      len;
+  int           nindex = 0, ret = -1;
+
+  while( off < replay.len )
+  {
+    *bad = off;
+    r = ( const struct scsi_replay_rec * ) ( replay.map + off );
+    if( replay.len - off < sizeof( *r ) || r->size % SCSI_REPLAY_ALIGN ||
+	r->size > replay.len - off )
+      goto out;
+    len = ( uint64_t ) sizeof( *r ) + r->cdb_len + r->sense_len +
+	r->out_len + r->in_len;
+    if( len > r->size )
+      goto out;
+    if( SCSI_REPLAY_DEVICE == r->type )
+    {
+      if( r->device != nindex || r->in_len == 0 )
+	goto out;
+      grown = realloc( index, ( nindex + 1 ) * sizeof( *index ) );
+      if( grown == NULL )
+	goto out;
+      index = grown;
+      /* a device may be named again by every session opened on it */
+      k = replay_device_get( ( const char * ) ( r + 1 ), r->in_len );
+      if( k < 0 )
+	goto out;
+      index[nindex++] = k;
+    }
+    else if( SCSI_REPLAY_COMMAND == r->type )
+    {
+      if( r->device >= nindex || r->cdb_len == 0 ||
+	  r->cdb_len > CDB_LENGTH || r->sense_len > SENSE_LENGTH )
+	goto out;
+      d = &replay.devices[index[r->device]];
+      if( d->ncmds == d->alloc )
+      {
+	d->alloc = d->alloc ? 2 * d->alloc : 16;
+	cmds = realloc( d->cmds, d->alloc * sizeof( *cmds ) );
+	if( cmds == NULL )
+	  goto out;
+	d->cmds = cmds;
+      }
+      d->cmds[d->ncmds++] = r;
+    }
+    else
+      goto out;
+    off += r->size;
+  }
+  ret = 0;
+out:
+  free( index );
+  return ret;
+}
+
+/* Loads the recording "FILE[,recorded]": commands complete at once, or
+ * after as long as they took when recorded. Returns 0 or -1. */
+int
+scsi_replay_load( const char *spec )
+{
+  struct stat   st;
+  char         *path, *comma;
+  size_t        bad = 0;
+  int           fd, k;
+
+  if( NULL == ( path = strdup( spec ) ) )
+    return -1;
+  comma = strrchr( path, ',' );
+  if( comma && 0 == strcmp( comma + 1, "recorded" ) )
+  {
+    *comma = '\0';
+    replay.realtime = true;
+  }
+  fd = open( path, O_RDONLY | O_CLOEXEC );
+  if( fd < 0 || fstat( fd, &st ) < 0 || st.st_size == 0 ||
+      MAP_FAILED == ( replay.map = mmap( NULL, st.st_size, PROT_READ,
+	      MAP_PRIVATE, fd, 0 ) ) )
+  {
+    pr2serr( "cannot read %s: %s\n", path,
+	st.st_size == 0 && fd >= 0 ? "empty file" : safe_strerror( errno ) );
+    replay.map = NULL;
+    if( fd >= 0 )
+      close( fd );
+    free( path );
+    return -1;
+  }
+  close( fd );
+  replay.len = st.st_size;
+  if( replay.len < sizeof( SCSI_REPLAY_MAGIC ) - 1 ||
+      memcmp( replay.map, SCSI_REPLAY_MAGIC,
+	  sizeof( SCSI_REPLAY_MAGIC ) - 1 ) )
+  {
+    pr2serr( "%s: not a recording of this host\n", path );
+    free( path );
+    return -1;
+  }
+  if( replay_index( &bad ) )
+  {
+    pr2serr( "%s: bad record at offset %zu\n", path, bad );
+    free( path );
+    return -1;
+  }
+  for( k = 0; k < replay.ndevices; k++ )
+    pthread_mutex_init( &replay.devices[k].lock, NULL );
+  free( path );
+  return 0;
+}
+
+bool
+scsi_replay_active( void )
+{
+  return replay.map != NULL;
+}
+
+/* Same contract as find_passport_devices() */
+int
+scsi_replay_devices( char ***devices )
+{
+  int           k;
+
+  *devices = calloc( replay.ndevices + 1, sizeof( char * ) );
+  if( *devices == NULL )
+    return 0;
+  for( k = 0; k < replay.ndevices; k++ )
+    if( NULL == ( ( *devices )[k] = strdup( replay.devices[k].name ) ) )
+      break;
+  return k;
+}
+
+/* Name of the index'th device of the recording, NULL past the last */
+char         *
+scsi_replay_device( int index )
+{
+  return index < replay.ndevices ? replay.devices[index].name : NULL;
+}
+
+int
+scsi_replay_open( struct scsi_op_t *op )
+{
+  struct replay_session *s;
+  int           k;
+
+  for( k = 0; k < replay.ndevices; k++ )
+    if( 0 == strcmp( replay.devices[k].name, op->device_name ) )
+      break;
+  if( k == replay.ndevices )
+  {
+    pr2serr( "%s: not in the recording\n", op->device_name );
+    return SG_LIB_CAT_OTHER;
+  }
+  if( NULL == ( s = calloc( 1, sizeof( *s ) ) ) )
+    return SG_LIB_CAT_OTHER;
+  s->dev = &replay.devices[k];
+  op->sg_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+  op->ptvp = construct_scsi_pt_obj_with_fd( -1, 0 );
+  if( op->sg_fd < 0 || op->ptvp == NULL )
+  {
+    pr2serr( "%s: cannot open: %s\n", op->device_name,
+        safe_strerror( errno ) );
+    if( op->ptvp )
+      destruct_scsi_pt_obj( op->ptvp );
+    if( op->sg_fd >= 0 )
+      close( op->sg_fd );
+    op->ptvp = NULL;
+    op->sg_fd = -1;
+    free( s );
+    return SG_LIB_CAT_OTHER;
+  }
+  op->replay = s;
+  return 0;
+}
+
+void
+scsi_replay_close( struct scsi_op_t *op )
+{
+  destruct_scsi_pt_obj( op->ptvp );
+  close( op->sg_fd );
+  free( op->replay );
+  op->replay = NULL;
+  op->ptvp = NULL;
+  op->sg_fd = -1;
+}
+
+/* Takes the next recorded command of the device of op; NULL if there is
+ * none left or the command in op->cdb is not the one recorded */
+static const struct scsi_replay_rec *
+replay_next( struct scsi_op_t *op )
+{
+  struct replay_device *d = ( ( struct replay_session * ) op->replay )->dev;
+  const struct scsi_replay_rec *r = NULL;
+  const uint8_t *out;
+  unsigned int  n;
+  int           cdb_len = cdb_size( op->cdb );
+
+  pthread_mutex_lock( &d->lock );
+  n = d->next;
+  if( n < d->ncmds )
+    r = d->cmds[d->next++];
+  pthread_mutex_unlock( &d->lock );
+  if( r == NULL )
+  {
+    pr2serr( "%s: no more commands in the recording\n", op->device_name );
+    return NULL;
+  }
+  if( r->cdb_len != cdb_len || memcmp( r + 1, op->cdb, cdb_len ) )
+  {
+    pr2serr( "%s: command %u differs from the recording\n",
+	op->device_name, n + 1 );
+    return NULL;
+  }
+  out = ( const uint8_t * ) ( r + 1 ) + r->cdb_len + r->sense_len;
+  if( sw.verbose && op->dir_inout && ( r->out_len != op->data_len ||
+	  memcmp( out, op->cmdout, r->out_len ) ) )
+    pr2serr( "%s: data-out of command %u differs from the recording\n",
+	op->device_name, n + 1 );
+  return r;
+}
+
+/* Hands what the device returned for r to op, as do_scsi_pt() would */
+static int
+replay_complete( struct scsi_op_t *op, const struct scsi_replay_rec *r )
+{
+  const uint8_t *p = ( const uint8_t * ) ( r + 1 ) + r->cdb_len;
+  int           len, resid = r->resid;
+
+  memcpy( op->sense, p, r->sense_len );
+  p += r->sense_len + r->out_len;
+  if( !op->dir_inout )
+  {
+    len = ( int ) r->in_len < op->data_len ? ( int ) r->in_len : op->data_len;
+    memcpy( op->reply, p, len );
+    resid = op->data_len - len;
+  }
+  set_scsi_pt_emulated( op->ptvp, r->status, r->transport_err, r->sense_len,
+      resid, r->ret < 0 ? -r->ret : 0, r->device_ns );
+  return r->ret;
+}
+
+int
+scsi_replay_xfer( struct scsi_op_t *op )
+{
+  const struct scsi_replay_rec *r = replay_next( op );
+  struct timespec ts;
+
+  if( r == NULL )
+    return SCSI_PT_DO_BAD_PARAMS;
+  if( replay.realtime )
+  {
+    ts.tv_sec = r->xfer_ns / 1000000000;
+    ts.tv_nsec = r->xfer_ns % 1000000000;
+    while( nanosleep( &ts, &ts ) < 0 && errno == EINTR )
+      ;
+  }
+  return replay_complete( op, r );
+}
+
+/* Fails the command with OS error err, kept in the pass-through object
+ * like do_scsi_pt() does so that scsi_xfer_complete() reports it */
+static int
+replay_os_error( struct scsi_op_t *op, int err )
+{
+  set_scsi_pt_emulated( op->ptvp, 0, 0, 0, op->data_len, err, 0 );
+  return -err;
+}
+
+/* The session's timerfd becomes readable once the command is due, and
+ * scsi_replay_receive() then completes it */
+int
+scsi_replay_submit( struct scsi_op_t *op )
+{
+  struct replay_session *s = op->replay;
+  struct itimerspec its;
+
+  if( NULL == ( s->cmd = replay_next( op ) ) )
+    return SCSI_PT_DO_BAD_PARAMS;
+  memset( &its, 0, sizeof( its ) );
+  if( replay.realtime )
+  {
+    its.it_value.tv_sec = s->cmd->xfer_ns / 1000000000;
+    its.it_value.tv_nsec = s->cmd->xfer_ns % 1000000000;
+  }
+  if( its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0 )
+    its.it_value.tv_nsec = 1;	/* zero would disarm the timer */
+  if( timerfd_settime( op->sg_fd, 0, &its, NULL ) < 0 )
+    return replay_os_error( op, errno );
+  return 0;
+}
+
+int
+scsi_replay_receive( struct scsi_op_t *op )
+{
+  struct replay_session *s = op->replay;
+  const struct scsi_replay_rec *r = s->cmd;
+  uint64_t      expirations;
+
+  if( read( op->sg_fd, &expirations, sizeof( expirations ) ) < 0 )
+    return errno == EAGAIN ? -EAGAIN : replay_os_error( op, errno );
+  s->cmd = NULL;
+  return replay_complete( op, r );
+}
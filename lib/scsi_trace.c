@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include "sg_lib.h"
+#include "sg_lib_data.h"
+#include "sg_pt.h"
+#include "sg_pt_linux.h"
+#include "scsi_trace.h"
+
+char         *sg_get_asc_ascq_str( int asc, int ascq, int buff_len,
+                                   char *buff );
+
+/* Writers claim a slot with one atomic add and publish it by storing its
+ * sequence number last; the slot's seq reads 0 while it is rewritten, so
+ * a dump can tell a torn record from a complete one. */
+static struct scsi_trace_rec trace_ring[SCSI_TRACE_RECORDS];
+static uint64_t trace_head;
+
+static const char *const trace_categories[] = {
+  "good", "status", "sense", "transport error", "os error", "not issued"
+};
+
+/* Records the outcome of the command of op. Called once per command, on
+ * the hot path, so it only copies what is needed for a later decode. */
+void
+scsi_trace_add( const struct scsi_op_t *op, int category, int status,
+    int result, int resid )
+{
+  struct scsi_trace_rec *rec;
+  struct sg_scsi_sense_hdr ssh;
+  uint64_t      seq;
+  int           len;
+
+  seq = __atomic_fetch_add( &trace_head, 1, __ATOMIC_RELAXED );
+  rec = &trace_ring[seq & ( SCSI_TRACE_RECORDS - 1 )];
+  __atomic_store_n( &rec->seq, 0, __ATOMIC_RELAXED );
+  __atomic_thread_fence( __ATOMIC_RELEASE );
+  rec->submit_ns = op->timing.submit_ns;
+  rec->xfer_ns = op->timing.xfer_ns;
+  rec->device_ns = op->timing.device_ns;
+  rec->data_len = op->data_len;
+  rec->resid = resid;
+  rec->fd = op->sg_fd;
+  rec->result = result;
+  rec->category = category;
+  rec->dir_out = op->dir_inout;
+  rec->status = status;
+  rec->sense_key = rec->asc = rec->ascq = 0;
+  if( category == SCSI_PT_RESULT_SENSE &&
+      sg_scsi_normalize_sense( op->sense, SENSE_LENGTH, &ssh ) )
+  {
+    rec->sense_key = ssh.sense_key;
+    rec->asc = ssh.asc;
+    rec->ascq = ssh.ascq;
+  }
+  len = sg_get_command_size( op->cdb[0] );
+  if( len > SCSI_TRACE_CDB )
+    len = SCSI_TRACE_CDB;
+  rec->cdb_len = len;
+  memcpy( rec->cdb, op->cdb, len );
+  __atomic_store_n( &rec->seq, seq + 1, __ATOMIC_RELEASE );
+}
+
+/* Copies slot seq into rec; false if it was overwritten meanwhile */
+static bool
+trace_read( uint64_t seq, struct scsi_trace_rec *rec )
+{
+  const struct scsi_trace_rec *slot;
+
+  slot = &trace_ring[seq & ( SCSI_TRACE_RECORDS - 1 )];
+  if( __atomic_load_n( &slot->seq, __ATOMIC_ACQUIRE ) != seq + 1 )
+    return false;
+  memcpy( rec, slot, sizeof( *rec ) );
+  __atomic_thread_fence( __ATOMIC_ACQUIRE );
+  return __atomic_load_n( &slot->seq, __ATOMIC_RELAXED ) == seq + 1;
+}
+
+/* Decodes the records still in the ring, oldest first. Safe to call while
+ * other threads issue commands. Returns the number of records printed. */
+int
+scsi_trace_dump( FILE *f )
+{
+  struct scsi_trace_rec rec;
+  struct timespec mono, real;
+  uint64_t      head, seq, offset, t;
+  char          name[64], cdb[80], asc[96];
+  time_t        secs;
+  struct tm     tm;
+  int           n = 0, k, len;
+
+  clock_gettime( CLOCK_MONOTONIC, &mono );
+  clock_gettime( CLOCK_REALTIME, &real );
+  offset = ( ( uint64_t ) real.tv_sec * 1000000000 + real.tv_nsec ) -
+      ( ( uint64_t ) mono.tv_sec * 1000000000 + mono.tv_nsec );
+  head = __atomic_load_n( &trace_head, __ATOMIC_ACQUIRE );
+  seq = head > SCSI_TRACE_RECORDS ? head - SCSI_TRACE_RECORDS : 0;
+  fprintf( f, "# %" PRIu64 " commands traced, last %" PRIu64 " kept\n",
+      head, head - seq );
+  for( ; seq < head; seq++ )
+  {
+    if( !trace_read( seq, &rec ) )
+      continue;
+    t = rec.submit_ns + offset;
+    secs = t / 1000000000;
+    localtime_r( &secs, &tm );
+    strftime( name, sizeof( name ), "%H:%M:%S", &tm );
+    fprintf( f, "%" PRIu64 " %s.%09" PRIu64 " fd=%d ", seq, name,
+        t % 1000000000, rec.fd );
+    sg_get_command_name( rec.cdb, 0, sizeof( name ), name );
+    for( k = 0, len = 0; k < rec.cdb_len; k++ )
+      len += sg_scnpr( cdb + len, sizeof( cdb ) - len, "%02x", rec.cdb[k] );
+    fprintf( f, "[%s] %s %s %u", cdb, name, rec.dir_out ? "out" : "in",
+        rec.data_len );
+    if( rec.resid )
+      fprintf( f, " resid=%d", rec.resid );
+    fprintf( f, " %s", rec.category < SG_ARRAY_SIZE( trace_categories ) ?
+        trace_categories[rec.category] : "?" );
+    if( rec.status )
+      fprintf( f, " status=0x%02x", rec.status );
+    if( rec.sense_key || rec.asc || rec.ascq )
+      fprintf( f, " %s %02x/%02x (%s)",
+          sg_lib_sense_key_desc[rec.sense_key & 0xf], rec.asc, rec.ascq,
+          sg_get_asc_ascq_str( rec.asc, rec.ascq, sizeof( asc ), asc ) );
+    if( rec.result )
+      fprintf( f, " result=%d", rec.result );
+    fprintf( f, " %" PRIu64 " us (device %" PRIu64 " us)\n",
+        rec.xfer_ns / 1000, rec.device_ns / 1000 );
+    n++;
+  }
+  fflush( f );
+  return n;
+}
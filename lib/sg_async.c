@@ -0,0 +1,326 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+
+#include "sg_lib.h"
+#include "sg_pt.h"
+#include "sg_pt_linux.h"
+#include "sg_async.h"
+#include "sg_pr2serr.h"
+#include "wd_emu.h"
+#include "scsi_replay.h"
+
+#define MAX_EVENTS 64
+
+extern struct switches
+{
+  unsigned int  verbose:3;
+} sw;
+
+/* Upper bound on the sg_async_defer() workers, whatever the CPU count */
+#define MAX_WORKERS 64
+
+/* A sg_async_defer() job, queued to the workers, then handed back to the
+ * loop on its finished list */
+struct sg_async_work
+{
+  struct sg_async_work *next;
+  struct scsi_op_t *op;
+  sg_async_work_fn work;
+  int           ret;
+};
+
+int
+sg_async_init( struct sg_async_loop *loop )
+{
+  struct epoll_event ev;
+
+  loop->inflight = 0;
+  loop->workers = NULL;
+  loop->nworkers = 0;
+  loop->queue = loop->finished = NULL;
+  loop->queue_tail = &loop->queue;
+  loop->stop = false;
+  loop->wake_fd[0] = loop->wake_fd[1] = -1;
+  pthread_mutex_init( &loop->lock, NULL );
+  pthread_cond_init( &loop->queued, NULL );
+  loop->epfd = epoll_create1( EPOLL_CLOEXEC );
+  if( loop->epfd < 0 )
+  {
+    pr2serr( "epoll_create1: %s\n", safe_strerror( errno ) );
+    sg_async_fini( loop );
+    return -1;
+  }
+  memset( &ev, 0, sizeof( ev ) );
+  ev.events = EPOLLIN;
+  ev.data.ptr = loop;		/* tells the jobs from the sessions */
+  if( pipe2( loop->wake_fd, O_CLOEXEC | O_NONBLOCK ) < 0 ||
+      epoll_ctl( loop->epfd, EPOLL_CTL_ADD, loop->wake_fd[0], &ev ) < 0 )
+  {
+    pr2serr( "sg_async_init: %s\n", safe_strerror( errno ) );
+    sg_async_fini( loop );
+    return -1;
+  }
+  return 0;
+}
+
+/* Stops the workers once their current job is done. The jobs whose done
+ * was not called yet, queued or finished, complete with -1 here: nothing
+ * dispatches the commands their done might submit any more. */
+void
+sg_async_fini( struct sg_async_loop *loop )
+{
+  struct sg_async_work *w, *next, *left;
+  int           k;
+
+  pthread_mutex_lock( &loop->lock );
+  loop->stop = true;
+  pthread_cond_broadcast( &loop->queued );
+  pthread_mutex_unlock( &loop->lock );
+  for( k = 0; k < loop->nworkers; k++ )
+    pthread_join( loop->workers[k], NULL );
+  free( loop->workers );
+  loop->workers = NULL;
+  loop->nworkers = 0;
+  *loop->queue_tail = loop->finished;
+  left = loop->queue;
+  loop->queue = loop->finished = NULL;
+  loop->queue_tail = &loop->queue;
+  for( w = left; w; w = next )
+  {
+    next = w->next;
+    loop->inflight--;
+    w->op->done( w->op, -1 );
+    free( w );
+  }
+  pthread_cond_destroy( &loop->queued );
+  pthread_mutex_destroy( &loop->lock );
+  if( loop->epfd >= 0 )
+    close( loop->epfd );
+  loop->epfd = -1;
+  for( k = 0; k < 2; k++ )
+  {
+    if( loop->wake_fd[k] >= 0 )
+      close( loop->wake_fd[k] );
+    loop->wake_fd[k] = -1;
+  }
+}
+
+/* Registers the open session of op with the loop. Closing the session
+ * removes it again. Handles that cannot be polled are accepted, their
+ * commands complete synchronously. Returns 0 on success, -1 on error. */
+int
+sg_async_add( struct sg_async_loop *loop, struct scsi_op_t *op )
+{
+  struct epoll_event ev;
+
+  memset( &ev, 0, sizeof( ev ) );
+  ev.events = EPOLLIN;
+  ev.data.ptr = op;
+  if( epoll_ctl( loop->epfd, EPOLL_CTL_ADD, op->sg_fd, &ev ) < 0 )
+  {
+    if( EPERM == errno )	/* block device: runs synchronously */
+      return 0;
+    pr2serr( "%s: epoll_ctl: %s\n", op->device_name,
+        safe_strerror( errno ) );
+    return -1;
+  }
+  return 0;
+}
+
+/* Queues the command held in op->cdb and calls done( op, ret ) with the
+ * scsi_xfer() style result once it has completed. Devices without the
+ * asynchronous sg interface run the command synchronously and complete
+ * it straight away. Returns 0 if the command was accepted; otherwise done
+ * is not called and a SG_LIB_CAT_* value is returned. */
+int
+scsi_xfer_submit( struct sg_async_loop *loop, struct scsi_op_t *op,
+    scsi_done_fn done )
+{
+  int           ret;
+
+  op->done = done;
+  scsi_xfer_prepare( op );
+  if( op->replay )
+    ret = scsi_replay_submit( op );
+  else if( op->emu )
+    ret = wd_emu_submit( op );
+  else
+    ret = do_scsi_pt_submit( op->ptvp, SCSI_TIMEOUT, sw.verbose );
+  if( SCSI_PT_DO_NOT_SUPPORTED == ret )
+  {
+    ret = do_scsi_pt( op->ptvp, -1, SCSI_TIMEOUT, sw.verbose );
+    done( op, scsi_xfer_complete( op, ret ) );
+    return 0;
+  }
+  if( ret )
+  {
+    /* never 0: the caller would wait for a done that never comes */
+    ret = scsi_xfer_complete( op, ret );
+    return ret ? ret : SG_LIB_CAT_OTHER;
+  }
+  loop->inflight++;
+  return 0;
+}
+
+static void  *
+sg_async_worker( void *arg )
+{
+  struct sg_async_loop *loop = arg;
+  struct sg_async_work *w;
+  char          c = 0;
+
+  pthread_mutex_lock( &loop->lock );
+  while( 1 )
+  {
+    while( loop->queue == NULL && !loop->stop )
+      pthread_cond_wait( &loop->queued, &loop->lock );
+    if( loop->stop )
+      break;
+    w = loop->queue;
+    if( ( loop->queue = w->next ) == NULL )
+      loop->queue_tail = &loop->queue;
+    pthread_mutex_unlock( &loop->lock );
+    w->ret = w->work( w->op );
+    pthread_mutex_lock( &loop->lock );
+    w->next = loop->finished;
+    loop->finished = w;
+    /* a full pipe already has the loop woken up */
+    if( write( loop->wake_fd[1], &c, 1 ) < 0 && EAGAIN != errno )
+      pr2serr( "%s: cannot wake the loop: %s\n", w->op->device_name,
+          safe_strerror( errno ) );
+  }
+  pthread_mutex_unlock( &loop->lock );
+  return NULL;
+}
+
+/* Starts the workers, one per online CPU. Returns how many run. */
+static int
+sg_async_workers( struct sg_async_loop *loop )
+{
+  long          n;
+
+  if( loop->nworkers || loop->workers )
+    return loop->nworkers;
+  n = sysconf( _SC_NPROCESSORS_ONLN );
+  n = n < 1 ? 1 : n > MAX_WORKERS ? MAX_WORKERS : n;
+  if( NULL == ( loop->workers = calloc( n, sizeof( pthread_t ) ) ) )
+    return 0;
+  while( loop->nworkers < n &&
+      !pthread_create( &loop->workers[loop->nworkers], NULL,
+          sg_async_worker, loop ) )
+    loop->nworkers++;
+  return loop->nworkers;
+}
+
+/* Queues work( op ) to the loop's workers, so a long computation does not
+ * hold up the commands of the other devices, then calls done( op, ret )
+ * from sg_async_run() with what work returned. There is one worker per
+ * CPU however many jobs are queued. op counts as in flight meanwhile and
+ * must not be touched. If no worker can be started, work runs right away
+ * and done is called before returning. */
+void
+sg_async_defer( struct sg_async_loop *loop, struct scsi_op_t *op,
+    sg_async_work_fn work, scsi_done_fn done )
+{
+  struct sg_async_work *w = NULL;
+
+  op->done = done;
+  if( sg_async_workers( loop ) == 0 ||
+      NULL == ( w = malloc( sizeof( *w ) ) ) )
+  {
+    done( op, work( op ) );
+    return;
+  }
+  w->next = NULL;
+  w->op = op;
+  w->work = work;
+  pthread_mutex_lock( &loop->lock );
+  *loop->queue_tail = w;
+  loop->queue_tail = &w->next;
+  pthread_cond_signal( &loop->queued );
+  pthread_mutex_unlock( &loop->lock );
+  loop->inflight++;
+}
+
+/* Calls done for every job the workers finished. The finished list, not
+ * the wake-up bytes, tells which: a failed read loses no job. */
+static void
+sg_async_reap( struct sg_async_loop *loop )
+{
+  struct sg_async_work *w, *next;
+  char          buf[64];
+  ssize_t       n;
+
+  while( ( n = read( loop->wake_fd[0], buf, sizeof( buf ) ) ) > 0 )
+    ;
+  if( n < 0 && EAGAIN != errno && EINTR != errno )
+    pr2serr( "sg_async_run: %s\n", safe_strerror( errno ) );
+  pthread_mutex_lock( &loop->lock );
+  w = loop->finished;
+  loop->finished = NULL;
+  pthread_mutex_unlock( &loop->lock );
+  for( ; w; w = next )
+  {
+    next = w->next;
+    loop->inflight--;
+    w->op->done( w->op, w->ret );
+    free( w );
+  }
+}
+
+/* Dispatches completions until no command is in flight. A timeout_ms of
+ * -1 waits forever for each event. Returns 0 when idle, -1 on timeout or
+ * error. */
+int
+sg_async_run( struct sg_async_loop *loop, int timeout_ms )
+{
+  struct epoll_event events[MAX_EVENTS];
+  struct scsi_op_t *op;
+  int           n, k, ret;
+
+  while( loop->inflight > 0 )
+  {
+    n = epoll_wait( loop->epfd, events, MAX_EVENTS, timeout_ms );
+    if( n < 0 )
+    {
+      if( EINTR == errno )
+	continue;
+      pr2serr( "epoll_wait: %s\n", safe_strerror( errno ) );
+      return -1;
+    }
+    if( n == 0 )
+      return -1;
+    for( k = 0; k < n; k++ )
+    {
+      if( events[k].data.ptr == loop )
+      {
+	sg_async_reap( loop );
+	continue;
+      }
+      op = events[k].data.ptr;
+      if( op->replay )
+	ret = scsi_replay_receive( op );
+      else if( op->emu )
+	ret = wd_emu_receive( op );
+      else
+	ret = do_scsi_pt_receive( op->ptvp, sw.verbose );
+      if( -EAGAIN == ret )
+	continue;
+      loop->inflight--;
+      /* op may be released or resubmitted by its callback */
+      op->done( op, scsi_xfer_complete( op, ret ) );
+    }
+  }
+  return 0;
+}
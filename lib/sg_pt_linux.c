@@ -6,7 +6,10 @@
 #include <ctype.h>
 #include <unistd.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/sysmacros.h>      /* to define 'major' */
@@ -20,6 +23,9 @@
 #include "sg_lib.h"
 #include "sg_pt_linux.h"
 #include "sg_pr2serr.h"
+#include "scsi_trace.h"
+#include "wd_emu.h"
+#include "scsi_replay.h"
 
 #ifdef major
 #define SG_DEV_MAJOR major
@@ -38,10 +44,6 @@
 #define SG_LINUX_SG_VER_V4_BASE 40000   /* lowest sg driver version with v4 interface */
 #define SG_LINUX_SG_VER_V4_FULL 40030   /* lowest version with full v4 interface */
 
-uint8_t       cdb[CDB_LENGTH];
-uint8_t       cmdout[MAX_SCSI_XFER] __attribute__ ((aligned (4096)));
-uint8_t       reply[MAX_SCSI_XFER] __attribute__ ((aligned (4096)));
-
 static const char *linux_host_bytes[] = {
   "DID_OK", "DID_NO_CONNECT", "DID_BUS_BUSY", "DID_TIME_OUT",
   "DID_BAD_TARGET", "DID_ABORT", "DID_PARITY", "DID_ERROR",
@@ -89,6 +91,27 @@ bool          sg_duration_set_nano = false;
 
 long          sg_lin_page_size = 4096;  /* default, overridden with correct value */
 
+static pthread_mutex_t sg_major_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Reads the bsg and NVMe char majors on first use. Sessions are opened
+ * from several threads at once (--all), so the first one parses
+ * /proc/devices under a lock and the flag is only set once the majors
+ * are stored. */
+static void
+sg_check_bsg_nvme_char_major( int verbose )
+{
+  if( __atomic_load_n( &sg_bsg_nvme_char_major_checked, __ATOMIC_ACQUIRE ) )
+    return;
+  pthread_mutex_lock( &sg_major_lock );
+  if( !sg_bsg_nvme_char_major_checked )
+  {
+    sg_find_bsg_nvme_char_major( verbose );
+    __atomic_store_n( &sg_bsg_nvme_char_major_checked, true,
+        __ATOMIC_RELEASE );
+  }
+  pthread_mutex_unlock( &sg_major_lock );
+}
+
 /* This function only needs to be called once (unless a NVMe controller
  * can be hot-plugged into system in which case it should be called
  * (again) after that event). */
@@ -214,11 +237,7 @@ check_pt_file_handle( int dev_fd, const char *device_name, int verbose )
     pr2ws( "%s: dev_fd=%d, device_name: %s\n", __func__, dev_fd,
         device_name );
   /* Linux doesn't need device_name to determine which pass-through */
-  if( !sg_bsg_nvme_char_major_checked )
-  {
-    sg_bsg_nvme_char_major_checked = true;
-    sg_find_bsg_nvme_char_major( verbose );
-  }
+  sg_check_bsg_nvme_char_major( verbose );
   if( dev_fd >= 0 )
   {
     bool          is_sg, is_bsg;
@@ -275,11 +294,7 @@ scsi_pt_open_flags( const char *device_name, int flags, int verbose )
 {
   int           fd;
 
-  if( !sg_bsg_nvme_char_major_checked )
-  {
-    sg_bsg_nvme_char_major_checked = true;
-    sg_find_bsg_nvme_char_major( verbose );
-  }
+  sg_check_bsg_nvme_char_major( verbose );
   if( verbose > 1 )
   {
     pr2ws( "open %s with flags=0x%x\n", device_name, flags );
@@ -375,7 +390,7 @@ void
 clear_scsi_pt_obj( struct sg_pt_base *vp )
 {
   bool          is_sg, is_bsg;
-  int           fd;
+  int           fd, sg_version;
   struct sg_sntl_dev_state_t dev_stat;
   struct sg_pt_linux_scsi *ptp = &vp->impl;
 
@@ -384,6 +399,7 @@ clear_scsi_pt_obj( struct sg_pt_base *vp )
     fd = ptp->dev_fd;
     is_sg = ptp->is_sg;
     is_bsg = ptp->is_bsg;
+    sg_version = ptp->sg_version;
     dev_stat = ptp->dev_stat;
     if( ptp->free_nvme_id_ctlp )
       free( ptp->free_nvme_id_ctlp );
@@ -398,6 +414,7 @@ clear_scsi_pt_obj( struct sg_pt_base *vp )
     ptp->dev_fd = fd;
     ptp->is_sg = is_sg;
     ptp->is_bsg = is_bsg;
+    ptp->sg_version = sg_version;
     ptp->dev_stat = dev_stat;
   }
 }
@@ -461,11 +478,7 @@ set_pt_file_handle( struct sg_pt_base *vp, int dev_fd, int verbose )
   struct sg_pt_linux_scsi *ptp = &vp->impl;
   struct stat   a_stat;
 
-  if( !sg_bsg_nvme_char_major_checked )
-  {
-    sg_bsg_nvme_char_major_checked = true;
-    sg_find_bsg_nvme_char_major( verbose );
-  }
+  sg_check_bsg_nvme_char_major( verbose );
   ptp->dev_fd = dev_fd;
   if( dev_fd >= 0 )
   {
@@ -843,6 +856,27 @@ get_pt_duration_ns( const struct sg_pt_base *vp )
   return sg_duration_set_nano ? ( uint32_t ) ptp->io_hdr.duration : 0;
 }
 
+/* Stores the outcome of a command run by the drive emulator (or replayed
+ * from a recording) the way the sg driver reports it, so the get_*
+ * functions above decode it as usual */
+void
+set_scsi_pt_emulated( struct sg_pt_base *vp, int status, int transport_err,
+    int sense_len, int resid, int os_err, uint64_t ns )
+{
+  struct sg_pt_linux_scsi *ptp = &vp->impl;
+
+  ptp->os_err = os_err;
+  ptp->io_hdr.device_status = status;
+  ptp->io_hdr.transport_status = transport_err;
+  ptp->io_hdr.driver_status = sense_len ? SG_LIB_DRIVER_SENSE : 0;
+  ptp->io_hdr.response_len = sense_len;
+  if( ptp->io_hdr.dout_xfer_len > 0 )
+    ptp->io_hdr.dout_resid = resid;
+  else
+    ptp->io_hdr.din_resid = resid;
+  ptp->io_hdr.duration = sg_duration_set_nano ? ns : ns / 1000000;
+}
+
 int
 get_scsi_pt_transport_err( const struct sg_pt_base *vp )
 {
@@ -944,18 +978,18 @@ get_scsi_pt_os_err_str( const struct sg_pt_base *vp, int max_b_len, char *b )
   return b;
 }
 
-/* Executes SCSI command using sg v3 interface */
+/* Converts the v4 header of ptp into the v3 header that the sg driver
+ * expects. Returns 0 or SCSI_PT_DO_BAD_PARAMS. */
 static int
-do_scsi_pt_v3( struct sg_pt_linux_scsi *ptp, int fd, int time_secs,
-    int verbose )
+build_v3_hdr( struct sg_pt_linux_scsi *ptp, struct sg_io_hdr *v3_hdrp,
+    int time_secs, int verbose )
 {
-  struct sg_io_hdr v3_hdr;
-  memset( &v3_hdr, 0, sizeof( v3_hdr ) );
+  memset( v3_hdrp, 0, sizeof( *v3_hdrp ) );
   /* convert v4 to v3 header */
-  v3_hdr.interface_id = 'S';
-  v3_hdr.dxfer_direction = SG_DXFER_NONE;
-  v3_hdr.cmdp = ( uint8_t * ) ( sg_uintptr_t ) ptp->io_hdr.request;
-  v3_hdr.cmd_len = ( uint8_t ) ptp->io_hdr.request_len;
+  v3_hdrp->interface_id = 'S';
+  v3_hdrp->dxfer_direction = SG_DXFER_NONE;
+  v3_hdrp->cmdp = ( uint8_t * ) ( sg_uintptr_t ) ptp->io_hdr.request;
+  v3_hdrp->cmd_len = ( uint8_t ) ptp->io_hdr.request_len;
   if( ptp->io_hdr.din_xfer_len > 0 )
   {
     if( ptp->io_hdr.dout_xfer_len > 0 )
@@ -964,34 +998,63 @@ do_scsi_pt_v3( struct sg_pt_linux_scsi *ptp, int fd, int time_secs,
         pr2ws( "sgv3 doesn't support bidi\n" );
       return SCSI_PT_DO_BAD_PARAMS;
     }
-    v3_hdr.dxferp = ( void * ) ( long ) ptp->io_hdr.din_xferp;
-    v3_hdr.dxfer_len = ( unsigned int ) ptp->io_hdr.din_xfer_len;
-    v3_hdr.dxfer_direction = SG_DXFER_FROM_DEV;
+    v3_hdrp->dxferp = ( void * ) ( long ) ptp->io_hdr.din_xferp;
+    v3_hdrp->dxfer_len = ( unsigned int ) ptp->io_hdr.din_xfer_len;
+    v3_hdrp->dxfer_direction = SG_DXFER_FROM_DEV;
   }
   else if( ptp->io_hdr.dout_xfer_len > 0 )
   {
-    v3_hdr.dxferp = ( void * ) ( long ) ptp->io_hdr.dout_xferp;
-    v3_hdr.dxfer_len = ( unsigned int ) ptp->io_hdr.dout_xfer_len;
-    v3_hdr.dxfer_direction = SG_DXFER_TO_DEV;
+    v3_hdrp->dxferp = ( void * ) ( long ) ptp->io_hdr.dout_xferp;
+    v3_hdrp->dxfer_len = ( unsigned int ) ptp->io_hdr.dout_xfer_len;
+    v3_hdrp->dxfer_direction = SG_DXFER_TO_DEV;
   }
   if( ptp->io_hdr.response && ( ptp->io_hdr.max_response_len > 0 ) )
   {
-    v3_hdr.sbp = ( uint8_t * ) ( sg_uintptr_t ) ptp->io_hdr.response;
-    v3_hdr.mx_sb_len = ( uint8_t ) ptp->io_hdr.max_response_len;
+    v3_hdrp->sbp = ( uint8_t * ) ( sg_uintptr_t ) ptp->io_hdr.response;
+    v3_hdrp->mx_sb_len = ( uint8_t ) ptp->io_hdr.max_response_len;
   }
-  v3_hdr.pack_id = ( int ) ptp->io_hdr.request_extra;
+  v3_hdrp->pack_id = ( int ) ptp->io_hdr.request_extra;
+  v3_hdrp->usr_ptr = ( void * ) ( sg_uintptr_t ) ptp->io_hdr.usr_ptr;
   if( BSG_FLAG_Q_AT_HEAD & ptp->io_hdr.flags )
-    v3_hdr.flags |= SG_FLAG_Q_AT_HEAD;  /* favour AT_HEAD */
+    v3_hdrp->flags |= SG_FLAG_Q_AT_HEAD;        /* favour AT_HEAD */
   else if( BSG_FLAG_Q_AT_TAIL & ptp->io_hdr.flags )
-    v3_hdr.flags |= SG_FLAG_Q_AT_TAIL;
-  if( NULL == v3_hdr.cmdp )
+    v3_hdrp->flags |= SG_FLAG_Q_AT_TAIL;
+  if( NULL == v3_hdrp->cmdp )
   {
     if( verbose )
       pr2ws( "No SCSI command (cdb) given [v3]\n" );
     return SCSI_PT_DO_BAD_PARAMS;
   }
   /* io_hdr.timeout is in milliseconds, if greater than zero */
-  v3_hdr.timeout = ( ( time_secs > 0 ) ? ( time_secs * 1000 ) : DEF_TIMEOUT );
+  v3_hdrp->timeout =
+      ( ( time_secs > 0 ) ? ( time_secs * 1000 ) : DEF_TIMEOUT );
+  return 0;
+}
+
+/* Copies the outcome of a completed v3 command back into the v4 header */
+static void
+v3_hdr_to_v4( struct sg_pt_linux_scsi *ptp, const struct sg_io_hdr *v3_hdrp )
+{
+  ptp->io_hdr.device_status = ( __u32 ) v3_hdrp->status;
+  ptp->io_hdr.driver_status = ( __u32 ) v3_hdrp->driver_status;
+  ptp->io_hdr.transport_status = ( __u32 ) v3_hdrp->host_status;
+  ptp->io_hdr.response_len = ( __u32 ) v3_hdrp->sb_len_wr;
+  ptp->io_hdr.duration = ( __u32 ) v3_hdrp->duration;
+  ptp->io_hdr.din_resid = ( __s32 ) v3_hdrp->resid;
+  /* v3_hdr.info not passed back since no mapping defined (yet) */
+}
+
+/* Executes SCSI command using sg v3 interface */
+static int
+do_scsi_pt_v3( struct sg_pt_linux_scsi *ptp, int fd, int time_secs,
+    int verbose )
+{
+  int           res;
+  struct sg_io_hdr v3_hdr;
+
+  res = build_v3_hdr( ptp, &v3_hdr, time_secs, verbose );
+  if( res )
+    return res;
   /* Finally do the v3 SG_IO ioctl */
   if( ioctl( fd, SG_IO, &v3_hdr ) < 0 )
   {
@@ -1001,13 +1064,7 @@ do_scsi_pt_v3( struct sg_pt_linux_scsi *ptp, int fd, int time_secs,
           safe_strerror( ptp->os_err ), ptp->os_err );
     return -ptp->os_err;
   }
-  ptp->io_hdr.device_status = ( __u32 ) v3_hdr.status;
-  ptp->io_hdr.driver_status = ( __u32 ) v3_hdr.driver_status;
-  ptp->io_hdr.transport_status = ( __u32 ) v3_hdr.host_status;
-  ptp->io_hdr.response_len = ( __u32 ) v3_hdr.sb_len_wr;
-  ptp->io_hdr.duration = ( __u32 ) v3_hdr.duration;
-  ptp->io_hdr.din_resid = ( __s32 ) v3_hdr.resid;
-  /* v3_hdr.info not passed back since no mapping defined (yet) */
+  v3_hdr_to_v4( ptp, &v3_hdr );
   return 0;
 }
 
@@ -1045,11 +1102,7 @@ do_scsi_pt( struct sg_pt_base *vp, int fd, int time_secs, int verbose )
   int           err;
   struct sg_pt_linux_scsi *ptp = &vp->impl;
   bool          have_checked_for_type = ( ptp->dev_fd >= 0 );
-  if( !sg_bsg_nvme_char_major_checked )
-  {
-    sg_bsg_nvme_char_major_checked = true;
-    sg_find_bsg_nvme_char_major( verbose );
-  }
+  sg_check_bsg_nvme_char_major( verbose );
   if( ptp->in_err )
   {
     if( verbose )
@@ -1103,79 +1156,344 @@ do_scsi_pt( struct sg_pt_base *vp, int fd, int time_secs, int verbose )
   return 0;
 }
 
+#ifndef SG_IOCTL_MAGIC_NUM
+#define SG_IOCTL_MAGIC_NUM 0x22
+#endif
+#ifndef SG_IOSUBMIT
+#define SG_IOSUBMIT _IOWR(SG_IOCTL_MAGIC_NUM, 0x41, struct sg_io_v4)
+#endif
+#ifndef SG_IORECEIVE
+#define SG_IORECEIVE _IOWR(SG_IOCTL_MAGIC_NUM, 0x42, struct sg_io_v4)
+#endif
+#ifndef SGV4_FLAG_IMMED
+#define SGV4_FLAG_IMMED 0x400
+#endif
+
+/* Queues the command of vp on its sg device without waiting for it. Uses
+ * SG_IOSUBMIT on a full sg v4 driver, otherwise a v3 write(). The result
+ * is fetched with do_scsi_pt_receive() once the file descriptor polls
+ * readable. Returns 0 on success, SCSI_PT_DO_NOT_SUPPORTED if the handle is
+ * not a sg device (bsg and block devices only do the blocking SG_IO),
+ * otherwise the same values as do_scsi_pt(). */
+int
+do_scsi_pt_submit( struct sg_pt_base *vp, int time_secs, int verbose )
+{
+  int           res;
+  struct sg_io_hdr v3_hdr;
+  struct sg_pt_linux_scsi *ptp = &vp->impl;
+
+  if( ptp->in_err )
+  {
+    if( verbose )
+      pr2ws( "Replicated or unused set_scsi_pt... functions\n" );
+    return SCSI_PT_DO_BAD_PARAMS;
+  }
+  if( ptp->dev_fd < 0 )
+  {
+    if( verbose )
+      pr2ws( "%s: invalid file descriptors\n", __func__ );
+    return SCSI_PT_DO_BAD_PARAMS;
+  }
+  if( ptp->os_err )
+    return -ptp->os_err;
+  if( !ptp->is_sg )
+    return SCSI_PT_DO_NOT_SUPPORTED;
+  ptp->io_hdr.usr_ptr = ( __u64 ) ( sg_uintptr_t ) vp;
+  if( ptp->sg_version >= SG_LINUX_SG_VER_V4_FULL )
+  {
+    if( 0 == ptp->io_hdr.request )
+    {
+      if( verbose )
+        pr2ws( "No SCSI command (cdb) given [v4]\n" );
+      return SCSI_PT_DO_BAD_PARAMS;
+    }
+    ptp->io_hdr.timeout =
+        ( ( time_secs > 0 ) ? ( time_secs * 1000 ) : DEF_TIMEOUT );
+    res = ioctl( ptp->dev_fd, SG_IOSUBMIT, &ptp->io_hdr );
+  }
+  else
+  {
+    res = build_v3_hdr( ptp, &v3_hdr, time_secs, verbose );
+    if( res )
+      return res;
+    while( ( res = write( ptp->dev_fd, &v3_hdr, sizeof( v3_hdr ) ) ) < 0 &&
+        EINTR == errno )
+      ;
+  }
+  if( res < 0 )
+  {
+    ptp->os_err = errno;
+    if( verbose > 1 )
+      pr2ws( "%s: submit failed: %s (errno=%d)\n", __func__,
+          safe_strerror( ptp->os_err ), ptp->os_err );
+    return -ptp->os_err;
+  }
+  return 0;
+}
+
+/* Collects the completion of the command previously queued on vp by
+ * do_scsi_pt_submit(). Does not block. Returns 0 when the command has
+ * completed (results are then available through the get_scsi_pt_...
+ * functions), -EAGAIN if it is still in flight, otherwise a negated
+ * errno. */
+int
+do_scsi_pt_receive( struct sg_pt_base *vp, int verbose )
+{
+  int           res;
+  struct sg_io_hdr v3_hdr;
+  struct sg_pt_linux_scsi *ptp = &vp->impl;
+
+  if( ptp->sg_version >= SG_LINUX_SG_VER_V4_FULL )
+  {
+    ptp->io_hdr.flags |= SGV4_FLAG_IMMED;
+    res = ioctl( ptp->dev_fd, SG_IORECEIVE, &ptp->io_hdr );
+  }
+  else
+  {
+    memset( &v3_hdr, 0, sizeof( v3_hdr ) );
+    v3_hdr.interface_id = 'S';
+    v3_hdr.pack_id = -1;	/* any */
+    while( ( res = read( ptp->dev_fd, &v3_hdr, sizeof( v3_hdr ) ) ) < 0 &&
+        EINTR == errno )
+      ;
+    if( res >= 0 )
+      v3_hdr_to_v4( ptp, &v3_hdr );
+  }
+  if( res < 0 )
+  {
+    if( EAGAIN == errno )
+      return -EAGAIN;
+    ptp->os_err = errno;
+    if( verbose > 1 )
+      pr2ws( "%s: receive failed: %s (errno=%d)\n", __func__,
+          safe_strerror( ptp->os_err ), ptp->os_err );
+    return -ptp->os_err;
+  }
+  return 0;
+}
+
 extern struct switches
 {
   unsigned int  verbose:3;
 } sw;
 
+uint64_t
+scsi_clock_ns( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( uint64_t ) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Grow the data buffers of a device context to at least len bytes,
+ * keeping their contents. The data buffers are page aligned so the sg
+ * driver can map them directly. Returns 0 on success, -1 if out of
+ * memory (the old buffers are then left in place). */
 int
-scsi_xfer( struct scsi_op_t *op )
+scsi_op_reserve( struct scsi_op_t *op, int len )
 {
-  int           ret = 0;
-  int           err = 0;
-  int           res_cat, status, s_len, k;
-  int           sg_fd = -1;
-  struct sg_pt_base *ptvp = NULL;
-  uint8_t       sense_buffer[32];
-  char          b[128];
-  const int     b_len = sizeof( b );
+  long          align = sysconf( _SC_PAGESIZE );
+  uint8_t      *cmdout, *reply;
 
-  sg_fd = scsi_pt_open_device( op->device_name, sw.verbose );
-  if( sg_fd < 0 )
+  if( len <= op->buf_len )
+    return 0;
+  if( align <= 0 )
+    align = 4096;
+  len = ( len + align - 1 ) / align * align;
+  if( posix_memalign( ( void ** ) &cmdout, align, len ) )
+    return -1;
+  if( posix_memalign( ( void ** ) &reply, align, len ) )
   {
-    pr2serr( "%s: %s\n", op->device_name, safe_strerror( -sg_fd ) );
-    ret = sg_convert_errno( -sg_fd );
-    goto done;
+    free( cmdout );
+    return -1;
   }
+  memset( cmdout, 0, len );
+  memset( reply, 0, len );
+  if( op->buf_len )
+  {
+    memcpy( cmdout, op->cmdout, op->buf_len );
+    memcpy( reply, op->reply, op->buf_len );
+  }
+  free( op->cmdout );
+  free( op->reply );
+  op->cmdout = cmdout;
+  op->reply = reply;
+  op->buf_len = len;
+  return 0;
+}
 
-  ptvp = construct_scsi_pt_obj_with_fd( sg_fd, sw.verbose );
-  if( ptvp == NULL )
+/* Allocate the command buffers of a device context, with data buffers
+ * for one block. Returns 0 on success, -1 if out of memory. */
+int
+scsi_op_init( struct scsi_op_t *op, char *device_name )
+{
+  memset( op, 0, sizeof( *op ) );
+  op->device_name = device_name;
+  op->sg_fd = -1;
+  op->cdb = calloc( 1, CDB_LENGTH );
+  op->sense = calloc( 1, SENSE_LENGTH );
+  if( !op->cdb || !op->sense || scsi_op_reserve( op, MAX_SCSI_XFER ) )
+  {
+    pr2serr( "%s: out of memory\n", __func__ );
+    scsi_op_free( op );
+    return -1;
+  }
+  return 0;
+}
+
+void
+scsi_op_free( struct scsi_op_t *op )
+{
+  scsi_session_close( op );
+  free( op->cdb );
+  free( op->cmdout );
+  free( op->reply );
+  free( op->sense );
+  free( op->handy_cache.data );
+  free( op->handy_cache.valid );
+  memset( &op->handy_cache, 0, sizeof( op->handy_cache ) );
+  op->cdb = op->cmdout = op->reply = op->sense = NULL;
+  op->buf_len = 0;
+}
+
+/* Open op->device_name once and keep the file descriptor and the
+ * pass-through object alive until scsi_session_close(). Returns 0 on
+ * success, otherwise a SG_LIB_CAT_* value. */
+int
+scsi_session_open( struct scsi_op_t *op )
+{
+  uint64_t      t0 = scsi_clock_ns(  );
+
+  if( op->ptvp )
+    return 0;
+  if( scsi_replay_active(  ) )
+  {
+    if( scsi_replay_open( op ) )
+      return SG_LIB_CAT_OTHER;
+    op->timing.open_ns = scsi_clock_ns(  ) - t0;
+    return 0;
+  }
+  if( wd_emu_device( op->device_name ) )
+  {
+    if( wd_emu_open( op ) )
+      return SG_LIB_CAT_OTHER;
+    op->timing.open_ns = scsi_clock_ns(  ) - t0;
+    return 0;
+  }
+  op->sg_fd = scsi_pt_open_device( op->device_name, sw.verbose );
+  if( op->sg_fd < 0 )
+  {
+    pr2serr( "%s: %s\n", op->device_name, safe_strerror( -op->sg_fd ) );
+    return sg_convert_errno( -op->sg_fd );
+  }
+  op->ptvp = construct_scsi_pt_obj_with_fd( op->sg_fd, sw.verbose );
+  if( op->ptvp == NULL )
   {
     pr2serr( "construct_scsi_pt_obj_with_fd() failed\n" );
-    ret = SG_LIB_CAT_OTHER;
-    goto done;
+    scsi_pt_close_device( op->sg_fd );
+    op->sg_fd = -1;
+    return SG_LIB_CAT_OTHER;
+  }
+  op->timing.open_ns = scsi_clock_ns(  ) - t0;
+  return 0;
+}
+
+void
+scsi_session_close( struct scsi_op_t *op )
+{
+  uint64_t      t0 = scsi_clock_ns(  );
+
+  if( op->ptvp == NULL )
+    return;
+  if( op->replay )
+    scsi_replay_close( op );
+  else if( op->emu )
+    wd_emu_close( op );
+  else
+  {
+    destruct_scsi_pt_obj( op->ptvp );
+    op->ptvp = NULL;
+    scsi_pt_close_device( op->sg_fd );
+    op->sg_fd = -1;
   }
+  op->timing.close_ns = scsi_clock_ns(  ) - t0;
+}
 
+/* Loads the command held in op->cdb, its length given by the opcode
+ * group, and the data buffer of op into the pass-through object of the
+ * open session. */
+void
+scsi_xfer_prepare( struct scsi_op_t *op )
+{
+  int           k;
+  struct sg_pt_base *ptvp = op->ptvp;
+  uint8_t      *cdb = op->cdb;
+  int           cdb_len = sg_get_command_size( cdb[0] );
+
+  clear_scsi_pt_obj( ptvp );
   if( sw.verbose > 1 )
   {
     printf( "Command bytes in hex:" );
-    for( k = 0; k < CDB_LENGTH; ++k )
+    for( k = 0; k < cdb_len; ++k )
       printf( " %02x", cdb[k] );
     printf( "\n" );
   }
-  if( CDB_LENGTH < MIN_SCSI_CDBSZ )
-  {
-    pr2serr( "CDB too short (min. %d bytes)\n", MIN_SCSI_CDBSZ );
-    goto done;
-  }
   if( op->dir_inout )
   {
     if( sw.verbose > 2 )
       pr2serr( "dxfer_buffer_out=%p, length=%d\n",
-          ( void * ) cmdout, op->data_len );
-    set_scsi_pt_data_out( ptvp, cmdout, op->data_len );
+          ( void * ) op->cmdout, op->data_len );
+    set_scsi_pt_data_out( ptvp, op->cmdout, op->data_len );
   }
   else
   {
     if( sw.verbose > 2 )
-      pr2serr( "dxfer_buffer_in=%p, length=%d\n", ( void * ) reply, op->data_len );
-    set_scsi_pt_data_in( ptvp, reply, op->data_len );
+      pr2serr( "dxfer_buffer_in=%p, length=%d\n", ( void * ) op->reply,
+          op->data_len );
+    set_scsi_pt_data_in( ptvp, op->reply, op->data_len );
   }
   if( sw.verbose )
   {
     char          d[128];
 
     pr2serr( "	  cdb to send: " );
-      pr2serr( "%s\n", sg_get_command_str( cdb, CDB_LENGTH,
-          sw.verbose > 1, sizeof( d ), d ) );
+    pr2serr( "%s\n", sg_get_command_str( cdb, cdb_len,
+            sw.verbose > 1, sizeof( d ), d ) );
   }
-  set_scsi_pt_cdb( ptvp, cdb, CDB_LENGTH );
+  set_scsi_pt_cdb( ptvp, cdb, cdb_len );
   if( sw.verbose > 2 )
-    pr2serr( "sense_buffer=%p, length=%d\n", ( void * ) sense_buffer,
-        ( int ) sizeof( sense_buffer ) );
-  set_scsi_pt_sense( ptvp, sense_buffer, sizeof( sense_buffer ) );
+    pr2serr( "sense_buffer=%p, length=%d\n", ( void * ) op->sense,
+        SENSE_LENGTH );
+  set_scsi_pt_sense( ptvp, op->sense, SENSE_LENGTH );
+  op->timing.submit_ns = scsi_clock_ns(  );
+}
 
-  ret = do_scsi_pt( ptvp, -1, SCSI_TIMEOUT, sw.verbose );
+/* Accounts and decodes the outcome of the command of op; ret is what
+ * do_scsi_pt() (or the asynchronous receive) returned. Returns 0 on
+ * success, otherwise a SG_LIB_CAT_* value. */
+int
+scsi_xfer_complete( struct scsi_op_t *op, int ret )
+{
+  int           err = 0;
+  int           res_cat = SCSI_STATS_NOT_ISSUED, status = 0, resid = 0;
+  int           s_len, k;
+  struct sg_pt_base *ptvp = op->ptvp;
+  uint8_t      *sense_buffer = op->sense;
+  char          b[128];
+  const int     b_len = sizeof( b );
+
+  op->timing.xfer_ns = scsi_clock_ns(  ) - op->timing.submit_ns;
+  op->timing.device_ns = get_pt_duration_ns( ptvp );
+  if( 0 == op->timing.device_ns )
+    op->timing.device_ns =
+        ( uint64_t ) get_scsi_pt_duration_ms( ptvp ) * 1000000;
+  op->timing.total_xfer_ns += op->timing.xfer_ns;
+  op->timing.commands++;
+  if( sw.verbose )
+    pr2serr( "command took %" PRIu64 " us (device %" PRIu64 " us)\n",
+        op->timing.xfer_ns / 1000, op->timing.device_ns / 1000 );
+  scsi_record_add( op, ret );
   if( ret > 0 )
   {
     switch ( ret )
@@ -1255,9 +1573,10 @@ scsi_xfer( struct scsi_op_t *op )
       ret = SG_LIB_CAT_RES_CONFLICT;
   }
 
+  resid = get_scsi_pt_resid( ptvp );
   if( !op->dir_inout )
   {
-    int           data_len = op->data_len - get_scsi_pt_resid( ptvp );
+    int           data_len = op->data_len - resid;
 
     if( ret && !( SG_LIB_CAT_RECOVERED == ret ||
         SG_LIB_CAT_NO_SENSE == ret ) )
@@ -1269,7 +1588,7 @@ scsi_xfer( struct scsi_op_t *op )
     else if( sw.verbose )
     {
       pr2serr( "Received %d bytes of data:\n", data_len );
-      hex2stderr( reply, data_len, 0 );
+      hex2stderr( op->reply, data_len, 0 );
     }
   }
 done:
@@ -1278,9 +1597,148 @@ done:
     sg_get_category_sense_str( ret, b_len, b, sw.verbose );
     pr2serr( "%s\n", b );
   }
-  if( ptvp )
-    destruct_scsi_pt_obj( ptvp );
-  if( sg_fd >= 0 )
-    scsi_pt_close_device( sg_fd );
+  if( op->cmd_log && op->timing.commands <= op->cmd_log_size )
+  {
+    struct scsi_cmd_time_t *t = &op->cmd_log[op->timing.commands - 1];
+
+    t->opcode = op->cdb[0];
+    t->action = op->cdb[1];
+    t->result = ret;
+    t->xfer_ns = op->timing.xfer_ns;
+    t->device_ns = op->timing.device_ns;
+  }
+  scsi_trace_add( op, res_cat, status, ret, resid );
+  if( op->stats )
+    scsi_stats_add( op->stats, op->cdb, res_cat, op->timing.xfer_ns );
+  return ret;
+}
+
+/* Upper bounds of the latency buckets: 1-2-5 steps from 100 us to 2 s */
+const uint64_t scsi_stats_bounds_ns[SCSI_STATS_BUCKETS] = {
+  100000, 200000, 500000, 1000000, 2000000, 5000000, 10000000, 20000000,
+  50000000, 100000000, 200000000, 500000000, 1000000000, 2000000000
+};
+
+void
+scsi_stats_init( struct scsi_stats_t *st )
+{
+  memset( st, 0, sizeof( *st ) );
+  pthread_mutex_init( &st->lock, NULL );
+}
+
+/* Histogram slot of a latency of 'us' microseconds */
+static unsigned int
+hist_slot( uint64_t us )
+{
+  unsigned int  shift;
+
+  if( us >= ( 1ULL << SCSI_HIST_MAX_BITS ) )
+    us = ( 1ULL << SCSI_HIST_MAX_BITS ) - 1;
+  if( us < 2 * SCSI_HIST_SUB )
+    return us;
+  shift = 63 - __builtin_clzll( us ) - SCSI_HIST_SUB_BITS;
+  return ( shift + 1 ) * SCSI_HIST_SUB + ( us >> shift ) - SCSI_HIST_SUB;
+}
+
+/* Largest latency, in microseconds, counted in 'slot' */
+static uint64_t
+hist_value( unsigned int slot )
+{
+  unsigned int  shift;
+
+  if( slot < 2 * SCSI_HIST_SUB )
+    return slot;
+  shift = slot / SCSI_HIST_SUB - 1;
+  return ( ( uint64_t ) ( SCSI_HIST_SUB + slot % SCSI_HIST_SUB + 1 ) <<
+      shift ) - 1;
+}
+
+/* Counts one command with the pass-through result 'category'
+ * (SCSI_STATS_NOT_ISSUED if it never reached the device) taking 'ns' */
+void
+scsi_stats_add( struct scsi_stats_t *st, const uint8_t *cdb, int category,
+    uint64_t ns )
+{
+  struct scsi_opcode_stats_t *os;
+  unsigned int  k;
+
+  pthread_mutex_lock( &st->lock );
+  for( k = 0; k < st->nops; k++ )
+    if( st->op[k].opcode == cdb[0] && st->op[k].action == cdb[1] )
+      break;
+  if( k == st->nops )
+  {
+    if( k == SCSI_STATS_OPCODES )
+    {
+      pthread_mutex_unlock( &st->lock );
+      return;
+    }
+    st->op[k].opcode = cdb[0];
+    st->op[k].action = cdb[1];
+    st->op[k].min_ns = UINT64_MAX;
+    st->nops++;
+  }
+  os = &st->op[k];
+  if( category < 0 || category >= SCSI_STATS_RESULTS )
+    category = SCSI_STATS_NOT_ISSUED;
+  os->results[category]++;
+  k = 0;
+  while( k < SCSI_STATS_BUCKETS && ns > scsi_stats_bounds_ns[k] )
+    k++;
+  os->buckets[k]++;
+  os->hist[hist_slot( ns / 1000 )]++;
+  os->count++;
+  os->sum_ns += ns;
+  if( ns < os->min_ns )
+    os->min_ns = ns;
+  if( ns > os->max_ns )
+    os->max_ns = ns;
+  pthread_mutex_unlock( &st->lock );
+}
+
+/* Latency in nanoseconds under which 'pct' percent of the commands of os
+ * completed, accurate to 1/SCSI_HIST_SUB; 0 if there were none */
+uint64_t
+scsi_stats_percentile( const struct scsi_opcode_stats_t *os, double pct )
+{
+  uint64_t      rank, seen = 0;
+  unsigned int  k;
+
+  if( os->count == 0 )
+    return 0;
+  rank = pct / 100 * os->count + 0.5;
+  if( rank < 1 )
+    rank = 1;
+  for( k = 0; k < SCSI_HIST_SLOTS; k++ )
+  {
+    seen += os->hist[k];
+    if( seen >= rank )
+      break;
+  }
+  if( k == SCSI_HIST_SLOTS || hist_value( k ) * 1000 > os->max_ns )
+    return os->max_ns;
+  return hist_value( k ) * 1000;
+}
+
+/* Runs the command held in op->cdb on the session of op. If no session is
+ * open one is opened just for this command and closed again. */
+int
+scsi_xfer( struct scsi_op_t *op )
+{
+  int           ret;
+  bool          transient = ( op->ptvp == NULL );
+
+  if( transient && ( ret = scsi_session_open( op ) ) )
+    return ret;
+  scsi_xfer_prepare( op );
+  if( op->replay )
+    ret = scsi_replay_xfer( op );
+  else if( op->emu )
+    ret = wd_emu_xfer( op );
+  else
+    ret = do_scsi_pt( op->ptvp, -1, SCSI_TIMEOUT, sw.verbose );
+  ret = scsi_xfer_complete( op, ret );
+  if( transient )
+    scsi_session_close( op );
   return ret;
 }
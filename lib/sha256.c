@@ -2,9 +2,16 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
-#define SHA256_DIGEST_SIZE 32
-#define SHA256_BLOCK_SIZE  64
+#include "sha256.h"
 
 #define SWAP32(x) ( x << 24 | x >> 24 | ( (x >> 8) & 0xff00 ) | ( (x & 0xff00) << 8 ) )
 #define ROR32(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
@@ -21,14 +28,21 @@ put_be32( uint32_t val, void *p )
   *(uint32_t *)p = SWAP32( val );
 }
 
-struct sha256_state
-{
-  uint32_t           state[SHA256_DIGEST_SIZE / 4];
-  uint32_t           count;
-  uint8_t            buf[SHA256_BLOCK_SIZE];
+#define SHA256_H0	0x6a09e667UL
+#define SHA256_H1	0xbb67ae85UL
+#define SHA256_H2	0x3c6ef372UL
+#define SHA256_H3	0xa54ff53aUL
+#define SHA256_H4	0x510e527fUL
+#define SHA256_H5	0x9b05688cUL
+#define SHA256_H6	0x1f83d9abUL
+#define SHA256_H7	0x5be0cd19UL
+
+const uint32_t SHA256_IV[8] = {
+  SHA256_H0, SHA256_H1, SHA256_H2, SHA256_H3,
+  SHA256_H4, SHA256_H5, SHA256_H6, SHA256_H7,
 };
 
-static const uint32_t SHA256_K[] = {
+const uint32_t SHA256_K[64] = {
   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
   0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
   0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
@@ -84,26 +98,15 @@ BLEND_OP( int I, uint32_t *W )
 	h = t1 + t2;						\
 } while (0)
 
-static void
-sha256_transform( uint32_t *state, const uint8_t *input, uint32_t *W )
+/* Compress the message words W[0..15], already in host order, into
+ * 'state'. W[16..63] are used for the schedule. */
+static inline void
+sha256_compress( uint32_t *state, uint32_t *W )
 {
   uint32_t           a, b, c, d, e, f, g, h;
   int           i;
 
-  /* load the input */
-  for( i = 0; i < 16; i += 8 )
-  {
-    LOAD_OP( i + 0, W, input );
-    LOAD_OP( i + 1, W, input );
-    LOAD_OP( i + 2, W, input );
-    LOAD_OP( i + 3, W, input );
-    LOAD_OP( i + 4, W, input );
-    LOAD_OP( i + 5, W, input );
-    LOAD_OP( i + 6, W, input );
-    LOAD_OP( i + 7, W, input );
-  }
-
-  /* now blend */
+  /* blend */
   for( i = 16; i < 64; i += 8 )
   {
     BLEND_OP( i + 0, W );
@@ -149,47 +152,201 @@ sha256_transform( uint32_t *state, const uint8_t *input, uint32_t *W )
   state[7] += h;
 }
 
-void
-sha256_update( struct sha256_state *sctx, const uint8_t *data, unsigned int len )
+static void
+sha256_transform( uint32_t *state, const uint8_t *input, uint32_t *W )
+{
+  int           i;
+
+  /* load the input */
+  for( i = 0; i < 16; i += 8 )
+  {
+    LOAD_OP( i + 0, W, input );
+    LOAD_OP( i + 1, W, input );
+    LOAD_OP( i + 2, W, input );
+    LOAD_OP( i + 3, W, input );
+    LOAD_OP( i + 4, W, input );
+    LOAD_OP( i + 5, W, input );
+    LOAD_OP( i + 6, W, input );
+    LOAD_OP( i + 7, W, input );
+  }
+  sha256_compress( state, W );
+}
+
+/* Portable block function */
+static void
+sha256_blocks_generic( uint32_t *state, const uint8_t *data,
+    unsigned int blocks )
+{
+  uint32_t      W[64];
+
+  while( blocks-- )
+  {
+    sha256_transform( state, data, W );
+    data += SHA256_BLOCK_SIZE;
+  }
+  memset( W, 0, sizeof( W ) );
+}
+
+/* Portable iterated hash of a 32 byte digest held as host order words.
+ * The padding of a 32 byte message is fixed, so only W[0..7] change. */
+static void
+sha256_iterate_generic( uint32_t *words, unsigned long iterations )
+{
+  uint32_t      W[64];
+  int           i;
+
+  for( i = 9; i < 15; i++ )
+    W[i] = 0;
+  W[8] = 0x80000000;
+  W[15] = SHA256_DIGEST_SIZE * 8;
+  while( iterations-- )
+  {
+    for( i = 0; i < 8; i++ )
+      W[i] = words[i];
+    for( i = 0; i < 8; i++ )
+      words[i] = SHA256_IV[i];
+    sha256_compress( words, W );
+  }
+  memset( W, 0, sizeof( W ) );
+}
+
+struct sha256_impl
+{
+  const char   *name;
+  sha256_block_fn blocks;
+  sha256_iterate_fn iterate;
+  int           ( *usable ) ( void );
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+static int
+cpu_has_shani( void )
+{
+  unsigned int  eax, ebx, ecx, edx;
+
+  if( !__get_cpuid( 1, &eax, &ebx, &ecx, &edx ) )
+    return 0;
+  /* SSSE3 and SSE4.1 */
+  if( !( ecx & ( 1 << 9 ) ) || !( ecx & ( 1 << 19 ) ) )
+    return 0;
+  if( !__get_cpuid_count( 7, 0, &eax, &ebx, &ecx, &edx ) )
+    return 0;
+  return ( ebx >> 29 ) & 1;
+}
+
+/* The CPU has the AVX2 or AVX-512F instructions and the kernel saves the
+ * ymm, or ymm and zmm, registers. */
+static int
+cpu_has_avx( int avx512 )
+{
+  unsigned int  eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+  unsigned int  xcr0_want = avx512 ? 0xe6 : 0x06;
+
+  if( !__get_cpuid( 1, &eax, &ebx, &ecx, &edx ) )
+    return 0;
+  /* OSXSAVE and AVX */
+  if( !( ecx & ( 1 << 27 ) ) || !( ecx & ( 1 << 28 ) ) )
+    return 0;
+  __asm__( "xgetbv":"=a"( xcr0_lo ), "=d"( xcr0_hi ):"c"( 0 ) );
+  if( ( xcr0_lo & xcr0_want ) != xcr0_want )
+    return 0;
+  if( !__get_cpuid_count( 7, 0, &eax, &ebx, &ecx, &edx ) )
+    return 0;
+  return avx512 ? ( ebx >> 16 ) & 1 : ( ebx >> 5 ) & 1;
+}
+
+static int
+cpu_has_avx2( void )
+{
+  return cpu_has_avx( 0 );
+}
+
+static int
+cpu_has_avx512( void )
+{
+  return cpu_has_avx( 1 );
+}
+#endif
+
+#if defined(__aarch64__)
+static int
+cpu_has_armv8_sha2( void )
+{
+  return ( getauxval( AT_HWCAP ) & HWCAP_SHA2 ) != 0;
+}
+#endif
+
+/* Fastest first; the portable code must stay last */
+static const struct sha256_impl sha256_impls[] = {
+#if defined(__x86_64__) || defined(__i386__)
+  {"shani", sha256_blocks_shani, sha256_iterate_shani, cpu_has_shani},
+#endif
+#if defined(__aarch64__)
+  {"armv8", sha256_blocks_armv8, sha256_iterate_armv8, cpu_has_armv8_sha2},
+#endif
+  {"generic", sha256_blocks_generic, sha256_iterate_generic, NULL},
+};
+
+#define SHA256_IMPLS ( sizeof( sha256_impls ) / sizeof( sha256_impls[0] ) )
+
+/* Multi-buffer iterate functions run 'lanes' chains side by side. Against
+ * a hardware single chain kernel they only pay off with at least
+ * 'hw_min_active' busy lanes, never if 0 (SHA-NI does a 32 byte round in
+ * ~65 ns, one AVX-512 step ~310 ns, one AVX2 step ~430 ns). */
+struct sha256_multi
+{
+  const char   *name;
+  int           lanes;
+  sha256_iterate_fn iterate;
+  int           ( *usable ) ( void );
+  int           hw_min_active;
+};
+
+static const struct sha256_multi sha256_multis[] = {
+#if defined(__x86_64__) || defined(__i386__)
+  {"avx512", 16, sha256_iterate_x16_avx512, cpu_has_avx512, 5},
+  {"avx2", 8, sha256_iterate_x8_avx2, cpu_has_avx2, 0},
+#endif
+  {NULL, 0, NULL, NULL, 0}
+};
+
+static const struct sha256_impl *sha256_impl = NULL;
+static const struct sha256_multi *sha256_multi = NULL;
+static pthread_once_t sha256_once = PTHREAD_ONCE_INIT;
+
+static void
+sha256_update_blocks( struct sha256_state *sctx, const uint8_t *data,
+    unsigned int len, sha256_block_fn blocks_fn )
 {
-  unsigned int  partial, done;
-  const uint8_t     *src;
-  uint32_t           W[64];
+  unsigned int  partial, done, blocks;
 
   partial = sctx->count & 0x3f;
   sctx->count += len;
   done = 0;
-  src = data;
 
   if( ( partial + len ) > 63 )
   {
     if( partial )
     {
-      done = -partial;
-      memcpy( sctx->buf + partial, data, done + 64 );
-      src = sctx->buf;
+      done = SHA256_BLOCK_SIZE - partial;
+      memcpy( sctx->buf + partial, data, done );
+      blocks_fn( sctx->state, sctx->buf, 1 );
     }
-
-    do
-    {
-      sha256_transform( sctx->state, src, W );
-      done += 64;
-      src = data + done;
-    }
-    while( done + 63 < len );
-
-    memset( W, 0, sizeof( W ) );
-
+    blocks = ( len - done ) / SHA256_BLOCK_SIZE;
+    if( blocks )
+      blocks_fn( sctx->state, data + done, blocks );
+    done += blocks * SHA256_BLOCK_SIZE;
     partial = 0;
   }
-  memcpy( sctx->buf + partial, src, len - done );
+  memcpy( sctx->buf + partial, data + done, len - done );
 }
 
-void
-sha256_final( struct sha256_state *sctx, uint8_t *out )
+static void
+sha256_final_blocks( struct sha256_state *sctx, uint8_t *out,
+    sha256_block_fn blocks_fn )
 {
-  uint32_t          *dst = ( uint32_t * ) out;
-  uint32_t           bits[2];
+  uint32_t     *dst = ( uint32_t * ) out;
+  uint32_t      bits[2];
   unsigned int  index, pad_len;
   int           i;
   static const uint8_t padding[64] = { 0x80, };
@@ -201,10 +358,11 @@ sha256_final( struct sha256_state *sctx, uint8_t *out )
   /* Pad out to 56 mod 64. */
   index = sctx->count & 0x3f;
   pad_len = ( index < 56 ) ? ( 56 - index ) : ( ( 64 + 56 ) - index );
-  sha256_update( sctx, padding, pad_len );
+  sha256_update_blocks( sctx, padding, pad_len, blocks_fn );
 
   /* Append length (before padding) */
-  sha256_update( sctx, ( const uint8_t * ) &bits, sizeof( bits ) );
+  sha256_update_blocks( sctx, ( const uint8_t * ) &bits, sizeof( bits ),
+      blocks_fn );
 
   /* Store state in digest */
   for( i = 0; i < 8; i++ )
@@ -214,27 +372,311 @@ sha256_final( struct sha256_state *sctx, uint8_t *out )
   memset( sctx, 0, sizeof( *sctx ) );
 }
 
-#define SHA256_H0	0x6a09e667UL
-#define SHA256_H1	0xbb67ae85UL
-#define SHA256_H2	0x3c6ef372UL
-#define SHA256_H3	0xa54ff53aUL
-#define SHA256_H4	0x510e527fUL
-#define SHA256_H5	0x9b05688cUL
-#define SHA256_H6	0x1f83d9abUL
-#define SHA256_H7	0x5be0cd19UL
+static void
+sha256_init_state( struct sha256_state *sctx )
+{
+  memcpy( sctx->state, SHA256_IV, sizeof( sctx->state ) );
+  sctx->count = 0;
+}
 
-static inline void
+/* FIPS 180-2 / NIST CAVS known answers. The last two messages span two
+ * blocks, one of them only after padding. */
+static const struct
+{
+  const char   *msg;
+  uint8_t       digest[SHA256_DIGEST_SIZE];
+} sha256_kat[] = {
+  {"",
+    {0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14,
+     0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
+     0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c,
+     0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55}},
+  {"abc",
+    {0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea,
+     0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+     0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c,
+     0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad}},
+  {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+    {0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8,
+     0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+     0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67,
+     0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1}},
+  {"abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmn"
+      "hijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+    {0xcf, 0x5b, 0x16, 0xa7, 0x78, 0xaf, 0x83, 0x80,
+     0x03, 0x6c, 0xe5, 0x9e, 0x7b, 0x04, 0x92, 0x37,
+     0x0b, 0x24, 0x9b, 0x11, 0xe8, 0xf0, 0x7a, 0x51,
+     0xaf, 0xac, 0x45, 0x03, 0x7a, 0xfe, 0xe9, 0xd1}},
+};
+
+/* Returns 0 if the block function of 'impl' reproduces every known answer
+ * and its iterate function agrees with hashing each digest in turn. */
+static int
+sha256_self_test( const struct sha256_impl *impl )
+{
+  struct sha256_state sctx;
+  uint8_t       digest[SHA256_DIGEST_SIZE];
+  uint32_t      words[SHA256_DIGEST_SIZE / 4];
+  unsigned int  k;
+
+  for( k = 0; k < sizeof( sha256_kat ) / sizeof( sha256_kat[0] ); k++ )
+  {
+    sha256_init_state( &sctx );
+    sha256_update_blocks( &sctx, ( const uint8_t * ) sha256_kat[k].msg,
+        strlen( sha256_kat[k].msg ), impl->blocks );
+    sha256_final_blocks( &sctx, digest, impl->blocks );
+    if( memcmp( digest, sha256_kat[k].digest, SHA256_DIGEST_SIZE ) )
+      return -1;
+  }
+
+  /* 'digest' holds the last known answer; chain it a few times */
+  for( k = 0; k < 8; k++ )
+    words[k] = get_be32( digest + 4 * k );
+  impl->iterate( words, 3 );
+  for( k = 0; k < 3; k++ )
+  {
+    sha256_init_state( &sctx );
+    sha256_update_blocks( &sctx, digest, SHA256_DIGEST_SIZE,
+        sha256_blocks_generic );
+    sha256_final_blocks( &sctx, digest, sha256_blocks_generic );
+  }
+  for( k = 0; k < 8; k++ )
+    if( words[k] != get_be32( digest + 4 * k ) )
+      return -1;
+  return 0;
+}
+
+/* Iterate the 32 byte digests[k] iterations[k] times each, running the
+ * chains on the lanes of 'mb' and refilling a lane as soon as its chain is
+ * done. When too few chains are left for 'mb' to pay off they are
+ * finished one at a time with 'impl'. */
+static void
+sha256_iterate_lanes( const struct sha256_impl *impl,
+    const struct sha256_multi *mb, uint8_t *digests,
+    const unsigned long *iterations, int n )
+{
+  uint32_t      words[8 * SHA256_MAX_LANES], one[8];
+  unsigned long left[SHA256_MAX_LANES], step;
+  int           job[SHA256_MAX_LANES];
+  int           lanes, lane, active, next = 0, min_active, i;
+
+  min_active = 1;
+  if( mb && impl->blocks != sha256_blocks_generic )
+  {
+    min_active = mb->hw_min_active;
+    if( min_active == 0 )
+      mb = NULL;
+  }
+  lanes = mb ? mb->lanes : 0;
+  memset( words, 0, sizeof( words ) );
+  for( lane = 0; lane < lanes; lane++ )
+    job[lane] = -1;
+
+  for( ;; )
+  {
+    active = 0;
+    step = ~0UL;
+    for( lane = 0; lane < lanes; lane++ )
+    {
+      while( job[lane] < 0 && next < n )
+      {
+        if( iterations[next] )
+        {
+          job[lane] = next;
+          left[lane] = iterations[next];
+          for( i = 0; i < 8; i++ )
+            words[i * lanes + lane] = get_be32( digests + 32 * next + 4 * i );
+        }
+        next++;
+      }
+      if( job[lane] < 0 )
+        continue;
+      active++;
+      if( left[lane] < step )
+        step = left[lane];
+    }
+    if( active == 0 || active < min_active )
+      break;
+    mb->iterate( words, step );
+    for( lane = 0; lane < lanes; lane++ )
+    {
+      if( job[lane] < 0 || ( left[lane] -= step ) )
+        continue;
+      for( i = 0; i < 8; i++ )
+        put_be32( words[i * lanes + lane], digests + 32 * job[lane] + 4 * i );
+      job[lane] = -1;
+    }
+  }
+
+  /* the tail: chains still in a lane, then those never started */
+  for( lane = 0; lane < lanes; lane++ )
+  {
+    if( job[lane] < 0 )
+      continue;
+    for( i = 0; i < 8; i++ )
+      one[i] = words[i * lanes + lane];
+    impl->iterate( one, left[lane] );
+    for( i = 0; i < 8; i++ )
+      put_be32( one[i], digests + 32 * job[lane] + 4 * i );
+  }
+  for( ; next < n; next++ )
+  {
+    for( i = 0; i < 8; i++ )
+      one[i] = get_be32( digests + 32 * next + 4 * i );
+    impl->iterate( one, iterations[next] );
+    for( i = 0; i < 8; i++ )
+      put_be32( one[i], digests + 32 * next + 4 * i );
+  }
+  memset( words, 0, sizeof( words ) );
+  memset( one, 0, sizeof( one ) );
+}
+
+/* Returns 0 if 'mb' agrees with the single chain code 'impl' on more
+ * chains than it has lanes, with uneven lengths including zero. */
+static int
+sha256_multi_self_test( const struct sha256_impl *impl,
+    const struct sha256_multi *mb )
+{
+  uint8_t       a[( SHA256_MAX_LANES + 3 ) * SHA256_DIGEST_SIZE];
+  uint8_t       b[sizeof( a )];
+  unsigned long iterations[SHA256_MAX_LANES + 3];
+  int           n = mb->lanes + 3, k;
+  struct sha256_multi all = *mb;
+
+  for( k = 0; k < n * SHA256_DIGEST_SIZE; k++ )
+    a[k] = k * 37;
+  for( k = 0; k < n; k++ )
+    iterations[k] = k % 5;
+  memcpy( b, a, n * SHA256_DIGEST_SIZE );
+  all.hw_min_active = 1;
+  sha256_iterate_lanes( impl, &all, a, iterations, n );
+  sha256_iterate_lanes( impl, NULL, b, iterations, n );
+  return memcmp( a, b, n * SHA256_DIGEST_SIZE ) ? -1 : 0;
+}
+
+/* Pick the first implementation the CPU supports that passes the known
+ * answer tests. The portable code is used if everything else fails. Then
+ * pick the widest multi-buffer code that agrees with it, if any. */
+static void
+sha256_select( void )
+{
+  unsigned int  k;
+
+  for( k = 0; k < SHA256_IMPLS; k++ )
+  {
+    if( sha256_impls[k].usable && !sha256_impls[k].usable(  ) )
+      continue;
+    if( sha256_self_test( &sha256_impls[k] ) == 0 )
+      break;
+    fprintf( stderr, "sha256: %s implementation failed its self test\n",
+        sha256_impls[k].name );
+  }
+  if( k == SHA256_IMPLS )
+    k = SHA256_IMPLS - 1;
+  sha256_impl = &sha256_impls[k];
+
+  for( k = 0; sha256_multis[k].name; k++ )
+  {
+    if( !sha256_multis[k].usable(  ) )
+      continue;
+    if( sha256_multi_self_test( sha256_impl, &sha256_multis[k] ) == 0 )
+    {
+      sha256_multi = &sha256_multis[k];
+      break;
+    }
+    fprintf( stderr, "sha256: %s multi-buffer code failed its self test\n",
+        sha256_multis[k].name );
+  }
+}
+
+/* Name of the implementation in use, e.g. for verbose output */
+const char   *
+sha256_impl_name( void )
+{
+  pthread_once( &sha256_once, sha256_select );
+  return sha256_impl->name;
+}
+
+/* Switch to the named single chain implementation, e.g. "generic", for
+ * benchmarks and tests. Returns 0 on success, -1 if it is not built in or
+ * the CPU lacks it, -2 if it fails the known answer tests. Not thread
+ * safe against hashing in progress. */
+int
+sha256_set_impl( const char *name )
+{
+  unsigned int  k;
+
+  pthread_once( &sha256_once, sha256_select );
+  for( k = 0; k < SHA256_IMPLS; k++ )
+  {
+    if( strcmp( sha256_impls[k].name, name ) )
+      continue;
+    if( sha256_impls[k].usable && !sha256_impls[k].usable(  ) )
+      return -1;
+    if( sha256_self_test( &sha256_impls[k] ) )
+      return -2;
+    sha256_impl = &sha256_impls[k];
+    return 0;
+  }
+  return -1;
+}
+
+/* Same for the multi-buffer code; NULL turns it off. The forced code is
+ * used whenever at least one lane is busy. */
+int
+sha256_set_multi( const char *name )
+{
+  static struct sha256_multi forced;
+  unsigned int  k;
+
+  pthread_once( &sha256_once, sha256_select );
+  if( name == NULL )
+  {
+    sha256_multi = NULL;
+    return 0;
+  }
+  for( k = 0; sha256_multis[k].name; k++ )
+  {
+    if( strcmp( sha256_multis[k].name, name ) )
+      continue;
+    if( !sha256_multis[k].usable(  ) )
+      return -1;
+    if( sha256_multi_self_test( sha256_impl, &sha256_multis[k] ) )
+      return -2;
+    forced = sha256_multis[k];
+    forced.hw_min_active = 1;
+    sha256_multi = &forced;
+    return 0;
+  }
+  return -1;
+}
+
+/* Name of the multi-buffer implementation, or NULL if there is none */
+const char   *
+sha256_multi_name( void )
+{
+  pthread_once( &sha256_once, sha256_select );
+  return sha256_multi ? sha256_multi->name : NULL;
+}
+
+void
 sha256_init( struct sha256_state *sctx )
 {
-  sctx->state[0] = SHA256_H0;
-  sctx->state[1] = SHA256_H1;
-  sctx->state[2] = SHA256_H2;
-  sctx->state[3] = SHA256_H3;
-  sctx->state[4] = SHA256_H4;
-  sctx->state[5] = SHA256_H5;
-  sctx->state[6] = SHA256_H6;
-  sctx->state[7] = SHA256_H7;
-  sctx->count = 0;
+  pthread_once( &sha256_once, sha256_select );
+  sha256_init_state( sctx );
+}
+
+void
+sha256_update( struct sha256_state *sctx, const uint8_t *data,
+    unsigned int len )
+{
+  sha256_update_blocks( sctx, data, len, sha256_impl->blocks );
+}
+
+void
+sha256_final( struct sha256_state *sctx, uint8_t *out )
+{
+  sha256_final_blocks( sctx, out, sha256_impl->blocks );
 }
 
 void
@@ -246,3 +688,32 @@ sha256hash( const uint8_t *data, unsigned int len, uint8_t *out )
   sha256_update( &sctx, data, len );
   sha256_final( &sctx, out );
 }
+
+/* Replace the 32 byte 'digest' by its SHA-256 hash, 'iterations' times.
+ * Same result as calling sha256hash() on it in a loop, without the
+ * buffering, padding and byte swapping of every round. */
+void
+sha256_iterate( uint8_t *digest, unsigned long iterations )
+{
+  uint32_t      words[SHA256_DIGEST_SIZE / 4];
+  int           i;
+
+  pthread_once( &sha256_once, sha256_select );
+  for( i = 0; i < 8; i++ )
+    words[i] = get_be32( digest + 4 * i );
+  sha256_impl->iterate( words, iterations );
+  for( i = 0; i < 8; i++ )
+    put_be32( words[i], digest + 4 * i );
+  memset( words, 0, sizeof( words ) );
+}
+
+/* Iterate each of the 'n' 32 byte digests at 'digests' its own number of
+ * times, as sha256_iterate() would, several chains at once where the CPU
+ * has wide enough vectors. */
+void
+sha256_iterate_many( uint8_t *digests, const unsigned long *iterations,
+    int n )
+{
+  pthread_once( &sha256_once, sha256_select );
+  sha256_iterate_lanes( sha256_impl, sha256_multi, digests, iterations, n );
+}
@@ -0,0 +1,123 @@
+/* SHA-256 block function for ARMv8 CPUs with the cryptography extension.
+ * Built with a target attribute so the rest of the tree needs no special
+ * compiler flags; only call it when AT_HWCAP reports SHA2. */
+
+#if defined(__aarch64__)
+
+#include <stdint.h>
+#include <arm_neon.h>
+
+#include "sha256.h"
+
+/* Four rounds using message words M0 */
+#define ARMV8_ROUNDS(g, M0) do {					\
+	tmp = vaddq_u32( M0, vld1q_u32( &SHA256_K[4 * (g)] ) );	\
+	abcd = state0;							\
+	state0 = vsha256hq_u32( state0, state1, tmp );			\
+	state1 = vsha256h2q_u32( state1, abcd, tmp );			\
+} while (0)
+
+/* Four rounds, then M0 becomes the words 16 further on */
+#define ARMV8_ROUNDS_SCHED(g, M0, M1, M2, M3) do {			\
+	ARMV8_ROUNDS( g, M0 );						\
+	M0 = vsha256su1q_u32( vsha256su0q_u32( M0, M1 ), M2, M3 );	\
+} while (0)
+
+__attribute__( ( target( "+crypto" ) ) )
+void
+sha256_blocks_armv8( uint32_t *state, const uint8_t *data,
+    unsigned int blocks )
+{
+  uint32x4_t    state0, state1, abcd, tmp, save0, save1;
+  uint32x4_t    m0, m1, m2, m3;
+
+  state0 = vld1q_u32( &state[0] );
+  state1 = vld1q_u32( &state[4] );
+
+  while( blocks-- )
+  {
+    save0 = state0;
+    save1 = state1;
+
+    m0 = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data ) ) );
+    m1 = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data + 16 ) ) );
+    m2 = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data + 32 ) ) );
+    m3 = vreinterpretq_u32_u8( vrev32q_u8( vld1q_u8( data + 48 ) ) );
+
+    ARMV8_ROUNDS_SCHED( 0, m0, m1, m2, m3 );
+    ARMV8_ROUNDS_SCHED( 1, m1, m2, m3, m0 );
+    ARMV8_ROUNDS_SCHED( 2, m2, m3, m0, m1 );
+    ARMV8_ROUNDS_SCHED( 3, m3, m0, m1, m2 );
+    ARMV8_ROUNDS_SCHED( 4, m0, m1, m2, m3 );
+    ARMV8_ROUNDS_SCHED( 5, m1, m2, m3, m0 );
+    ARMV8_ROUNDS_SCHED( 6, m2, m3, m0, m1 );
+    ARMV8_ROUNDS_SCHED( 7, m3, m0, m1, m2 );
+    ARMV8_ROUNDS_SCHED( 8, m0, m1, m2, m3 );
+    ARMV8_ROUNDS_SCHED( 9, m1, m2, m3, m0 );
+    ARMV8_ROUNDS_SCHED( 10, m2, m3, m0, m1 );
+    ARMV8_ROUNDS_SCHED( 11, m3, m0, m1, m2 );
+    ARMV8_ROUNDS( 12, m0 );
+    ARMV8_ROUNDS( 13, m1 );
+    ARMV8_ROUNDS( 14, m2 );
+    ARMV8_ROUNDS( 15, m3 );
+
+    state0 = vaddq_u32( state0, save0 );
+    state1 = vaddq_u32( state1, save1 );
+    data += SHA256_BLOCK_SIZE;
+  }
+
+  vst1q_u32( &state[0], state0 );
+  vst1q_u32( &state[4], state1 );
+}
+
+/* Iterated hash of a 32 byte message. The message and the chaining state
+ * stay in registers; words 8..15 are the fixed padding of 256 bits. */
+__attribute__( ( target( "+crypto" ) ) )
+void
+sha256_iterate_armv8( uint32_t *words, unsigned long iterations )
+{
+  static const uint32_t pad[8] = {
+    0x80000000, 0, 0, 0, 0, 0, 0, SHA256_DIGEST_SIZE * 8
+  };
+  const uint32x4_t pad0 = vld1q_u32( &pad[0] );
+  const uint32x4_t pad1 = vld1q_u32( &pad[4] );
+  const uint32x4_t iv0 = vld1q_u32( &SHA256_IV[0] );
+  const uint32x4_t iv1 = vld1q_u32( &SHA256_IV[4] );
+  uint32x4_t    state0, state1, abcd, tmp;
+  uint32x4_t    m0, m1, m2, m3;
+
+  m0 = vld1q_u32( &words[0] );
+  m1 = vld1q_u32( &words[4] );
+  while( iterations-- )
+  {
+    state0 = iv0;
+    state1 = iv1;
+    m2 = pad0;
+    m3 = pad1;
+
+    ARMV8_ROUNDS_SCHED( 0, m0, m1, m2, m3 );
+    ARMV8_ROUNDS_SCHED( 1, m1, m2, m3, m0 );
+    ARMV8_ROUNDS_SCHED( 2, m2, m3, m0, m1 );
+    ARMV8_ROUNDS_SCHED( 3, m3, m0, m1, m2 );
+    ARMV8_ROUNDS_SCHED( 4, m0, m1, m2, m3 );
+    ARMV8_ROUNDS_SCHED( 5, m1, m2, m3, m0 );
+    ARMV8_ROUNDS_SCHED( 6, m2, m3, m0, m1 );
+    ARMV8_ROUNDS_SCHED( 7, m3, m0, m1, m2 );
+    ARMV8_ROUNDS_SCHED( 8, m0, m1, m2, m3 );
+    ARMV8_ROUNDS_SCHED( 9, m1, m2, m3, m0 );
+    ARMV8_ROUNDS_SCHED( 10, m2, m3, m0, m1 );
+    ARMV8_ROUNDS_SCHED( 11, m3, m0, m1, m2 );
+    ARMV8_ROUNDS( 12, m0 );
+    ARMV8_ROUNDS( 13, m1 );
+    ARMV8_ROUNDS( 14, m2 );
+    ARMV8_ROUNDS( 15, m3 );
+
+    /* the digest is the next message */
+    m0 = vaddq_u32( state0, iv0 );
+    m1 = vaddq_u32( state1, iv1 );
+  }
+  vst1q_u32( &words[0], m0 );
+  vst1q_u32( &words[4], m1 );
+}
+
+#endif
@@ -0,0 +1,311 @@
+/* SHA-256 code for x86 CPUs: a block function for the SHA extensions
+ * (SHA-NI) and multi-buffer iterated hashes for AVX2 and AVX-512.
+ * Built with target attributes so the rest of the tree needs no special
+ * compiler flags; only call a function when CPUID reports what its target
+ * attribute names. */
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "sha256.h"
+
+/* Four rounds using message words M0, then extend the schedule: M0 becomes
+ * the words 16 further on, built from M0..M3. */
+#define SHANI_ROUNDS_SCHED(g, M0, M1, M2, M3) do {			\
+	msg = _mm_add_epi32( M0,					\
+	    _mm_loadu_si128( ( const __m128i * ) &SHA256_K[4 * (g)] ) ); \
+	state1 = _mm_sha256rnds2_epu32( state1, state0, msg );		\
+	tmp = _mm_add_epi32( _mm_sha256msg1_epu32( M0, M1 ),		\
+	    _mm_alignr_epi8( M3, M2, 4 ) );				\
+	M0 = _mm_sha256msg2_epu32( tmp, M3 );				\
+	msg = _mm_shuffle_epi32( msg, 0x0e );				\
+	state0 = _mm_sha256rnds2_epu32( state0, state1, msg );		\
+} while (0)
+
+/* The last four groups need no further schedule */
+#define SHANI_ROUNDS(g, M0) do {					\
+	msg = _mm_add_epi32( M0,					\
+	    _mm_loadu_si128( ( const __m128i * ) &SHA256_K[4 * (g)] ) ); \
+	state1 = _mm_sha256rnds2_epu32( state1, state0, msg );		\
+	msg = _mm_shuffle_epi32( msg, 0x0e );				\
+	state0 = _mm_sha256rnds2_epu32( state0, state1, msg );		\
+} while (0)
+
+__attribute__( ( target( "sha,ssse3,sse4.1" ) ) )
+void
+sha256_blocks_shani( uint32_t *state, const uint8_t *data,
+    unsigned int blocks )
+{
+  const __m128i bswap = _mm_set_epi64x( 0x0c0d0e0f08090a0bULL,
+      0x0405060700010203ULL );
+  __m128i       state0, state1, msg, tmp, abef, cdgh;
+  __m128i       m0, m1, m2, m3;
+
+  /* the instructions want the state as ABEF and CDGH */
+  tmp = _mm_shuffle_epi32( _mm_loadu_si128( ( const __m128i * ) &state[0] ),
+      0xb1 );
+  state1 = _mm_shuffle_epi32( _mm_loadu_si128( ( const __m128i * )
+          &state[4] ), 0x1b );
+  state0 = _mm_alignr_epi8( tmp, state1, 8 );
+  state1 = _mm_blend_epi16( state1, tmp, 0xf0 );
+
+  while( blocks-- )
+  {
+    abef = state0;
+    cdgh = state1;
+
+    m0 = _mm_shuffle_epi8( _mm_loadu_si128( ( const __m128i * ) data ),
+        bswap );
+    m1 = _mm_shuffle_epi8( _mm_loadu_si128( ( const __m128i * ) ( data +
+                16 ) ), bswap );
+    m2 = _mm_shuffle_epi8( _mm_loadu_si128( ( const __m128i * ) ( data +
+                32 ) ), bswap );
+    m3 = _mm_shuffle_epi8( _mm_loadu_si128( ( const __m128i * ) ( data +
+                48 ) ), bswap );
+
+    SHANI_ROUNDS_SCHED( 0, m0, m1, m2, m3 );
+    SHANI_ROUNDS_SCHED( 1, m1, m2, m3, m0 );
+    SHANI_ROUNDS_SCHED( 2, m2, m3, m0, m1 );
+    SHANI_ROUNDS_SCHED( 3, m3, m0, m1, m2 );
+    SHANI_ROUNDS_SCHED( 4, m0, m1, m2, m3 );
+    SHANI_ROUNDS_SCHED( 5, m1, m2, m3, m0 );
+    SHANI_ROUNDS_SCHED( 6, m2, m3, m0, m1 );
+    SHANI_ROUNDS_SCHED( 7, m3, m0, m1, m2 );
+    SHANI_ROUNDS_SCHED( 8, m0, m1, m2, m3 );
+    SHANI_ROUNDS_SCHED( 9, m1, m2, m3, m0 );
+    SHANI_ROUNDS_SCHED( 10, m2, m3, m0, m1 );
+    SHANI_ROUNDS_SCHED( 11, m3, m0, m1, m2 );
+    SHANI_ROUNDS( 12, m0 );
+    SHANI_ROUNDS( 13, m1 );
+    SHANI_ROUNDS( 14, m2 );
+    SHANI_ROUNDS( 15, m3 );
+
+    state0 = _mm_add_epi32( state0, abef );
+    state1 = _mm_add_epi32( state1, cdgh );
+    data += SHA256_BLOCK_SIZE;
+  }
+
+  /* back to ABCD and EFGH */
+  tmp = _mm_shuffle_epi32( state0, 0x1b );
+  state1 = _mm_shuffle_epi32( state1, 0xb1 );
+  state0 = _mm_blend_epi16( tmp, state1, 0xf0 );
+  state1 = _mm_alignr_epi8( state1, tmp, 8 );
+  _mm_storeu_si128( ( __m128i * ) &state[0], state0 );
+  _mm_storeu_si128( ( __m128i * ) &state[4], state1 );
+}
+
+/* Iterated hash of a 32 byte message. The message and the chaining state
+ * stay in registers; words 8..15 are the fixed padding of 256 bits. */
+__attribute__( ( target( "sha,ssse3,sse4.1" ) ) )
+void
+sha256_iterate_shani( uint32_t *words, unsigned long iterations )
+{
+  const __m128i pad0 = _mm_set_epi32( 0, 0, 0, 0x80000000 );
+  const __m128i pad1 = _mm_set_epi32( SHA256_DIGEST_SIZE * 8, 0, 0, 0 );
+  __m128i       state0, state1, msg, tmp, iv0, iv1;
+  __m128i       m0, m1, m2, m3;
+
+  /* the initial state as ABEF and CDGH */
+  tmp = _mm_shuffle_epi32( _mm_loadu_si128( ( const __m128i * )
+          &SHA256_IV[0] ), 0xb1 );
+  iv1 = _mm_shuffle_epi32( _mm_loadu_si128( ( const __m128i * )
+          &SHA256_IV[4] ), 0x1b );
+  iv0 = _mm_alignr_epi8( tmp, iv1, 8 );
+  iv1 = _mm_blend_epi16( iv1, tmp, 0xf0 );
+
+  m0 = _mm_loadu_si128( ( const __m128i * ) &words[0] );
+  m1 = _mm_loadu_si128( ( const __m128i * ) &words[4] );
+  while( iterations-- )
+  {
+    state0 = iv0;
+    state1 = iv1;
+    m2 = pad0;
+    m3 = pad1;
+
+    SHANI_ROUNDS_SCHED( 0, m0, m1, m2, m3 );
+    SHANI_ROUNDS_SCHED( 1, m1, m2, m3, m0 );
+    SHANI_ROUNDS_SCHED( 2, m2, m3, m0, m1 );
+    SHANI_ROUNDS_SCHED( 3, m3, m0, m1, m2 );
+    SHANI_ROUNDS_SCHED( 4, m0, m1, m2, m3 );
+    SHANI_ROUNDS_SCHED( 5, m1, m2, m3, m0 );
+    SHANI_ROUNDS_SCHED( 6, m2, m3, m0, m1 );
+    SHANI_ROUNDS_SCHED( 7, m3, m0, m1, m2 );
+    SHANI_ROUNDS_SCHED( 8, m0, m1, m2, m3 );
+    SHANI_ROUNDS_SCHED( 9, m1, m2, m3, m0 );
+    SHANI_ROUNDS_SCHED( 10, m2, m3, m0, m1 );
+    SHANI_ROUNDS_SCHED( 11, m3, m0, m1, m2 );
+    SHANI_ROUNDS( 12, m0 );
+    SHANI_ROUNDS( 13, m1 );
+    SHANI_ROUNDS( 14, m2 );
+    SHANI_ROUNDS( 15, m3 );
+
+    /* the digest, as ABCD and EFGH, is the next message */
+    state0 = _mm_add_epi32( state0, iv0 );
+    state1 = _mm_add_epi32( state1, iv1 );
+    tmp = _mm_shuffle_epi32( state0, 0x1b );
+    state1 = _mm_shuffle_epi32( state1, 0xb1 );
+    m0 = _mm_blend_epi16( tmp, state1, 0xf0 );
+    m1 = _mm_alignr_epi8( state1, tmp, 8 );
+  }
+  _mm_storeu_si128( ( __m128i * ) &words[0], m0 );
+  _mm_storeu_si128( ( __m128i * ) &words[4], m1 );
+}
+
+/* Multi-buffer iterated hashes: 8 (AVX2) or 16 (AVX-512) independent
+ * 32 byte chains, one per vector lane. 'words' holds word j of lane l at
+ * words[j * lanes + l]. The schedule is kept as a ring of 16 vectors. */
+
+#define MB_ROUND(i, ADD, ROR, SHR, XOR, AND, OR, ANDNOT, SET1) do {	\
+	if( (i) >= 16 )							\
+	  w[(i) & 15] = ADD( ADD( w[(i) & 15], w[((i) - 7) & 15] ),	\
+	      ADD( XOR( XOR( ROR( w[((i) - 15) & 15], 7 ),		\
+	              ROR( w[((i) - 15) & 15], 18 ) ),			\
+	              SHR( w[((i) - 15) & 15], 3 ) ),			\
+	          XOR( XOR( ROR( w[((i) - 2) & 15], 17 ),		\
+	              ROR( w[((i) - 2) & 15], 19 ) ),			\
+	              SHR( w[((i) - 2) & 15], 10 ) ) ) );		\
+	t1 = ADD( ADD( ADD( h, XOR( XOR( ROR( e, 6 ), ROR( e, 11 ) ),	\
+	            ROR( e, 25 ) ) ),					\
+	        OR( AND( e, f ), ANDNOT( e, g ) ) ),			\
+	    ADD( SET1( SHA256_K[i] ), w[(i) & 15] ) );			\
+	t2 = ADD( XOR( XOR( ROR( a, 2 ), ROR( a, 13 ) ), ROR( a, 22 ) ),	\
+	    OR( AND( a, b ), AND( c, OR( a, b ) ) ) );			\
+	h = g;								\
+	g = f;								\
+	f = e;								\
+	e = ADD( d, t1 );						\
+	d = c;								\
+	c = b;								\
+	b = a;								\
+	a = ADD( t1, t2 );						\
+} while (0)
+
+#define AVX2_ROR(x, n) _mm256_or_si256( _mm256_srli_epi32( x, n ),	\
+	    _mm256_slli_epi32( x, 32 - (n) ) )
+#define AVX2_ROUND(i) MB_ROUND( i, _mm256_add_epi32, AVX2_ROR,		\
+	    _mm256_srli_epi32, _mm256_xor_si256, _mm256_and_si256,	\
+	    _mm256_or_si256, _mm256_andnot_si256, _mm256_set1_epi32 )
+
+__attribute__( ( target( "avx2" ) ) )
+void
+sha256_iterate_x8_avx2( uint32_t *words, unsigned long iterations )
+{
+  __m256i       m[8], w[16];
+  __m256i       a, b, c, d, e, f, g, h, t1, t2;
+  int           i;
+
+  for( i = 0; i < 8; i++ )
+    m[i] = _mm256_loadu_si256( ( const __m256i * ) &words[i * 8] );
+  while( iterations-- )
+  {
+    for( i = 0; i < 8; i++ )
+      w[i] = m[i];
+    w[8] = _mm256_set1_epi32( 0x80000000 );
+    for( i = 9; i < 15; i++ )
+      w[i] = _mm256_setzero_si256(  );
+    w[15] = _mm256_set1_epi32( SHA256_DIGEST_SIZE * 8 );
+    a = _mm256_set1_epi32( SHA256_IV[0] );
+    b = _mm256_set1_epi32( SHA256_IV[1] );
+    c = _mm256_set1_epi32( SHA256_IV[2] );
+    d = _mm256_set1_epi32( SHA256_IV[3] );
+    e = _mm256_set1_epi32( SHA256_IV[4] );
+    f = _mm256_set1_epi32( SHA256_IV[5] );
+    g = _mm256_set1_epi32( SHA256_IV[6] );
+    h = _mm256_set1_epi32( SHA256_IV[7] );
+#pragma GCC unroll 64
+    for( i = 0; i < 64; i++ )
+      AVX2_ROUND( i );
+    m[0] = _mm256_add_epi32( a, _mm256_set1_epi32( SHA256_IV[0] ) );
+    m[1] = _mm256_add_epi32( b, _mm256_set1_epi32( SHA256_IV[1] ) );
+    m[2] = _mm256_add_epi32( c, _mm256_set1_epi32( SHA256_IV[2] ) );
+    m[3] = _mm256_add_epi32( d, _mm256_set1_epi32( SHA256_IV[3] ) );
+    m[4] = _mm256_add_epi32( e, _mm256_set1_epi32( SHA256_IV[4] ) );
+    m[5] = _mm256_add_epi32( f, _mm256_set1_epi32( SHA256_IV[5] ) );
+    m[6] = _mm256_add_epi32( g, _mm256_set1_epi32( SHA256_IV[6] ) );
+    m[7] = _mm256_add_epi32( h, _mm256_set1_epi32( SHA256_IV[7] ) );
+  }
+  for( i = 0; i < 8; i++ )
+    _mm256_storeu_si256( ( __m256i * ) &words[i * 8], m[i] );
+}
+
+/* AVX-512F has a rotate and a three input logic instruction; Ch and Maj
+ * collapse to one ternarylogic each (truth tables 0xca and 0xe8). */
+#define AVX512_ROUND(i) do {						\
+	if( (i) >= 16 )							\
+	  w[(i) & 15] = _mm512_add_epi32(				\
+	      _mm512_add_epi32( w[(i) & 15], w[((i) - 7) & 15] ),	\
+	      _mm512_add_epi32(						\
+	          _mm512_ternarylogic_epi32(				\
+	              _mm512_ror_epi32( w[((i) - 15) & 15], 7 ),	\
+	              _mm512_ror_epi32( w[((i) - 15) & 15], 18 ),	\
+	              _mm512_srli_epi32( w[((i) - 15) & 15], 3 ), 0x96 ), \
+	          _mm512_ternarylogic_epi32(				\
+	              _mm512_ror_epi32( w[((i) - 2) & 15], 17 ),		\
+	              _mm512_ror_epi32( w[((i) - 2) & 15], 19 ),		\
+	              _mm512_srli_epi32( w[((i) - 2) & 15], 10 ), 0x96 ) ) ); \
+	t1 = _mm512_add_epi32( _mm512_add_epi32( h,			\
+	        _mm512_ternarylogic_epi32( _mm512_ror_epi32( e, 6 ),	\
+	            _mm512_ror_epi32( e, 11 ), _mm512_ror_epi32( e, 25 ),	\
+	            0x96 ) ),						\
+	    _mm512_add_epi32( _mm512_ternarylogic_epi32( e, f, g, 0xca ),	\
+	        _mm512_add_epi32( _mm512_set1_epi32( SHA256_K[i] ),	\
+	            w[(i) & 15] ) ) );					\
+	t2 = _mm512_add_epi32( _mm512_ternarylogic_epi32(		\
+	        _mm512_ror_epi32( a, 2 ), _mm512_ror_epi32( a, 13 ),	\
+	        _mm512_ror_epi32( a, 22 ), 0x96 ),			\
+	    _mm512_ternarylogic_epi32( a, b, c, 0xe8 ) );		\
+	h = g;								\
+	g = f;								\
+	f = e;								\
+	e = _mm512_add_epi32( d, t1 );					\
+	d = c;								\
+	c = b;								\
+	b = a;								\
+	a = _mm512_add_epi32( t1, t2 );					\
+} while (0)
+
+__attribute__( ( target( "avx512f" ) ) )
+void
+sha256_iterate_x16_avx512( uint32_t *words, unsigned long iterations )
+{
+  __m512i       m[8], w[16];
+  __m512i       a, b, c, d, e, f, g, h, t1, t2;
+  int           i;
+
+  for( i = 0; i < 8; i++ )
+    m[i] = _mm512_loadu_si512( &words[i * 16] );
+  while( iterations-- )
+  {
+    for( i = 0; i < 8; i++ )
+      w[i] = m[i];
+    w[8] = _mm512_set1_epi32( 0x80000000 );
+    for( i = 9; i < 15; i++ )
+      w[i] = _mm512_setzero_si512(  );
+    w[15] = _mm512_set1_epi32( SHA256_DIGEST_SIZE * 8 );
+    a = _mm512_set1_epi32( SHA256_IV[0] );
+    b = _mm512_set1_epi32( SHA256_IV[1] );
+    c = _mm512_set1_epi32( SHA256_IV[2] );
+    d = _mm512_set1_epi32( SHA256_IV[3] );
+    e = _mm512_set1_epi32( SHA256_IV[4] );
+    f = _mm512_set1_epi32( SHA256_IV[5] );
+    g = _mm512_set1_epi32( SHA256_IV[6] );
+    h = _mm512_set1_epi32( SHA256_IV[7] );
+#pragma GCC unroll 64
+    for( i = 0; i < 64; i++ )
+      AVX512_ROUND( i );
+    m[0] = _mm512_add_epi32( a, _mm512_set1_epi32( SHA256_IV[0] ) );
+    m[1] = _mm512_add_epi32( b, _mm512_set1_epi32( SHA256_IV[1] ) );
+    m[2] = _mm512_add_epi32( c, _mm512_set1_epi32( SHA256_IV[2] ) );
+    m[3] = _mm512_add_epi32( d, _mm512_set1_epi32( SHA256_IV[3] ) );
+    m[4] = _mm512_add_epi32( e, _mm512_set1_epi32( SHA256_IV[4] ) );
+    m[5] = _mm512_add_epi32( f, _mm512_set1_epi32( SHA256_IV[5] ) );
+    m[6] = _mm512_add_epi32( g, _mm512_set1_epi32( SHA256_IV[6] ) );
+    m[7] = _mm512_add_epi32( h, _mm512_set1_epi32( SHA256_IV[7] ) );
+  }
+  for( i = 0; i < 8; i++ )
+    _mm512_storeu_si512( &words[i * 16], m[i] );
+}
+
+#endif
@@ -0,0 +1,489 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/timerfd.h>
+
+#include "sg_lib.h"
+#include "sg_pt.h"
+#include "sg_pt_linux.h"
+#include "sg_unaligned.h"
+#include "sg_pr2serr.h"
+#include "kdf.h"
+#include "wd_emu.h"
+
+/* Geometry and limits of an emulated drive, as reported by a My Passport
+ * with an AES-256 bridge (see doc/WD_Encryption_API.txt) */
+#define EMU_BLOCK_LEN     512
+#define EMU_HANDY_BLOCKS  32
+#define EMU_MAX_XFER      8
+#define EMU_KEY_LEN       32
+#define EMU_CIPHER        0x28	/* AES 256 XTS */
+#define EMU_MAX_ATTEMPTS  5
+#define EMU_ITERATIONS    1000
+
+void          sg_build_sense_buffer( bool desc, uint8_t * sbp, uint8_t skey,
+                                     uint8_t asc, uint8_t ascq );
+
+/* Vendor default password of AES-256 drives: security status 0 */
+static const uint8_t emu_default_key[EMU_KEY_LEN] = {
+  0x03, 0x14, 0x15, 0x92, 0x65, 0x35, 0x89, 0x79,
+  0x32, 0x38, 0x46, 0x26, 0x43, 0x38, 0x32, 0x79,
+  0xFC, 0xEB, 0xEA, 0x6D, 0x9A, 0xCA, 0x76, 0x86,
+  0xCD, 0xC7, 0xB9, 0xD9, 0xBC, 0xC7, 0xCD, 0x86
+};
+
+struct wd_emu_drive
+{
+  pthread_mutex_t lock;		/* sessions of several threads may share it */
+  bool          ready;		/* state set up on first open */
+  uint8_t       security;
+  uint8_t       cipher;
+  uint8_t       key[EMU_KEY_LEN];	/* password blob that unlocks */
+  int           attempts;	/* failed unlocks since power on */
+  uint32_t      reset_enabler;	/* from the last ENCRYPTION STATUS, or 0 */
+  unsigned int  seed;
+  uint8_t       handy[EMU_HANDY_BLOCKS * EMU_BLOCK_LEN];
+};
+
+/* One open session: the timerfd stands in for the sg file descriptor */
+struct wd_emu_session
+{
+  struct wd_emu_drive *drive;
+  int           index;
+};
+
+static struct
+{
+  int           count;
+  unsigned int  latency_us;
+  unsigned int  fail_pct;
+  char          password[KDF_MAX_PASSWD + 1];
+  struct wd_emu_drive *drives;
+} emu;
+
+/* Parses "COUNT[,LATENCY_US[,FAIL_PCT[,PASSWORD]]]": COUNT drives, each
+ * command taking LATENCY_US and failing with a transport error FAIL_PCT
+ * percent of the time, locked with PASSWORD. Returns 0 or -1. */
+int
+wd_emu_configure( const char *spec )
+{
+  unsigned long val[3] = { 0, 0, 0 };
+  const char   *p = spec;
+  char         *end;
+  int           k;
+
+  for( k = 0; k < 3; k++ )
+  {
+    val[k] = strtoul( p, &end, 10 );
+    if( end == p || ( *end && *end != ',' ) )
+      return -1;
+    p = end;
+    if( *p == '\0' )
+      break;
+    p++;
+  }
+  if( val[0] < 1 || val[0] > WD_EMU_MAX_DRIVES || val[1] > 10000000 ||
+      val[2] > 100 || strlen( p ) > KDF_MAX_PASSWD )
+    return -1;
+  emu.count = val[0];
+  emu.latency_us = val[1];
+  emu.fail_pct = val[2];
+  snprintf( emu.password, sizeof( emu.password ), "%s",
+      k == 3 && *p ? p : WD_EMU_PASSWORD );
+  /* pages of drives never opened are never touched */
+  emu.drives = calloc( emu.count, sizeof( *emu.drives ) );
+  if( emu.drives == NULL )
+    return -1;
+  for( k = 0; k < emu.count; k++ )
+    pthread_mutex_init( &emu.drives[k].lock, NULL );
+  return 0;
+}
+
+int
+wd_emu_count( void )
+{
+  return emu.count;
+}
+
+bool
+wd_emu_device( const char *device_name )
+{
+  return 0 == strncmp( device_name, WD_EMU_PREFIX,
+      sizeof( WD_EMU_PREFIX ) - 1 );
+}
+
+/* Same contract as find_passport_devices() */
+int
+wd_emu_devices( char ***devices )
+{
+  int           k;
+
+  *devices = calloc( emu.count + 1, sizeof( char * ) );
+  if( *devices == NULL )
+    return 0;
+  for( k = 0; k < emu.count; k++ )
+    if( asprintf( &( *devices )[k], WD_EMU_PREFIX "%d", k ) < 0 )
+    {
+      ( *devices )[k] = NULL;
+      break;
+    }
+  return k;
+}
+
+/* Power on: locked with the configured password, handy blocks 1 and 2
+ * written the way the WD software leaves them */
+static void
+emu_drive_init( struct wd_emu_drive *d, int index )
+{
+  struct kdf_params kp;
+  uint8_t      *block, sum;
+  const char   *hint = "emulated drive";
+  char          label[33];
+  int           i, k;
+
+  d->cipher = EMU_CIPHER;
+  d->seed = index * 2654435761u + 1;
+  for( k = 1; k <= 2; k++ )
+  {
+    block = d->handy + k * EMU_BLOCK_LEN;
+    block[1] = k;
+    block[2] = 'W';
+    block[3] = 'D';
+  }
+  block = d->handy + EMU_BLOCK_LEN;
+  memset( &kp, 0, sizeof( kp ) );
+  kp.iterations = EMU_ITERATIONS;
+  kdf_params_write( &kp, block );
+  memcpy( block + 12, "W\0D\0C\0.\0", 8 );
+  for( i = 0; hint[i]; i++ )
+    block[24 + 2 * i] = hint[i];
+  snprintf( label, sizeof( label ), "Emulated %d", index );
+  for( i = 0; label[i]; i++ )
+    block[EMU_BLOCK_LEN + 8 + 2 * i] = label[i];
+  for( k = 1; k <= 2; k++ )
+  {
+    block = d->handy + k * EMU_BLOCK_LEN;
+    for( sum = i = 0; i < EMU_BLOCK_LEN - 1; i++ )
+      sum += block[i];
+    block[EMU_BLOCK_LEN - 1] = -sum;
+  }
+  kdf_params_read( d->handy + EMU_BLOCK_LEN, &kp );
+  if( kdf_derive( &kp, emu.password, d->key ) )
+    d->security = 1;
+  else
+    memcpy( d->key, emu_default_key, EMU_KEY_LEN );
+  d->ready = true;
+}
+
+int
+wd_emu_open( struct scsi_op_t *op )
+{
+  struct wd_emu_session *s;
+  char         *end;
+  long          index;
+
+  index = strtol( op->device_name + sizeof( WD_EMU_PREFIX ) - 1, &end, 10 );
+  if( *end || index < 0 || index >= emu.count )
+  {
+    pr2serr( "%s: no such emulated drive\n", op->device_name );
+    return SG_LIB_CAT_OTHER;
+  }
+  if( NULL == ( s = calloc( 1, sizeof( *s ) ) ) )
+    return SG_LIB_CAT_OTHER;
+  s->drive = &emu.drives[index];
+  s->index = index;
+  op->sg_fd = timerfd_create( CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC );
+  op->ptvp = construct_scsi_pt_obj_with_fd( -1, 0 );
+  if( op->sg_fd < 0 || op->ptvp == NULL )
+  {
+    pr2serr( "%s: cannot open: %s\n", op->device_name,
+        safe_strerror( errno ) );
+    if( op->ptvp )
+      destruct_scsi_pt_obj( op->ptvp );
+    if( op->sg_fd >= 0 )
+      close( op->sg_fd );
+    op->ptvp = NULL;
+    op->sg_fd = -1;
+    free( s );
+    return SG_LIB_CAT_OTHER;
+  }
+  pthread_mutex_lock( &s->drive->lock );
+  if( !s->drive->ready )
+    emu_drive_init( s->drive, index );
+  pthread_mutex_unlock( &s->drive->lock );
+  op->emu = s;
+  return 0;
+}
+
+void
+wd_emu_close( struct scsi_op_t *op )
+{
+  destruct_scsi_pt_obj( op->ptvp );
+  close( op->sg_fd );
+  free( op->emu );
+  op->emu = NULL;
+  op->ptvp = NULL;
+  op->sg_fd = -1;
+}
+
+/* Fails the command with CHECK CONDITION and fixed format sense */
+static int
+emu_sense( struct scsi_op_t *op, int *sense_len, uint8_t key, uint8_t asc,
+    uint8_t ascq )
+{
+  memset( op->sense, 0, 18 );
+  sg_build_sense_buffer( false, op->sense, key, asc, ascq );
+  *sense_len = 18;
+  return SAM_STAT_CHECK_CONDITION;
+}
+
+/* Copies len bytes of reply data; the rest of the transfer is residual */
+static int
+emu_data_in( struct scsi_op_t *op, const uint8_t *data, int len, int alloc )
+{
+  if( len > alloc )
+    len = alloc;
+  if( len > op->data_len )
+    len = op->data_len;
+  memcpy( op->reply, data, len );
+  return op->data_len - len;
+}
+
+static int
+emu_state_error( struct scsi_op_t *op, int *sense_len,
+    struct wd_emu_drive *d )
+{
+  return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x74,
+      d->security == 6 ? 0x80 : 0x81 );
+}
+
+/* Runs the command of op on drive d (locked) the way the bridge chip
+ * does. Returns the SCSI status; sets *sense_len and *resid. */
+static int
+emu_exec( struct scsi_op_t *op, struct wd_emu_drive *d, int index,
+    int *sense_len, int *resid )
+{
+  const uint8_t *cdb = op->cdb, *par = op->cmdout;
+  uint8_t       buf[EMU_BLOCK_LEN];
+  uint32_t      lba, count, enabler = d->reset_enabler;
+  int           len = sg_get_unaligned_be16( &cdb[7] );
+
+  *sense_len = 0;
+  *resid = 0;
+  d->reset_enabler = 0;		// any command but a status voids it
+  memset( buf, 0, sizeof( buf ) );
+  switch ( cdb[0] )
+  {
+    case 0x00:			// TEST UNIT READY
+      return SAM_STAT_GOOD;
+    case 0x12:			// INQUIRY
+      if( cdb[1] & 1 )
+      {
+	if( cdb[2] != 0x80 )
+	  return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x24, 0 );
+	buf[1] = 0x80;
+	buf[3] = snprintf( ( char * ) buf + 4, 60, "WXEMU%07d", index );
+	*resid = emu_data_in( op, buf, 4 + buf[3], cdb[4] );
+	return SAM_STAT_GOOD;
+      }
+      buf[2] = 6;
+      buf[3] = 2;
+      buf[4] = 31;
+      memcpy( buf + 8, "WD      My Passport 0820EMU1", 28 );
+      *resid = emu_data_in( op, buf, 36, cdb[4] );
+      return SAM_STAT_GOOD;
+    case 0xC0:			// ENCRYPTION STATUS
+      if( cdb[1] != 0x45 )
+	return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x24, 0 );
+      d->reset_enabler = rand_r( &d->seed ) | 1;
+      buf[0] = 0x45;
+      buf[3] = d->security;
+      buf[4] = d->cipher;
+      sg_put_unaligned_be16( EMU_KEY_LEN, &buf[6] );
+      sg_put_unaligned_be32( d->reset_enabler, &buf[8] );
+      buf[15] = 1;
+      buf[16] = d->cipher;
+      *resid = emu_data_in( op, buf, 17, len );
+      return SAM_STAT_GOOD;
+    case 0xC1:
+      if( !op->dir_inout || op->data_len < len || len < 8 ||
+	  par[0] != 0x45 )
+	return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x26, 0 );
+      switch ( cdb[1] )
+      {
+	case 0xE1:		// UNLOCK ENCRYPTION
+	  if( len != 8 + EMU_KEY_LEN )
+	    return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x24,
+		0 );
+	  if( sg_get_unaligned_be16( &par[6] ) != EMU_KEY_LEN )
+	    return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x26,
+		0 );
+	  if( d->security != 1 )
+	    return emu_state_error( op, sense_len, d );
+	  if( memcmp( par + 8, d->key, EMU_KEY_LEN ) )
+	  {
+	    if( ++d->attempts >= EMU_MAX_ATTEMPTS )
+	      d->security = 6;
+	    return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x74,
+		0x40 );
+	  }
+	  d->attempts = 0;
+	  d->security = 2;
+	  return SAM_STAT_GOOD;
+	case 0xE2:		// CHANGE ENCRYPTION PASSPHRASE
+	  if( len != 8 + 2 * EMU_KEY_LEN )
+	    return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x24,
+		0 );
+	  if( sg_get_unaligned_be16( &par[6] ) != EMU_KEY_LEN ||
+	      ( par[3] & 0x11 ) == 0x11 )
+	    return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x26,
+		0 );
+	  if( d->security != ( par[3] & 0x01 ? 0 : 2 ) )
+	    return emu_state_error( op, sense_len, d );
+	  if( !( par[3] & 0x01 ) && memcmp( par + 8, d->key, EMU_KEY_LEN ) )
+	  {
+	    if( ++d->attempts >= EMU_MAX_ATTEMPTS )
+	      d->security = 6;
+	    return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x74,
+		0x40 );
+	  }
+	  if( par[3] & 0x10 )
+	  {
+	    memcpy( d->key, emu_default_key, EMU_KEY_LEN );
+	    d->security = 0;
+	  }
+	  else
+	  {
+	    memcpy( d->key, par + 8 + EMU_KEY_LEN, EMU_KEY_LEN );
+	    d->security = 2;
+	  }
+	  return SAM_STAT_GOOD;
+	case 0xE3:		// RESET DATA ENCRYPTION KEY
+	  if( enabler == 0 || sg_get_unaligned_be32( &cdb[2] ) != enabler ||
+	      len != 8 + EMU_KEY_LEN )
+	    return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x24,
+		0 );
+	  if( par[4] != d->cipher )
+	    return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x26,
+		0 );
+	  memcpy( d->key, emu_default_key, EMU_KEY_LEN );
+	  d->security = 0;
+	  d->attempts = 0;
+	  return SAM_STAT_GOOD;
+      }
+      return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x24, 0 );
+    case 0xD5:			// READ HANDY CAPACITY
+      sg_put_unaligned_be32( EMU_HANDY_BLOCKS - 1, &buf[0] );
+      sg_put_unaligned_be32( EMU_BLOCK_LEN, &buf[4] );
+      sg_put_unaligned_be16( EMU_MAX_XFER, &buf[10] );
+      *resid = emu_data_in( op, buf, 12, op->data_len );
+      return SAM_STAT_GOOD;
+    case 0xD8:			// READ HANDY STORE
+    case 0xDA:			// WRITE HANDY STORE
+      lba = sg_get_unaligned_be32( &cdb[2] );
+      count = len;
+      if( count > EMU_MAX_XFER )
+	return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x24, 0 );
+      if( lba >= EMU_HANDY_BLOCKS || count > EMU_HANDY_BLOCKS - lba )
+	return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x21, 0 );
+      if( op->data_len < ( int ) count * EMU_BLOCK_LEN )
+	return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x24, 0 );
+      if( cdb[0] == 0xD8 )
+      {
+	memcpy( op->reply, d->handy + lba * EMU_BLOCK_LEN,
+	    count * EMU_BLOCK_LEN );
+	*resid = op->data_len - count * EMU_BLOCK_LEN;
+	return SAM_STAT_GOOD;
+      }
+      if( d->security != 0 && d->security != 2 )
+	return emu_sense( op, sense_len, SPC_SK_DATA_PROTECT, 0x74, 0x71 );
+      memcpy( d->handy + lba * EMU_BLOCK_LEN, op->cmdout,
+	  count * EMU_BLOCK_LEN );
+      return SAM_STAT_GOOD;
+  }
+  return emu_sense( op, sense_len, SPC_SK_ILLEGAL_REQUEST, 0x20, 0 );
+}
+
+/* Executes the command of op once its latency has passed */
+static void
+emu_complete( struct scsi_op_t *op, uint64_t ns )
+{
+  struct wd_emu_session *s = op->emu;
+  struct wd_emu_drive *d = s->drive;
+  int           status, sense_len, resid;
+  bool          fail;
+
+  pthread_mutex_lock( &d->lock );
+  fail = emu.fail_pct && rand_r( &d->seed ) % 100 < emu.fail_pct;
+  if( fail )
+    status = sense_len = resid = 0;
+  else
+    status = emu_exec( op, d, s->index, &sense_len, &resid );
+  pthread_mutex_unlock( &d->lock );
+  set_scsi_pt_emulated( op->ptvp, status, fail ? 0x07 : 0, sense_len,
+      fail ? op->data_len : resid, 0, ns );
+}
+
+/* Synchronous command: sleeps through the latency, like do_scsi_pt() */
+int
+wd_emu_xfer( struct scsi_op_t *op )
+{
+  struct timespec ts;
+  uint64_t      t0 = scsi_clock_ns(  );
+
+  if( emu.latency_us )
+  {
+    ts.tv_sec = emu.latency_us / 1000000;
+    ts.tv_nsec = emu.latency_us % 1000000 * 1000;
+    while( nanosleep( &ts, &ts ) < 0 && errno == EINTR )
+      ;
+  }
+  emu_complete( op, scsi_clock_ns(  ) - t0 );
+  return 0;
+}
+
+/* Fails the command with OS error err, kept in the pass-through object
+ * like do_scsi_pt() does so that scsi_xfer_complete() reports it */
+static int
+emu_os_error( struct scsi_op_t *op, int err )
+{
+  set_scsi_pt_emulated( op->ptvp, 0, 0, 0, op->data_len, err, 0 );
+  return -err;
+}
+
+/* Asynchronous command: the session's timerfd becomes readable once the
+ * latency has passed, and wd_emu_receive() then runs it */
+int
+wd_emu_submit( struct scsi_op_t *op )
+{
+  struct itimerspec its;
+
+  memset( &its, 0, sizeof( its ) );
+  its.it_value.tv_sec = emu.latency_us / 1000000;
+  its.it_value.tv_nsec = emu.latency_us % 1000000 * 1000;
+  if( its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0 )
+    its.it_value.tv_nsec = 1;	// zero would disarm the timer
+  if( timerfd_settime( op->sg_fd, 0, &its, NULL ) < 0 )
+    return emu_os_error( op, errno );
+  return 0;
+}
+
+int
+wd_emu_receive( struct scsi_op_t *op )
+{
+  uint64_t      expirations;
+
+  if( read( op->sg_fd, &expirations, sizeof( expirations ) ) < 0 )
+    return errno == EAGAIN ? -EAGAIN : emu_os_error( op, errno );
+  emu_complete( op, scsi_clock_ns(  ) - op->timing.submit_ns );
+  return 0;
+}
@@ -10,24 +10,51 @@
 #include <inttypes.h>
 #include <errno.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <poll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <limits.h>
+#include <time.h>
+#include <signal.h>
 #include <bsd/readpassphrase.h>
 #include "sg_lib.h"
 #include "sg_pt.h"
 #include "sg_pt_linux.h"
 #include "sg_pr2serr.h"
 #include "sg_unaligned.h"
+#include "lsscsi.h"
+#include "sg_async.h"
+#include "hotplug.h"
+#include "sha256.h"
+#include "kdf.h"
+#include "scsi_trace.h"
+#include "wd_emu.h"
+#include "scsi_replay.h"
+#include "passport.h"
+#include "wdpd.h"
 
-enum pass_xchg
-{ CHANGE_PASSWD, SET_PASSWD, DISABLE_ENCRYPTION = 16 };
+#define MAX_UNLOCK_THREADS 32
 
+#define WD_READ_HANDY_CAPACITY(x) {x[0] = 0xD5; memset( x+1, 0, 9 );}
 #define WD_READ_HANDY_STORE(x) {x[0] = 0xD8, x[1] = 0; memset( x+2, 0, 8 );}
 #define WD_WRITE_HANDY_STORE(x) {x[0] = 0xDA, x[1] = 0; memset( x+2, 0, 8 );}
 #define WD_GET_ENCRYPTION_STATUS(x) {x[0] = 0xC0, x[1] = 0x45; memset( x+2, 0, 8 );}
 #define WD_UNLOCK(x) {x[0] = 0xC1, x[1] = 0xE1; memset( x+2, 0, 8 );}
 #define WD_CHANGE_PASSWORD(x) {x[0] = 0xC1, x[1] = 0xE2; memset( x+2, 0, 8 );}
 #define WD_SECURE_ERASE(x) {x[0] = 0xC1, x[1] = 0xE3; memset( x+2, 0, 8 );}
+#define INQUIRY_SERIAL(x) {x[0] = 0x12, x[1] = 1, x[2] = 0x80; memset( x+3, 0, 7 ); x[4] = 0xFC;}
+
+// Handy store image: a header block, then every handy block in order
+#define HANDY_IMAGE_MAGIC "WDHANDY1"
+#define HANDY_IMAGE_HDR 512
+#define HANDY_IMAGE_SERIAL 64
+// Commands recorded for the --json report
+#define JSON_MAX_COMMANDS 256
+// Handy blocks kept per session at most
+#define HANDY_CACHE_BLOCKS 65536
 
 struct switches
 {
@@ -43,11 +70,47 @@ struct switches
   unsigned int  changepasswd:1;
   unsigned int  disableencryption:1;
   unsigned int  erase:1;
+  unsigned int  all:1;
+  unsigned int  async:1;
+  unsigned int  monitor:1;
+  unsigned int  backup:1;
+  unsigned int  restore:1;
+  unsigned int  json:1;
+  unsigned int  daemon:1;
+  unsigned int  watch:1;
+  unsigned int  stats:1;
 } sw;
 
-char         *find_passport_device( void );
-void          sha256hash( const uint8_t * data, unsigned int len,
-    uint8_t * out );
+// --backup-handy / --restore-handy: image file (a directory for --all)
+static char  *handy_image;
+
+// --json: the report goes here, everything else printed goes to stderr
+static FILE  *json_out;
+static struct scsi_cmd_time_t json_commands[JSON_MAX_COMMANDS];
+static uint64_t discovery_ns;
+
+// --daemon / --socket: socket of wd-passportd, NULL to drive the disk
+static const char *wdpd_socket;
+
+// --watch: base interval between two status polls of a drive
+static unsigned int watch_ms = 2000;
+// --prom: textfile exporter metrics rewritten after every poll cycle
+static char  *prom_file;
+
+// --stats (and --json): latency of every command by opcode and action
+static struct scsi_stats_t cmd_stats_buf, *cmd_stats;
+
+// --trace: where the command trace is dumped ("-" for stderr)
+static char  *trace_file;
+static volatile sig_atomic_t trace_wanted;
+// --record: every SG_IO command and what the drive returned is saved here
+static char  *record_file;
+
+// --kdf: key derivation for a new password
+static struct kdf_params kdf_opt;
+static bool   kdf_opt_set = false;
+// --kdf-target-ms: derivation time the work factor is calibrated to
+static unsigned int kdf_target_ms = 0;
 
 static struct option long_options[] = {
   {"help", no_argument, 0, 'h'},
@@ -63,6 +126,23 @@ static struct option long_options[] = {
   {"change_passwd", no_argument, 0, 'C'},
   {"disable_encryption", no_argument, 0, 'D'},
   {"erase_reset_key", no_argument, 0, 'E'},
+  {"all", no_argument, 0, 'a'},
+  {"async", no_argument, 0, 'A'},
+  {"monitor", no_argument, 0, 'm'},
+  {"kdf", required_argument, 0, 'K'},
+  {"kdf-target-ms", required_argument, 0, 'T'},
+  {"backup-handy", required_argument, 0, 'B'},
+  {"restore-handy", required_argument, 0, 'R'},
+  {"json", no_argument, 0, 'j'},
+  {"daemon", optional_argument, 0, 'd'},
+  {"socket", required_argument, 0, 'c'},
+  {"watch", optional_argument, 0, 'w'},
+  {"prom", required_argument, 0, 'p'},
+  {"trace", required_argument, 0, 't'},
+  {"stats", no_argument, 0, 'x'},
+  {"emulate", required_argument, 0, 'e'},
+  {"record", required_argument, 0, 'r'},
+  {"replay", required_argument, 0, 'y'},
   {0, 0, 0, 0}
 };
 
@@ -83,6 +163,47 @@ static struct opt_help
   {'C', "change the current password (disk must be previously unlocked)"},
   {'D', "disable disk's encryption (removes user key)"},
   {'E', "emergency key reset (all disk content is lost as a result)"},
+  {'a', "unlock every attached WD Passport in parallel (use with -u)"},
+  {'A', "with --all drive every device from one thread using\n"
+    "\t\t\t    asynchronous sg commands instead of a thread pool"},
+  {'m', "keep running and report WD Passports as they are plugged in\n"
+    "\t\t\t    or removed (with -u unlock them as they appear)"},
+  {'K', "with -P or -C: derive the key with 'wd' (default, Windows\n"
+    "\t\t\t    compatible) or 'scrypt[,LOG2N[,R[,P]]]' (Linux only,\n"
+    "\t\t\t    default scrypt,16,8,4), recorded in handy block 1"},
+  {'T', "with -P, -C or -S: pick the largest iteration count (or\n"
+    "\t\t\t    scrypt N) whose key derivation takes at most MS\n"
+    "\t\t\t    milliseconds on this host"},
+  {'B', "save every handy store block and the drive's serial to\n"
+    "\t\t\t    FILE (FILE/SERIAL.handy if FILE is a directory;\n"
+    "\t\t\t    with --all every drive is saved this way)"},
+  {'R', "write a handy store image back to the drive it was taken\n"
+    "\t\t\t    from (disk must be unlocked or unprotected)"},
+  {'j', "print the drive's state and the time spent in discovery,\n"
+    "\t\t\t    open, each SCSI command and the KDF as JSON"},
+  {'d', "run as wd-passportd: keep every drive open and serve\n"
+    "\t\t\t    requests on a UNIX socket (default " WDPD_SOCKET ")"},
+  {'c', "send -s, -l, -i, -u and -C to wd-passportd listening on\n"
+    "\t\t\t    the given socket"},
+  {'w', "poll the status of every WD Passport each SEC seconds\n"
+    "\t\t\t    (default 2, less often while nothing changes) and\n"
+    "\t\t\t    print only transitions (as JSON lines with --json)"},
+  {'p', "with --watch: after every poll cycle replace FILE with\n"
+    "\t\t\t    Prometheus metrics (security state, cipher, command\n"
+    "\t\t\t    counts and latency per opcode)"},
+  {'t', "append the last SCSI commands (CDB, result, sense, time)\n"
+    "\t\t\t    to FILE ('-' for stderr) on exit, and on SIGUSR1\n"
+    "\t\t\t    with --watch or --monitor"},
+  {'x', "print the count and min/p50/p90/p99/max latency of every\n"
+    "\t\t\t    SCSI command issued, by opcode and action"},
+  {'e', "run against N emulated drives instead of real ones:\n"
+    "\t\t\t    N[,LATENCY_US[,FAIL_PERCENT[,PASSWORD]]], locked with\n"
+    "\t\t\t    PASSWORD (default '" WD_EMU_PASSWORD "')"},
+  {'r', "save every SCSI command with its data, sense and timing\n"
+    "\t\t\t    to FILE for --replay"},
+  {'y', "serve the commands from a --record FILE instead of the\n"
+    "\t\t\t    drives, at once or with FILE,recorded as long as they\n"
+    "\t\t\t    took"},
   {0, ""}
 };
 
@@ -106,16 +227,32 @@ usage(  )
   exit( 0 );
 }
 
+// The binary is installed setuid root so that users can reach the sg
+// devices. A file named on the command line would then be created, truncated
+// or read as root, so options taking one are left to the real root.
+static void
+require_real_root( const char *option )
+{
+  if( getuid(  ) != geteuid(  ) )
+  {
+    pr2serr( "%s opens files as root and is only allowed to root\n",
+	option );
+    exit( 1 );
+  }
+}
+
 static int
 parse_cmd_line( int argc, char *argv[] )
 {
   int           idx = 0;
   int          *allsw = ( int * ) &sw;
   int           c;
+  char         *end;
+  double        sec;
 
   while( 1 )
   {
-    c = getopt_long( argc, argv, "hvsulLiISPCDE", long_options, &idx );
+    c = getopt_long( argc, argv, "hvsulLiISPCDEaAmK:T:B:R:jd::c:w::p:t:xe:r:y:", long_options, &idx );
     if( c == -1 )
       break;
     switch ( c )
@@ -159,10 +296,165 @@ parse_cmd_line( int argc, char *argv[] )
       case 'E':
 	sw.erase = 1;
 	break;
+      case 'a':
+	sw.all = 1;
+	break;
+      case 'A':
+	sw.async = 1;
+	break;
+      case 'm':
+	sw.monitor = 1;
+	break;
+      case 'K':
+	if( kdf_params_parse( optarg, &kdf_opt ) )
+	{
+	  pr2serr( "Invalid --kdf: %s\n", optarg );
+	  exit( 1 );
+	}
+	kdf_opt_set = true;
+	break;
+      case 'B':
+	require_real_root( "--backup-handy" );
+	sw.backup = 1;
+	handy_image = optarg;
+	break;
+      case 'R':
+	require_real_root( "--restore-handy" );
+	sw.restore = 1;
+	handy_image = optarg;
+	break;
+      case 'j':
+	sw.json = 1;
+	break;
+      case 'd':
+	sw.daemon = 1;
+	wdpd_socket = optarg ? optarg : WDPD_SOCKET;
+	break;
+      case 'c':
+	// the client connects as root: the daemon's own socket only
+	if( strcmp( optarg, WDPD_SOCKET ) )
+	  require_real_root( "--socket PATH" );
+	wdpd_socket = optarg;
+	break;
+      case 'w':
+	sw.watch = 1;
+	if( optarg == NULL )
+	  break;
+	sec = strtod( optarg, &end );
+	if( *end || !( sec >= 0.1 && sec <= 3600 ) )
+	{
+	  pr2serr( "Invalid --watch interval: %s\n", optarg );
+	  exit( 1 );
+	}
+	watch_ms = sec * 1000;
+	break;
+      case 'p':
+	require_real_root( "--prom" );
+	prom_file = optarg;
+	break;
+      case 't':
+	// stderr is the caller's own
+	if( strcmp( optarg, "-" ) )
+	  require_real_root( "--trace FILE" );
+	trace_file = optarg;
+	break;
+      case 'x':
+	sw.stats = 1;
+	break;
+      case 'e':
+	if( wd_emu_configure( optarg ) )
+	{
+	  pr2serr( "Invalid --emulate: %s\n", optarg );
+	  exit( 1 );
+	}
+	break;
+      case 'r':
+	require_real_root( "--record" );
+	record_file = optarg;
+	break;
+      case 'y':
+	require_real_root( "--replay" );
+	if( scsi_replay_load( optarg ) )
+	  exit( 1 );
+	break;
+      case 'T':
+	kdf_target_ms = strtoul( optarg, &end, 10 );
+	if( *end || kdf_target_ms < 1 || kdf_target_ms > 600000 )
+	{
+	  pr2serr( "Invalid --kdf-target-ms: %s\n", optarg );
+	  exit( 1 );
+	}
+	break;
     }
   }
   if( 0 == ( *allsw >> 3 ) )
     usage(  );
+  if( sw.all && !sw.unlock && !sw.backup )
+  {
+    pr2serr( "--all requires --unlock or --backup-handy\n" );
+    exit( 1 );
+  }
+  if( wdpd_socket && !sw.daemon && ( sw.setlabel || sw.sethint ||
+	  sw.newsalt || sw.newpasswd || sw.disableencryption || sw.erase ||
+	  sw.all || sw.monitor || sw.backup || sw.restore || sw.json ||
+	  sw.watch ) )
+  {
+    pr2serr( "--socket only takes -s, -l, -i, -u and -C\n" );
+    exit( 1 );
+  }
+  if( sw.json && ( sw.all || sw.monitor ) )
+  {
+    pr2serr( "--json reports on a single drive\n" );
+    exit( 1 );
+  }
+  if( sw.watch && ( sw.monitor || sw.all || sw.unlock ) )
+  {
+    pr2serr( "--watch cannot be combined with --monitor, --all or --unlock\n" );
+    exit( 1 );
+  }
+  if( wd_emu_count(  ) && ( sw.watch || sw.monitor || sw.daemon ) )
+  {
+    pr2serr( "--emulate has no hotplug events for --watch, --monitor or"
+	" --daemon\n" );
+    exit( 1 );
+  }
+  if( scsi_replay_active(  ) && wd_emu_count(  ) )
+  {
+    pr2serr( "--replay and --emulate cannot be combined\n" );
+    exit( 1 );
+  }
+  if( ( record_file || scsi_replay_active(  ) ) &&
+      ( sw.watch || sw.monitor || wdpd_socket ) )
+  {
+    pr2serr( "--record and --replay work on the commands of one run\n" );
+    exit( 1 );
+  }
+  if( sw.stats && ( sw.watch || sw.monitor || wdpd_socket ) )
+  {
+    pr2serr( "--stats reports on the commands of one run\n" );
+    exit( 1 );
+  }
+  if( prom_file && !sw.watch )
+  {
+    pr2serr( "--prom requires --watch\n" );
+    exit( 1 );
+  }
+  if( sw.backup && sw.restore )
+  {
+    pr2serr( "--backup-handy and --restore-handy cannot be combined\n" );
+    exit( 1 );
+  }
+  if( kdf_opt_set && !sw.newpasswd && !sw.changepasswd )
+  {
+    pr2serr( "--kdf requires --set_new_passwd or --change_passwd\n" );
+    exit( 1 );
+  }
+  if( kdf_target_ms && !sw.newpasswd && !sw.changepasswd && !sw.newsalt )
+  {
+    pr2serr( "--kdf-target-ms requires --set_new_passwd, --change_passwd"
+	" or --set_new_salt\n" );
+    exit( 1 );
+  }
   return 0;
 }
 
@@ -191,7 +483,7 @@ sec_status_to_str( int security_status )
 char         *
 cipher_id_to_str( int cipher_id )
 {
-  static char   result[16];
+  static __thread char result[16];
 
   switch ( cipher_id )
   {
@@ -223,52 +515,230 @@ secure_erase_drive( struct scsi_op_t *op )
 
   if( frnd < 0 )
     return 0;
-  WD_SECURE_ERASE( cdb );
-  key_reset_enabler = sg_get_unaligned_be32( &reply[8] );
-  sg_put_unaligned_be32( key_reset_enabler, &cdb[2] );	// Key Reset Enabler
-  memset( cmdout, 0, MAX_SCSI_XFER );
-  cmdout[0] = 0x45;
-  cmdout[4] = reply[4];		// Cipher ID
-  pwblen = sg_get_unaligned_be16( &reply[6] );	// Password Length
+  WD_SECURE_ERASE( op->cdb );
+  key_reset_enabler = sg_get_unaligned_be32( &op->reply[8] );
+  sg_put_unaligned_be32( key_reset_enabler, &op->cdb[2] );	// Key Reset Enabler
+  memset( op->cmdout, 0, MAX_SCSI_XFER );
+  op->cmdout[0] = 0x45;
+  op->cmdout[4] = op->reply[4];		// Cipher ID
+  pwblen = sg_get_unaligned_be16( &op->reply[6] );	// Password Length
   if( pwblen < 16 || pwblen > 32 )
     pwblen = 32;
-  sg_put_unaligned_be16( 8 + pwblen, &cdb[7] );
-  read( frnd, &cmdout[8], pwblen );
+  sg_put_unaligned_be16( 8 + pwblen, &op->cdb[7] );
+  read( frnd, &op->cmdout[8], pwblen );
   close( frnd );
   op->dir_inout = true;
   op->data_len = 8 + pwblen;
   return !scsi_xfer( op );
 }
 
-static int
-read_handy_store( struct scsi_op_t *op, int page )
+// Reads the handy store geometry once per device context. Drives that do
+// not answer, or use another block size, get the single 512 byte block
+// transfers this tool always made.
+static const struct handy_capacity_t *
+read_handy_capacity( struct scsi_op_t *op )
 {
-  WD_READ_HANDY_STORE( cdb );
-  sg_put_unaligned_be32( page, &cdb[2] );
-  sg_put_unaligned_be16( 1, &cdb[7] );
+  struct handy_capacity_t *cap = &op->handy;
+
+  if( cap->block_len )
+    return cap;
+  WD_READ_HANDY_CAPACITY( op->cdb );
   op->dir_inout = false;
-  op->data_len = MAX_SCSI_XFER;
-  return !scsi_xfer( op );
+  op->data_len = 12;
+  if( !scsi_xfer( op ) )
+  {
+    cap->last_block = sg_get_unaligned_be32( &op->reply[0] );
+    cap->block_len = sg_get_unaligned_be32( &op->reply[4] );
+    cap->max_xfer = sg_get_unaligned_be16( &op->reply[10] );
+  }
+  if( cap->block_len != MAX_SCSI_XFER || cap->max_xfer == 0 ||
+      cap->last_block < 2 )
+  {
+    if( sw.verbose )
+      printf( "No usable handy store capacity, using single blocks\n" );
+    cap->last_block = 2;
+    cap->block_len = MAX_SCSI_XFER;
+    cap->max_xfer = 1;
+  }
+  else if( sw.verbose )
+    printf( "Handy store: %u blocks of %u bytes, %u per command\n",
+	cap->last_block + 1, cap->block_len, cap->max_xfer );
+  return cap;
+}
+
+static void
+prep_handy_store( struct scsi_op_t *op, bool write, uint32_t first,
+    uint32_t count )
+{
+  if( write )
+  {
+    WD_WRITE_HANDY_STORE( op->cdb );
+  }
+  else
+  {
+    WD_READ_HANDY_STORE( op->cdb );
+  }
+  sg_put_unaligned_be32( first, &op->cdb[2] );
+  sg_put_unaligned_be16( count, &op->cdb[7] );
+  op->dir_inout = write;
+  op->data_len = count * MAX_SCSI_XFER;
+}
+
+// Fills op->reply from the session's copy if it holds every block
+static bool
+handy_cache_lookup( struct scsi_op_t *op, uint32_t first, uint32_t count )
+{
+  struct handy_cache_t *hc = &op->handy_cache;
+  uint32_t      k;
+
+  if( first >= hc->nblocks || count > hc->nblocks - first ||
+      scsi_op_reserve( op, count * MAX_SCSI_XFER ) )
+    return false;
+  for( k = first; k < first + count; k++ )
+  {
+    if( !hc->valid[k] )
+      return false;
+  }
+  memcpy( op->reply, hc->data + first * MAX_SCSI_XFER,
+      count * MAX_SCSI_XFER );
+  hc->hits += count;
+  return true;
+}
+
+// Records what the drive now holds, or forgets blocks whose transfer failed
+static void
+handy_cache_update( struct scsi_op_t *op, const uint8_t *data,
+    uint32_t first, uint32_t count, bool valid )
+{
+  struct handy_cache_t *hc = &op->handy_cache;
+  uint8_t      *p;
+  uint32_t      k, n;
+
+  if( first >= HANDY_CACHE_BLOCKS || count > HANDY_CACHE_BLOCKS - first )
+    return;
+  if( valid && first + count > hc->nblocks )
+  {
+    n = first + count;
+    if( ( p = realloc( hc->data, n * MAX_SCSI_XFER ) ) == NULL )
+      valid = false;
+    else
+    {
+      hc->data = p;
+      if( ( p = realloc( hc->valid, n ) ) == NULL )
+	valid = false;
+      else
+      {
+	memset( p + hc->nblocks, 0, n - hc->nblocks );
+	hc->valid = p;
+	hc->nblocks = n;
+      }
+    }
+  }
+  for( k = first; k < first + count && k < hc->nblocks; k++ )
+  {
+    hc->valid[k] = valid;
+    if( valid )
+      memcpy( hc->data + k * MAX_SCSI_XFER,
+	  data + ( k - first ) * MAX_SCSI_XFER, MAX_SCSI_XFER );
+  }
+}
+
+// The session's copy of block k, NULL unless it holds what the drive has
+static const uint8_t *
+handy_cache_block( const struct scsi_op_t *op, uint32_t k )
+{
+  const struct handy_cache_t *hc = &op->handy_cache;
+
+  if( k >= hc->nblocks || !hc->valid[k] )
+    return NULL;
+  return hc->data + k * MAX_SCSI_XFER;
+}
+
+void
+handy_cache_drop( struct scsi_op_t *op )
+{
+  struct handy_cache_t *hc = &op->handy_cache;
+
+  if( hc->nblocks )
+    memset( hc->valid, 0, hc->nblocks );
+}
+
+// Moves count handy blocks from first between the drive and op->cmdout
+// (write) or op->reply (read), as few commands as the drive allows
+static int
+handy_store_io( struct scsi_op_t *op, bool write, uint32_t first,
+    uint32_t count )
+{
+  const struct handy_capacity_t *cap;
+  uint8_t      *base;
+  uint32_t      done, n;
+  int           ok = 1;
+
+  if( !write && handy_cache_lookup( op, first, count ) )
+    return 1;
+  if( count == 1 )		// any drive takes one block, no need to ask
+  {
+    prep_handy_store( op, write, first, 1 );
+    ok = !scsi_xfer( op );
+    handy_cache_update( op, write ? op->cmdout : op->reply, first, 1, ok );
+    return ok;
+  }
+  cap = read_handy_capacity( op );
+  if( count == 0 || first > cap->last_block ||
+      count > cap->last_block - first + 1 ||
+      count > INT_MAX / cap->block_len ||
+      scsi_op_reserve( op, count * cap->block_len ) )
+    return 0;
+  // each command transfers straight into its slice of the buffer
+  base = write ? op->cmdout : op->reply;
+  for( done = 0; ok && done < count; done += n )
+  {
+    n = count - done < cap->max_xfer ? count - done : cap->max_xfer;
+    prep_handy_store( op, write, first + done, n );
+    if( write )
+      op->cmdout = base + done * cap->block_len;
+    else
+      op->reply = base + done * cap->block_len;
+    ok = !scsi_xfer( op );
+  }
+  if( write )
+    op->cmdout = base;
+  else
+    op->reply = base;
+  handy_cache_update( op, base, first, count, ok );
+  return ok;
+}
+
+// Fills op->reply with count blocks from first
+static int
+read_handy_store( struct scsi_op_t *op, uint32_t first, uint32_t count )
+{
+  return handy_store_io( op, false, first, count );
+}
+
+// Writes count blocks from first out of op->cmdout
+static int
+write_handy_store( struct scsi_op_t *op, uint32_t first, uint32_t count )
+{
+  return handy_store_io( op, true, first, count );
 }
 
+// Checks the security block and extracts its hint
 static char  *
-read_handy_store_block1( struct scsi_op_t *op )
+parse_handy_store_block1( const uint8_t *block, char *hint )
 {
   int           i;
   uint8_t       sum;
-  static char   hint[102];
 
-  if( !read_handy_store( op, 1 ) )
-    return NULL;
-  if( reply[0] != 0 || reply[1] != 1 || reply[2] != 'W' || reply[3] != 'D' )
+  if( block[0] != 0 || block[1] != 1 || block[2] != 'W' || block[3] != 'D' )
     return NULL;
   for( sum = i = 0; i < MAX_SCSI_XFER; i++ )
-    sum += reply[i];
+    sum += block[i];
   if( sum != 0 )
     return NULL;
   for( i = 0; i < 101; i++ )
   {
-    hint[i] = reply[24 + 2 * i];
+    hint[i] = block[24 + 2 * i];
     if( !hint[i] )
       break;
   }
@@ -276,24 +746,22 @@ read_handy_store_block1( struct scsi_op_t *op )
   return hint;
 }
 
+// Checks the label block and extracts the label
 static char  *
-read_handy_store_block2( struct scsi_op_t *op )
+parse_handy_store_block2( const uint8_t *block, char *label )
 {
   int           i;
   uint8_t       sum;
-  static char   label[33];
 
-  if( !read_handy_store( op, 2 ) )
-    return NULL;
-  if( reply[0] != 0 || reply[1] != 2 || reply[2] != 'W' || reply[3] != 'D' )
+  if( block[0] != 0 || block[1] != 2 || block[2] != 'W' || block[3] != 'D' )
     return NULL;
   for( sum = i = 0; i < MAX_SCSI_XFER; i++ )
-    sum += reply[i];
+    sum += block[i];
   if( sum != 0 )
     return NULL;
   for( i = 0; i < 32; i++ )
   {
-    label[i] = reply[8 + 2 * i];
+    label[i] = block[8 + 2 * i];
     if( !label[i] )
       break;
   }
@@ -301,56 +769,106 @@ read_handy_store_block2( struct scsi_op_t *op )
   return label;
 }
 
-static int
-write_handy_store( struct scsi_op_t *op, int page )
+// Blocks with a WD signature carry a checksum: all bytes sum to zero
+static bool
+handy_block_ok( const uint8_t *block )
 {
-  WD_WRITE_HANDY_STORE( cdb );
-  sg_put_unaligned_be32( page, &cdb[2] );
-  sg_put_unaligned_be16( 1, &cdb[7] );
-  op->dir_inout = true;
-  op->data_len = MAX_SCSI_XFER;
-  return !scsi_xfer( op );
+  uint8_t       sum;
+  int           i;
+
+  if( block[2] != 'W' || block[3] != 'D' )
+    return true;
+  for( sum = i = 0; i < MAX_SCSI_XFER; i++ )
+    sum += block[i];
+  return sum == 0;
 }
 
+// Fills serial (at least HANDY_IMAGE_SERIAL bytes) from VPD page 80h
+static char  *
+get_serial( struct scsi_op_t *op, char *serial )
+{
+  int           len, i, j;
+
+  INQUIRY_SERIAL( op->cdb );
+  op->dir_inout = false;
+  op->data_len = 0xFC;
+  if( scsi_xfer( op ) || op->reply[1] != 0x80 )
+    return NULL;
+  len = op->reply[3] < HANDY_IMAGE_SERIAL ? op->reply[3] :
+      HANDY_IMAGE_SERIAL - 1;
+  for( i = 0; i < len && op->reply[4 + i] == ' '; i++ )
+    ;
+  for( j = 0; i < len && op->reply[4 + i] >= ' '; i++ )
+    serial[j++] = op->reply[4 + i];
+  while( j > 0 && serial[j - 1] == ' ' )
+    j--;
+  serial[j] = 0;
+  return j ? serial : NULL;
+}
+
+// Fills hint (at least 102 bytes) and leaves block 1 in op->reply
+char         *
+read_handy_store_block1( struct scsi_op_t *op, char *hint )
+{
+  if( !read_handy_store( op, 1, 1 ) )
+    return NULL;
+  return parse_handy_store_block1( op->reply, hint );
+}
+
+// Fills label (at least 33 bytes)
+char         *
+read_handy_store_block2( struct scsi_op_t *op, char *label )
+{
+  if( !read_handy_store( op, 2, 1 ) )
+    return NULL;
+  return parse_handy_store_block2( op->reply, label );
+}
+
+// With kp the KDF record is replaced, else it is kept unless new_salt
 static int
-write_handy_store_block1( struct scsi_op_t *op, int new_salt, char *hint )
+write_handy_store_block1( struct scsi_op_t *op, int new_salt, char *hint,
+    const struct kdf_params *kp )
 {
-  char         *old_hint;
+  char          hint_buf[102], *old_hint;
   uint8_t       sum, c;
   int           frnd = open( "/dev/urandom", O_RDONLY );
   int           i;
 
-  old_hint = read_handy_store_block1( op );
-  memset( cmdout, 0, MAX_SCSI_XFER );
-  cmdout[1] = 1;
-  cmdout[2] = 'W';
-  cmdout[3] = 'D';
+  old_hint = read_handy_store_block1( op, hint_buf );
+  memset( op->cmdout, 0, MAX_SCSI_XFER );
+  op->cmdout[1] = 1;
+  op->cmdout[2] = 'W';
+  op->cmdout[3] = 'D';
   if( new_salt || old_hint == NULL )
   {
-    read( frnd, &cmdout[11], 9 );
-    cmdout[11] &= 7;
-    cmdout[11]++;		// between 1-8 hash iterations
+    read( frnd, &op->cmdout[11], 9 );
+    op->cmdout[11] &= 7;
+    op->cmdout[11]++;		// between 1-8 hash iterations
     for( i = 0; i < 4; i++ )	// force SALT as UCS-2 chars
     {
-      c = cmdout[12 + 2 * i] & 0x7f;
+      c = op->cmdout[12 + 2 * i] & 0x7f;
       if( c < '#' )
 	c += '#';
       if( c > 'z' )
 	c -= 5;
-      cmdout[12 + 2 * i] = c;
-      cmdout[13 + 2 * i] = 0;
+      op->cmdout[12 + 2 * i] = c;
+      op->cmdout[13 + 2 * i] = 0;
     }
   }
-  else				// preserve iterations and salt
+  else				// preserve iterations, salt and reserved bytes
   {
-    memcpy( &cmdout[8], &reply[8], 12 );
+    memcpy( &op->cmdout[8], &op->reply[8], 12 );
+    memcpy( &op->cmdout[KDF_PARAMS_OFFSET], &op->reply[KDF_PARAMS_OFFSET],
+	MAX_SCSI_XFER - 1 - KDF_PARAMS_OFFSET );
   }
   close( frnd );
+  if( kp )
+    kdf_params_write( kp, op->cmdout );
   if( hint )
   {
     for( i = 0; i < 101; i++ )
     {
-      cmdout[24 + 2 * i] = hint[i];
+      op->cmdout[24 + 2 * i] = hint[i];
       if( !hint[i] )
 	break;
     }
@@ -359,16 +877,16 @@ write_handy_store_block1( struct scsi_op_t *op, int new_salt, char *hint )
   {
     for( i = 0; i < 101; i++ )
     {
-      cmdout[24 + 2 * i] = old_hint[i];
+      op->cmdout[24 + 2 * i] = old_hint[i];
       if( !old_hint[i] )
 	break;
     }
     old_hint[i] = 0;
   }
   for( sum = i = 0; i < MAX_SCSI_XFER; i++ )
-    sum += cmdout[i];
-  cmdout[MAX_SCSI_XFER - 1] = -sum;
-  if( write_handy_store( op, 1 ) )
+    sum += op->cmdout[i];
+  op->cmdout[MAX_SCSI_XFER - 1] = -sum;
+  if( write_handy_store( op, 1, 1 ) )
     return 1;
   return 0;
 }
@@ -379,291 +897,2049 @@ write_handy_store_block2( struct scsi_op_t *op, char *label )
   int           i;
   uint8_t       sum;
 
-  memset( cmdout, 0, MAX_SCSI_XFER );
-  cmdout[1] = 2;
-  cmdout[2] = 'W';
-  cmdout[3] = 'D';
+  memset( op->cmdout, 0, MAX_SCSI_XFER );
+  op->cmdout[1] = 2;
+  op->cmdout[2] = 'W';
+  op->cmdout[3] = 'D';
   for( i = 0; i < 32; i++ )
   {
     if( label[i] < ' ' )
       break;
-    cmdout[8 + 2 * i] = label[i];
+    op->cmdout[8 + 2 * i] = label[i];
   }
   for( sum = i = 0; i < MAX_SCSI_XFER; i++ )
-    sum += cmdout[i];
-  cmdout[MAX_SCSI_XFER - 1] = -sum;
-  if( write_handy_store( op, 2 ) )
+    sum += op->cmdout[i];
+  op->cmdout[MAX_SCSI_XFER - 1] = -sum;
+  if( write_handy_store( op, 2, 1 ) )
     return 1;
   return 0;
 }
 
+// Returns digest, or NULL if the KDF could not run (out of memory). The
+// time taken goes to the timing of op.
 static uint8_t *
-hash_password( char *salt, char *password, int iterations )
+hash_password( struct scsi_op_t *op, const struct kdf_params *kp,
+    char *password, uint8_t *digest )
+{
+  char          desc[64];
+  uint64_t      t0;
+  bool          ok;
+
+  if( sw.verbose )
+    printf( "Deriving key with %s (%s SHA-256 code)\n",
+	kdf_params_str( kp, desc, sizeof( desc ) ), sha256_impl_name(  ) );
+  t0 = scsi_clock_ns(  );
+  ok = kdf_derive( kp, password, digest ) != NULL;
+  op->timing.kdf_ns += scsi_clock_ns(  ) - t0;
+  if( ok )
+    return digest;
+  printf( "Cannot derive the key with %s\n",
+      kdf_params_str( kp, desc, sizeof( desc ) ) );
+  return NULL;
+}
+
+// Sets the work factor of kp for --kdf-target-ms; ns, unless NULL, gets
+// the derivation time the calibration measured for it
+static int
+calibrate_kdf( struct kdf_params *kp, uint64_t *ns )
 {
-  static uint8_t digest[32];
-  uint8_t       salt_passwd[138];
-  int           i, len;
+  char          desc[64];
 
-  memset( salt_passwd, 0, 138 );
-  memcpy( salt_passwd, &reply[12], 8 );	// UCS-2 salt
-  for( i = 0; i < 64; i++ )
+  printf( "Calibrating key derivation to %u ms...\n", kdf_target_ms );
+  if( kdf_calibrate( kp, kdf_target_ms, ns ) )
   {
-    if( password[i] < ' ' )
-      break;
-    salt_passwd[8 + 2 * i] = password[i];
+    printf( "Cannot calibrate %s\n", kdf_params_str( kp, desc,
+	    sizeof( desc ) ) );
+    return 0;
+  }
+  return 1;
+}
+
+static void
+report_kdf( const struct kdf_params *kp, uint64_t ns )
+{
+  char          desc[64];
+
+  printf( "Key derivation: %s, %.1f ms on this host (target %u ms)\n",
+      kdf_params_str( kp, desc, sizeof( desc ) ), ns / 1e6, kdf_target_ms );
+}
+
+// Saves every handy store block to path, or to path/SERIAL.handy if path
+// is a directory. The blocks are read with as few commands as possible.
+static int
+backup_handy( struct scsi_op_t *op, const char *path )
+{
+  const struct handy_capacity_t *cap;
+  uint8_t       hdr[HANDY_IMAGE_HDR];
+  char          serial[HANDY_IMAGE_SERIAL], file[PATH_MAX];
+  uint32_t      count, k;
+  struct stat   st;
+  int           fd, i, ok;
+
+  if( get_serial( op, serial ) == NULL )
+  {
+    printf( "%s: cannot read the serial number\n", op->device_name );
+    return 0;
+  }
+  cap = read_handy_capacity( op );
+  count = cap->last_block + 1;
+  if( !read_handy_store( op, 0, count ) )
+  {
+    printf( "%s: cannot read the handy store\n", op->device_name );
+    return 0;
   }
-  len = 8 + 2 * i;
-  for( i = 0; i < iterations; i++ )
+  for( k = 0; k < count; k++ )
   {
-    sha256hash( salt_passwd, len, digest );
-    len = 32;
-    memcpy( salt_passwd, digest, len );
+    if( !handy_block_ok( op->reply + k * cap->block_len ) )
+      printf( "%s: handy block %u has a bad checksum, saved as is\n",
+	  op->device_name, k );
   }
-  return digest;
+  memset( hdr, 0, sizeof( hdr ) );
+  memcpy( hdr, HANDY_IMAGE_MAGIC, 8 );
+  sg_put_unaligned_be32( cap->block_len, &hdr[8] );
+  sg_put_unaligned_be32( count, &hdr[12] );
+  memcpy( &hdr[16], serial, strlen( serial ) );
+  sha256hash( op->reply, count * cap->block_len, &hdr[80] );
+
+  if( stat( path, &st ) == 0 && S_ISDIR( st.st_mode ) )
+  {
+    // the serial becomes a file name
+    for( i = 0; serial[i]; i++ )
+      if( !isalnum( ( unsigned char ) serial[i] ) && serial[i] != '-' )
+	serial[i] = '_';
+    snprintf( file, sizeof( file ), "%s/%s.handy", path, serial );
+    path = file;
+  }
+  fd = open( path, O_WRONLY | O_CREAT | O_TRUNC, 0600 );
+  ok = fd >= 0 && write( fd, hdr, sizeof( hdr ) ) == sizeof( hdr ) &&
+      write( fd, op->reply, count * cap->block_len ) ==
+      ( ssize_t ) ( count * cap->block_len );
+  if( fd >= 0 && close( fd ) )
+    ok = 0;
+  if( !ok )
+  {
+    printf( "%s: cannot write %s: %s\n", op->device_name, path,
+	strerror( errno ) );
+    return 0;
+  }
+  printf( "%s: %u handy blocks saved to %s\n", op->device_name, count,
+      path );
+  return 1;
 }
 
-int
-change_password( struct scsi_op_t *op, int security )
+// Writes an image made by backup_handy() back, only to the same drive
+static int
+restore_handy( struct scsi_op_t *op, const char *path )
+{
+  const struct handy_capacity_t *cap;
+  uint8_t       hdr[HANDY_IMAGE_HDR], digest[SHA256_DIGEST_SIZE];
+  char          serial[HANDY_IMAGE_SERIAL];
+  uint32_t      count, len, k;
+  int           fd;
+  const char   *err = NULL;
+
+  if( get_serial( op, serial ) == NULL )
+  {
+    printf( "%s: cannot read the serial number\n", op->device_name );
+    return 0;
+  }
+  cap = read_handy_capacity( op );
+  if( ( fd = open( path, O_RDONLY ) ) < 0 )
+  {
+    printf( "Cannot open %s: %s\n", path, strerror( errno ) );
+    return 0;
+  }
+  count = len = 0;
+  if( read( fd, hdr, sizeof( hdr ) ) != sizeof( hdr ) ||
+      memcmp( hdr, HANDY_IMAGE_MAGIC, 8 ) )
+    err = "not a handy store image";
+  else
+  {
+    count = sg_get_unaligned_be32( &hdr[12] );
+    hdr[16 + HANDY_IMAGE_SERIAL - 1] = 0;
+    if( strncmp( ( char * ) &hdr[16], serial, HANDY_IMAGE_SERIAL ) )
+      err = "image was taken from another drive";
+    else if( sg_get_unaligned_be32( &hdr[8] ) != cap->block_len ||
+	count == 0 || count > cap->last_block + 1 ||
+	count > INT_MAX / cap->block_len )
+      err = "image does not match the drive's handy store";
+  }
+  if( err == NULL )
+  {
+    len = count * cap->block_len;
+    if( scsi_op_reserve( op, len ) )
+      err = "out of memory";
+    else if( read( fd, op->cmdout, len ) != ( ssize_t ) len )
+      err = "image is truncated";
+  }
+  close( fd );
+  if( err == NULL )
+  {
+    sha256hash( op->cmdout, len, digest );
+    if( memcmp( digest, &hdr[80], SHA256_DIGEST_SIZE ) )
+      err = "image is corrupted";
+    for( k = 0; err == NULL && k < count; k++ )
+      if( !handy_block_ok( op->cmdout + k * cap->block_len ) )
+	err = "image holds a block with a bad checksum";
+  }
+  if( err )
+  {
+    printf( "%s: %s\n", path, err );
+    return 0;
+  }
+  if( !write_handy_store( op, 0, count ) )
+  {
+    printf( "%s: cannot write the handy store\n", op->device_name );
+    return 0;
+  }
+  printf( "%u handy blocks restored from %s\n", count, path );
+  return 1;
+}
+
+// Records kp in handy store block 1 after the drive accepted the new key
+static int
+record_kdf( struct scsi_op_t *op, const struct kdf_params *kp )
 {
-  int           i, iterations, pwblen;
-  char          salt[5], old_passwd[65], new_passwd[65], sec_passwd[65];
+  char          desc[64];
+  int           i, tries;
+
+  for( tries = 0; tries < 3; tries++ )
+  {
+    if( write_handy_store_block1( op, 0, NULL, kp ) )
+      return 1;
+  }
+  // without the record the key cannot be derived again: say what it was
+  printf( "!!! The password was changed but handy store block 1 could\n"
+      "!!! not be updated with its KDF: %s", kdf_params_str( kp, desc,
+	  sizeof( desc ) ) );
+  if( kp->algo == KDF_SCRYPT )
+  {
+    printf( " salt " );
+    for( i = 0; i < KDF_SCRYPT_SALT; i++ )
+      printf( "%02x", kp->salt[i] );
+  }
+  printf( "\n" );
+  return 0;
+}
 
-  if( security == SET_PASSWD && reply[3] != 0 )
+// Checks the lock state in op->reply allows the security operation
+static int
+password_state_ok( struct scsi_op_t *op, int security )
+{
+  if( security == SET_PASSWD && op->reply[3] != 0 )
   {
     printf( "Device has to be unprotected to perform this operation.\n" );
     return 0;
   }
   if( ( security == CHANGE_PASSWD || security == DISABLE_ENCRYPTION ) &&
-      reply[3] != 2 )
+      op->reply[3] != 2 )
   {
     printf( "Device has to be unlocked to perform this operation.\n" );
     return 0;
   }
-  pwblen = sg_get_unaligned_be16( &reply[6] );	// Password Length
-  if( read_handy_store_block1( op ) == NULL )
+  return 1;
+}
+
+// Sends the security operation with the passwords it needs (old_passwd
+// to change or disable, new_passwd to set or change). The encryption
+// status must be in op->reply.
+int
+change_password_to( struct scsi_op_t *op, int security, char *old_passwd,
+    char *new_passwd )
+{
+  struct kdf_params cur, new;
+  uint64_t      t0;
+  int           pwblen, ret;
+  uint8_t       digest[32];
+  char          hint[102];
+
+  if( !password_state_ok( op, security ) )
+    return 0;
+  pwblen = sg_get_unaligned_be16( &op->reply[6] );	// Password Length
+  if( read_handy_store_block1( op, hint ) == NULL )
   {
     printf( "!!! WARNING !!!\n"
 	"If this is the first time you set a password,\n"
 	"make sure you change it at least once.\n"
 	"Otherwise the factory password can be used to\n"
 	"decrypt your data!!!\n" );
-    write_handy_store_block1( op, 1, NULL );
-  }
-  iterations = sg_get_unaligned_be32( &reply[8] );
-  for( i = 0; i < 4; i++ )	// UCS-2 salt
-    salt[i] = reply[12 + 2 * i];
-  salt[i] = 0;
-  WD_CHANGE_PASSWORD( cdb );
-  sg_put_unaligned_be16( 8 + 2 * pwblen, &cdb[7] );
-  memset( cmdout, 0, MAX_SCSI_XFER );
-  cmdout[0] = 0x45;
-  cmdout[3] = security;
-  sg_put_unaligned_be16( pwblen, &cmdout[6] );
+    if( !write_handy_store_block1( op, 1, NULL, NULL ) ||
+	read_handy_store_block1( op, hint ) == NULL )
+      return 0;
+  }
+  kdf_params_read( op->reply, &cur );
+  new = cur;
+  if( kdf_opt_set )
+  {
+    new.algo = kdf_opt.algo;
+    if( new.algo == KDF_SCRYPT )
+    {
+      new.log2_n = kdf_opt.log2_n;
+      new.r = kdf_opt.r;
+      new.p = kdf_opt.p;
+      if( kdf_params_new_salt( &new ) )
+	return 0;
+    }
+  }
+  else if( security == DISABLE_ENCRYPTION )
+    new.algo = KDF_WD;
+  if( kdf_target_ms && security != DISABLE_ENCRYPTION &&
+      !calibrate_kdf( &new, NULL ) )
+    return 0;
+  WD_CHANGE_PASSWORD( op->cdb );
+  sg_put_unaligned_be16( 8 + 2 * pwblen, &op->cdb[7] );
+  memset( op->cmdout, 0, MAX_SCSI_XFER );
+  op->cmdout[0] = 0x45;
+  op->cmdout[3] = security;
+  sg_put_unaligned_be16( pwblen, &op->cmdout[6] );
+  if( security == CHANGE_PASSWD || security == DISABLE_ENCRYPTION )
+  {
+    if( hash_password( op, &cur, old_passwd, digest ) == NULL )
+      return 0;
+    memcpy( &op->cmdout[8], digest, pwblen );
+  }
+  if( security == CHANGE_PASSWD || security == SET_PASSWD )
+  {
+    t0 = scsi_clock_ns(  );
+    if( hash_password( op, &new, new_passwd, digest ) == NULL )
+      return 0;
+    if( kdf_target_ms )
+      report_kdf( &new, scsi_clock_ns(  ) - t0 );
+    memcpy( &op->cmdout[8 + pwblen], digest, pwblen );
+  }
+  memset( digest, 0, sizeof( digest ) );
+  op->dir_inout = true;
+  op->data_len = 8 + 2 * pwblen;
+  ret = !scsi_xfer( op );
+  // only now that the drive holds the new key may block 1 describe it
+  if( ret && ( new.algo != cur.algo || new.iterations != cur.iterations ||
+	  ( new.algo == KDF_SCRYPT && ( new.log2_n != cur.log2_n ||
+		  memcmp( new.salt, cur.salt, KDF_SCRYPT_SALT ) ) ) ) )
+    ret = record_kdf( op, &new );
+  return ret;
+}
+
+int
+change_password( struct scsi_op_t *op, int security )
+{
+  char          old_passwd[65], new_passwd[65], sec_passwd[65];
+  int           ret = 0;
+
+  if( !password_state_ok( op, security ) )
+    return 0;
   if( security == CHANGE_PASSWD || security == DISABLE_ENCRYPTION )
   {
     if( NULL == readpassphrase( "Please enter current disk password: ",
 	old_passwd, 65, RPP_ECHO_OFF ) )
       return 0;
-    memcpy( &cmdout[8], hash_password( salt, old_passwd, iterations ),
-	pwblen );
   }
   if( security == CHANGE_PASSWD || security == SET_PASSWD )
   {
     if( NULL == readpassphrase( "Please enter new disk password: ",
 	new_passwd, 65, RPP_ECHO_OFF ) )
-      return 0;
+      goto out;
     if( NULL == readpassphrase( "Retype new disk password: ",
 	sec_passwd, 65, RPP_ECHO_OFF ) )
-      return 0;
+      goto out;
     if( strcmp( new_passwd, sec_passwd ) )
     {
       printf( "Passwords don't match\n" );
-      return 0;
+      goto out;
     }
-    memcpy( &cmdout[8 + pwblen],
-	hash_password( salt, new_passwd, iterations ), pwblen );
   }
-  op->dir_inout = true;
-  op->data_len = 8 + 2 * pwblen;
-  return !scsi_xfer( op );
+  ret = change_password_to( op, security, old_passwd, new_passwd );
+out:
+  memset( old_passwd, 0, sizeof( old_passwd ) );
+  memset( new_passwd, 0, sizeof( new_passwd ) );
+  memset( sec_passwd, 0, sizeof( sec_passwd ) );
+  return ret;
 }
 
-int
-unlock_drive( struct scsi_op_t *op )
+// Builds the UNLOCK command for a derived key
+static void
+prep_unlock_key( struct scsi_op_t *op, int pwblen, const uint8_t *digest )
 {
-  int           i, iterations, pwblen;
-  char          salt[5], old_passwd[65];
-
-  if( reply[3] != 1 )
-  {
-    printf( "Drive is not locked.\n" );
-    return 0;
-  }
-  pwblen = sg_get_unaligned_be16( &reply[6] );	// Password Length
-  if( read_handy_store_block1( op ) == NULL )
-    return 0;
-  iterations = sg_get_unaligned_be32( &reply[8] );
-  for( i = 0; i < 4; i++ )	// UCS-2 salt
-    salt[i] = reply[12 + 2 * i];
-  salt[i] = 0;
-  WD_UNLOCK( cdb );
-  sg_put_unaligned_be16( 8 + pwblen, &cdb[7] );
-  memset( cmdout, 0, MAX_SCSI_XFER );
-  cmdout[0] = 0x45;
-  sg_put_unaligned_be16( pwblen, &cmdout[6] );
-  if( NULL == readpassphrase( "Please enter current disk password: ",
-      old_passwd, 65, RPP_ECHO_OFF ) )
-    return 0;
-  memcpy( &cmdout[8], hash_password( salt, old_passwd, iterations ), pwblen );
+  WD_UNLOCK( op->cdb );
+  sg_put_unaligned_be16( 8 + pwblen, &op->cdb[7] );
+  memset( op->cmdout, 0, MAX_SCSI_XFER );
+  op->cmdout[0] = 0x45;
+  sg_put_unaligned_be16( pwblen, &op->cmdout[6] );
+  memcpy( &op->cmdout[8], digest, pwblen );
   op->dir_inout = true;
   op->data_len = 8 + pwblen;
+}
+
+// Builds the UNLOCK command from the security block held in op->reply
+static int
+prep_unlock( struct scsi_op_t *op, int pwblen, char *passwd )
+{
+  struct kdf_params kp;
+  uint8_t       digest[32];
+
+  kdf_params_read( op->reply, &kp );
+  if( hash_password( op, &kp, passwd, digest ) == NULL )
+    return -1;
+  prep_unlock_key( op, pwblen, digest );
+  memset( digest, 0, sizeof( digest ) );
+  return 0;
+}
+
+// If passwd is NULL the user is asked for it
+int
+unlock_drive( struct scsi_op_t *op, char *passwd )
+{
+  int           pwblen;
+  char          hint[102], old_passwd[65];
+
+  if( op->reply[3] != 1 )
+  {
+    printf( "Drive is not locked.\n" );
+    return 0;
+  }
+  pwblen = sg_get_unaligned_be16( &op->reply[6] );	// Password Length
+  if( read_handy_store_block1( op, hint ) == NULL )
+    return 0;
+  if( passwd == NULL )
+  {
+    if( NULL == readpassphrase( "Please enter current disk password: ",
+	old_passwd, 65, RPP_ECHO_OFF ) )
+      return 0;
+    passwd = old_passwd;
+  }
+  if( prep_unlock( op, pwblen, passwd ) )
+    return 0;
   return !scsi_xfer( op );
 }
 
-int
-get_encryption_status( struct scsi_op_t *op )
+static void
+prep_encryption_status( struct scsi_op_t *op )
+{
+  WD_GET_ENCRYPTION_STATUS( op->cdb );
+  sg_put_unaligned_be16( 48, &op->cdb[7] );
+  op->dir_inout = false;
+  op->data_len = MAX_SCSI_XFER;
+}
+
+int
+get_encryption_status( struct scsi_op_t *op )
+{
+  prep_encryption_status( op );
+  if( !scsi_xfer( op ) && op->reply[0] == 0x45 )
+    return 1;
+  return 0;
+}
+
+static int
+op_status( struct scsi_op_t *op )
+{
+  printf( "Security: %s\n", sec_status_to_str( op->reply[3] ) );
+  printf( "Cipher: %s\n", cipher_id_to_str( op->reply[4] ) );
+  return 1;
+}
+
+static int
+op_unlock( struct scsi_op_t *op )
+{
+  if( unlock_drive( op, NULL ) )
+  {
+    printf( "Drive unlocked successfully.\n" );
+    return 1;
+  }
+  printf( "Error unlocking drive.\n" );
+  return 0;
+}
+
+// With -l and -i blocks 1 and 2 come back from a single command
+static int
+op_get_label_hint( struct scsi_op_t *op )
+{
+  char          label[33], hint[102], *get_label, *get_hint;
+  int           n, ok;
+
+  n = sw.getlabel && sw.gethint ? 2 : 1;
+  ok = read_handy_store( op, sw.gethint ? 1 : 2, n );
+  if( sw.getlabel )
+  {
+    get_label = ok ? parse_handy_store_block2( op->reply + ( n - 1 ) *
+	MAX_SCSI_XFER, label ) : NULL;
+    if( get_label )
+      printf( "Disk label: %s\n", get_label );
+    else
+      printf( "Disk label was not yet set\n" );
+  }
+  if( sw.gethint )
+  {
+    get_hint = ok ? parse_handy_store_block1( op->reply, hint ) : NULL;
+    if( get_hint )
+      printf( "Password hint: %s\n", get_hint );
+    else
+      printf( "Password hint was not yet set\n" );
+  }
+  return ok;
+}
+
+static int
+op_backup( struct scsi_op_t *op )
+{
+  return backup_handy( op, handy_image );
+}
+
+static int
+op_set_label( struct scsi_op_t *op )
+{
+  char          set_label[33];
+
+  if( NULL == readpassphrase( "Please enter new disk label: ",
+      set_label, 33, RPP_ECHO_ON ) )
+    return 0;
+  if( write_handy_store_block2( op, set_label ) )
+  {
+    printf( "Disk label was set\n" );
+    return 1;
+  }
+  return 0;
+}
+
+static int
+op_set_hint( struct scsi_op_t *op )
+{
+  char          set_hint[102];
+
+  if( NULL == readpassphrase( "Please enter a password hint: ",
+      set_hint, 102, RPP_ECHO_ON ) )
+    return 0;
+  if( write_handy_store_block1( op, 0, set_hint, NULL ) )
+  {
+    printf( "Password hint was set\n" );
+    return 1;
+  }
+  return 0;
+}
+
+static int
+op_new_salt( struct scsi_op_t *op )
+{
+  struct kdf_params kp;
+  uint64_t      ns = 0;
+
+  if( op->reply[3] != 0 )
+  {
+    printf( "Device has to be unprotected to perform this operation.\n" );
+    return 0;
+  }
+  if( kdf_target_ms )
+  {
+    memset( &kp, 0, sizeof( kp ) );
+    kp.algo = KDF_WD;
+    // no password to derive here: report what the calibration measured
+    if( !calibrate_kdf( &kp, &ns ) )
+      return 0;
+  }
+  if( write_handy_store_block1( op, 1, NULL, kdf_target_ms ? &kp : NULL ) )
+  {
+    printf( "Generating and storing new salt.\n" );
+    if( kdf_target_ms )
+      report_kdf( &kp, ns );
+    return 1;
+  }
+  return 0;
+}
+
+static int
+op_new_passwd( struct scsi_op_t *op )
+{
+  if( change_password( op, SET_PASSWD ) )
+  {
+    printf( "Password was set successfully.\n" );
+    return 1;
+  }
+  printf( "Error setting new password.\n" );
+  return 0;
+}
+
+static int
+op_change_passwd( struct scsi_op_t *op )
+{
+  if( change_password( op, CHANGE_PASSWD ) )
+  {
+    printf( "Password changed successfully.\n" );
+    return 1;
+  }
+  printf( "Error changing password.\n" );
+  return 0;
+}
+
+static int
+op_disable_encryption( struct scsi_op_t *op )
+{
+  if( change_password( op, DISABLE_ENCRYPTION ) )
+  {
+    printf( "Security is disabled (no password).\n" );
+    return 1;
+  }
+  printf( "Security disabled operation failed.\n" );
+  return 0;
+}
+
+static int
+op_restore( struct scsi_op_t *op )
+{
+  if( op->reply[3] != 0 && op->reply[3] != 2 )
+  {
+    printf( "Device has to be unlocked or unprotected to perform this "
+	"operation.\n" );
+    return 0;
+  }
+  return restore_handy( op, handy_image );
+}
+
+static int
+op_erase( struct scsi_op_t *op )
+{
+  int           c;
+
+  printf( "!!! All data on %s will be lost !!!\n", op->device_name );
+  printf( "Are you sure you want to continue? [y/N] " );
+  fflush( stdout );
+  c = getchar(  );
+  c |= 0x20;
+  if( c != 'y' )
+  {
+    printf( "Ok, nevermind.\n" );
+    return 0;
+  }
+  handy_cache_drop( op );	// the drive may reset its handy store
+  // the key reset enabler is voided by every other command: fetch it last
+  if( !get_encryption_status( op ) )
+  {
+    printf( "Cannot get encryption status.\n" );
+    return 0;
+  }
+  if( secure_erase_drive( op ) )
+  {
+    printf
+	( "Device erased. You need to create a new partition on the device.\n" );
+    return 1;
+  }
+  printf( "Something went wrong.\n" );
+  return 0;
+}
+
+// Labels and hints hold the low byte of each UCS-2 character the drive
+// stores, so bytes above 0x7f are Latin-1 and escaped as such: raw they
+// would not be valid UTF-8
+static void
+json_string( FILE *f, const char *str )
+{
+  fputc( '"', f );
+  for( ; *str; str++ )
+  {
+    if( *str == '"' || *str == '\\' )
+      fprintf( f, "\\%c", *str );
+    else if( ( unsigned char ) *str < ' ' || ( unsigned char ) *str > 0x7f )
+      fprintf( f, "\\u%04x", ( unsigned char ) *str );
+    else
+      fputc( *str, f );
+  }
+  fputc( '"', f );
+}
+
+// Name of a command of the tool, by opcode and cdb[1]
+static const char *
+command_name( uint8_t opcode, uint8_t action, char *buf, int len )
+{
+  switch ( opcode << 8 | action )
+  {
+    case 0xC045:
+      return "encryption status";
+    case 0xC1E1:
+      return "unlock";
+    case 0xC1E2:
+      return "change password";
+    case 0xC1E3:
+      return "secure erase";
+    case 0x1201:
+      return "inquiry vpd";
+  }
+  switch ( opcode )
+  {
+    case 0xD5:
+      return "read handy capacity";
+    case 0xD8:
+      return "read handy store";
+    case 0xDA:
+      return "write handy store";
+  }
+  sg_get_opcode_name( opcode, 0, len, buf );
+  return buf;
+}
+
+// --stats: one line per opcode and action, latencies in microseconds
+static void
+stats_report( FILE *f, struct scsi_stats_t *st )
+{
+  struct scsi_opcode_stats_t *os;
+  char          name[64];
+  uint64_t      errors;
+  unsigned int  k, r;
+
+  fprintf( f, "%-5s  %-20s %6s %6s %8s %8s %8s %8s %8s\n", "cdb",
+      "command", "count", "errors", "min_us", "p50_us", "p90_us", "p99_us",
+      "max_us" );
+  for( k = 0; k < st->nops; k++ )
+  {
+    os = &st->op[k];
+    for( errors = 0, r = 1; r < SCSI_STATS_RESULTS; r++ )
+      errors += os->results[r];
+    fprintf( f, "%02x %02x  %-20.20s %6" PRIu64 " %6" PRIu64 " %8" PRIu64
+	" %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n",
+	os->opcode, os->action, command_name( os->opcode, os->action, name,
+	    sizeof( name ) ), os->count, errors, os->min_ns / 1000,
+	scsi_stats_percentile( os, 50 ) / 1000,
+	scsi_stats_percentile( os, 90 ) / 1000,
+	scsi_stats_percentile( os, 99 ) / 1000, os->max_ns / 1000 );
+  }
+}
+
+// From here on stdout is the report only
+static int
+json_open( void )
+{
+  int           fd;
+
+  fflush( stdout );
+  if( ( fd = dup( STDOUT_FILENO ) ) < 0 )
+    return -1;
+  if( ( json_out = fdopen( fd, "w" ) ) == NULL )
+  {
+    close( fd );
+    return -1;
+  }
+  return dup2( STDERR_FILENO, STDOUT_FILENO ) < 0 ? -1 : 0;
+}
+
+// The drive's state at the end of the session, from status (NULL if it
+// could not be read), and where the time went
+static void
+json_report( struct scsi_op_t *op, const uint8_t *status, const char *error,
+    int failed )
+{
+  FILE         *f = json_out;
+  struct scsi_cmd_time_t *t;
+  struct kdf_params kp;
+  const uint8_t *block;
+  char          label[33], hint[102], desc[64];
+  bool          block1 = false, block2 = false;
+  unsigned int  k;
+
+  // only what the operations read or wrote: the report issues no command
+  if( status && ( block = handy_cache_block( op, 1 ) ) &&
+      parse_handy_store_block1( block, hint ) )
+  {
+    block1 = true;
+    kdf_params_read( block, &kp );
+  }
+  if( status && ( block = handy_cache_block( op, 2 ) ) )
+    block2 = parse_handy_store_block2( block, label ) != NULL;
+  fprintf( f, "{\n  \"device\": " );
+  json_string( f, op->device_name );
+  if( error )
+  {
+    fprintf( f, ",\n  \"error\": " );
+    json_string( f, error );
+  }
+  if( status )
+  {
+    fprintf( f, ",\n  \"security\": " );
+    json_string( f, sec_status_to_str( status[3] ) );
+    fprintf( f, ",\n  \"security_code\": %u", status[3] );
+    fprintf( f, ",\n  \"cipher\": " );
+    json_string( f, cipher_id_to_str( status[4] ) );
+    fprintf( f, ",\n  \"password_length\": %u",
+	sg_get_unaligned_be16( &status[6] ) );
+    fprintf( f, ",\n  \"key_reset_enabler\": \"%08x\"",
+	sg_get_unaligned_be32( &status[8] ) );
+    fprintf( f, ",\n  \"label\": " );
+    if( block2 )
+      json_string( f, label );
+    else
+      fprintf( f, "null" );
+    fprintf( f, ",\n  \"hint_set\": %s", !block1 ? "null" : hint[0] ?
+	"true" : "false" );
+    if( block1 )
+    {
+      fprintf( f, ",\n  \"iterations\": %u,\n  \"kdf\": ",
+	  kp.iterations );
+      json_string( f, kdf_params_str( &kp, desc, sizeof( desc ) ) );
+    }
+    fprintf( f, ",\n  \"failed_operations\": %d", failed );
+  }
+  fprintf( f, ",\n  \"timing_us\": {\"discovery\": %" PRIu64
+      ", \"open\": %" PRIu64 ", \"commands\": %" PRIu64 ", \"kdf\": %"
+      PRIu64 "}", discovery_ns / 1000, op->timing.open_ns / 1000,
+      op->timing.total_xfer_ns / 1000, op->timing.kdf_ns / 1000 );
+  fprintf( f, ",\n  \"commands\": [" );
+  for( k = 0; k < op->timing.commands && k < JSON_MAX_COMMANDS; k++ )
+  {
+    t = &json_commands[k];
+    fprintf( f, "%s\n    {\"cdb\": \"%02x %02x\", \"result\": %d, "
+	"\"us\": %" PRIu64 ", \"device_us\": %" PRIu64 "}", k ? "," : "",
+	t->opcode, t->action, t->result, t->xfer_ns / 1000,
+	t->device_ns / 1000 );
+  }
+  fprintf( f, "\n  ],\n  \"latency_us\": [" );
+  for( k = 0; cmd_stats && k < cmd_stats->nops; k++ )
+  {
+    struct scsi_opcode_stats_t *os = &cmd_stats->op[k];
+
+    fprintf( f, "%s\n    {\"cdb\": \"%02x %02x\", \"count\": %" PRIu64
+	", \"min\": %" PRIu64 ", \"p50\": %" PRIu64 ", \"p90\": %" PRIu64
+	", \"p99\": %" PRIu64 ", \"max\": %" PRIu64 "}", k ? "," : "",
+	os->opcode, os->action, os->count, os->min_ns / 1000,
+	scsi_stats_percentile( os, 50 ) / 1000,
+	scsi_stats_percentile( os, 90 ) / 1000,
+	scsi_stats_percentile( os, 99 ) / 1000, os->max_ns / 1000 );
+  }
+  fprintf( f, "\n  ]\n}\n" );
+  fflush( f );
+}
+
+enum operation_id
+{
+  OP_STATUS, OP_UNLOCK, OP_GET_LABEL_HINT, OP_BACKUP, OP_RESTORE,
+  OP_SET_LABEL, OP_SET_HINT, OP_NEW_SALT, OP_NEW_PASSWD, OP_CHANGE_PASSWD,
+  OP_DISABLE_ENCRYPTION, OP_ERASE
+};
+
+// Every operation of an invocation, in the order they run. Reads come
+// before writes, and a handy image is restored before the label, hint,
+// salt and password operations rewrite the blocks they own, so block 1
+// always matches the key the drive ends up with. The ones marked
+// 'security' change the lock state, so the status is queried again after
+// them.
+static const struct operation
+{
+  enum operation_id id;
+  const char   *name;
+  int           ( *run ) ( struct scsi_op_t * op );
+  bool          security;
+} operations[] = {
+  {OP_STATUS, "status", op_status, false},
+  {OP_UNLOCK, "unlock", op_unlock, true},
+  {OP_GET_LABEL_HINT, "get_label_hint", op_get_label_hint, false},
+  {OP_BACKUP, "backup_handy", op_backup, false},
+  {OP_RESTORE, "restore_handy", op_restore, false},
+  {OP_SET_LABEL, "set_disk_label", op_set_label, false},
+  {OP_SET_HINT, "set_passwd_hint", op_set_hint, false},
+  {OP_NEW_SALT, "set_new_salt", op_new_salt, false},
+  {OP_NEW_PASSWD, "set_new_passwd", op_new_passwd, true},
+  {OP_CHANGE_PASSWD, "change_passwd", op_change_passwd, true},
+  {OP_DISABLE_ENCRYPTION, "disable_encryption", op_disable_encryption, true},
+  {OP_ERASE, "erase_reset_key", op_erase, true},
+};
+
+static bool
+operation_wanted( enum operation_id id )
+{
+  switch ( id )
+  {
+    case OP_STATUS:
+      return sw.status;
+    case OP_UNLOCK:
+      return sw.unlock;
+    case OP_GET_LABEL_HINT:
+      return sw.getlabel || sw.gethint;
+    case OP_BACKUP:
+      return sw.backup;
+    case OP_SET_LABEL:
+      return sw.setlabel;
+    case OP_SET_HINT:
+      return sw.sethint;
+    case OP_NEW_SALT:
+      return sw.newsalt;
+    case OP_NEW_PASSWD:
+      return sw.newpasswd;
+    case OP_CHANGE_PASSWD:
+      return sw.changepasswd;
+    case OP_DISABLE_ENCRYPTION:
+      return sw.disableencryption;
+    case OP_RESTORE:
+      return sw.restore;
+    case OP_ERASE:
+      return sw.erase;
+  }
+  return false;
+}
+
+// Runs every requested operation in one session. Each one starts with the
+// latest encryption status in op->reply. Returns 0 if all succeeded, 1 if
+// any failed, -1 without a status.
+static int
+run_operations( struct scsi_op_t *op )
+{
+  const struct operation *o;
+  uint8_t       status[MAX_SCSI_XFER];
+  unsigned int  commands, hits;
+  int           ran = 0, failed = 0;
+
+  if( !get_encryption_status( op ) )
+  {
+    printf( "Cannot get encryption status.\n" );
+    if( json_out )
+      json_report( op, NULL, "cannot get encryption status", 0 );
+    return -1;
+  }
+  memcpy( status, op->reply, sizeof( status ) );
+  for( o = operations; o < operations + SG_ARRAY_SIZE( operations ); o++ )
+  {
+    if( !operation_wanted( o->id ) )
+      continue;
+    commands = op->timing.commands;
+    hits = op->handy_cache.hits;
+    memcpy( op->reply, status, sizeof( status ) );
+    ran++;
+    if( !o->run( op ) )
+      failed++;
+    if( sw.verbose )
+      pr2serr( "%s: %u commands, %u handy blocks from cache\n", o->name,
+	  op->timing.commands - commands, op->handy_cache.hits - hits );
+    if( o->security && get_encryption_status( op ) )
+      memcpy( status, op->reply, sizeof( status ) );
+  }
+  if( ran > 1 )
+    printf( "%d of %d operations succeeded\n", ran - failed, ran );
+  if( json_out )
+    json_report( op, status, NULL, failed );
+  return failed ? 1 : 0;
+}
+
+enum unlock_result
+{ UNLOCK_OK, UNLOCK_NOT_LOCKED, UNLOCK_FAILED, UNLOCK_NO_STATUS };
+
+enum unlock_state
+{ UNLOCK_ST_STATUS, UNLOCK_ST_BLOCK1, UNLOCK_ST_KDF, UNLOCK_ST_UNLOCK,
+  UNLOCK_ST_DONE
+};
+
+struct unlock_pool;
+
+// A drive of --all. Block 1 of every drive is read first, so the WD scheme
+// keys of all of them are derived in one kdf_hash_passwords() batch.
+struct unlock_job
+{
+  char         *device_name;
+  enum unlock_result result;
+  int           security;
+  uint64_t      ns;
+  struct unlock_pool *pool;
+  struct scsi_op_t op;
+  enum unlock_state state;
+  int           pwblen;
+  struct kdf_params kp;		// from block 1, once in UNLOCK_ST_KDF
+  bool          have_key;	// key derived by the batch
+  uint8_t       key[KDF_DIGEST_SIZE];
+  uint64_t      t0;
+  char          sg_node[64];
+};
+
+struct unlock_pool
+{
+  struct unlock_job *jobs;
+  int           njobs;
+  int           next;
+  char         *passwd;
+  struct sg_async_loop loop;
+};
+
+// Every attached WD Passport, or every emulated or replayed one
+static int
+passport_devices( char ***devices )
+{
+  if( wd_emu_count(  ) )
+    return wd_emu_devices( devices );
+  if( scsi_replay_active(  ) )
+    return scsi_replay_devices( devices );
+  return find_passport_devices( devices );
+}
+
+static void
+unlock_job_done( struct unlock_job *job, enum unlock_result result )
+{
+  job->result = result;
+  job->state = UNLOCK_ST_DONE;
+  memset( job->key, 0, sizeof( job->key ) );
+  scsi_op_free( &job->op );
+  job->ns = scsi_clock_ns(  ) - job->t0;
+}
+
+// Takes the status and block 1 now in op->reply: the drive then waits
+// for its key in UNLOCK_ST_KDF, or is done
+static bool
+unlock_check_status( struct unlock_job *job )
+{
+  struct scsi_op_t *op = &job->op;
+
+  job->security = op->reply[3];
+  if( job->security != 1 )
+  {
+    unlock_job_done( job, UNLOCK_NOT_LOCKED );
+    return false;
+  }
+  job->pwblen = sg_get_unaligned_be16( &op->reply[6] );
+  return true;
+}
+
+static bool
+unlock_check_block1( struct unlock_job *job )
+{
+  char          hint[102];
+
+  if( parse_handy_store_block1( job->op.reply, hint ) == NULL )
+  {
+    unlock_job_done( job, UNLOCK_FAILED );
+    return false;
+  }
+  kdf_params_read( job->op.reply, &job->kp );
+  job->state = UNLOCK_ST_KDF;
+  return true;
+}
+
+// Derives the key of every drive waiting for one under the WD scheme in
+// a single batch, spread over the multi-buffer SHA-256 lanes and CPUs.
+// scrypt keys are left to each drive: they are memory-hard by design.
+static void
+unlock_derive_batch( struct unlock_pool *pool )
+{
+  struct kdf_job *kj;
+  struct unlock_job *job;
+  int           k, n;
+
+  if( ( kj = calloc( pool->njobs, sizeof( *kj ) ) ) == NULL )
+    return;			// each drive derives its own key then
+  for( n = k = 0; k < pool->njobs; k++ )
+  {
+    job = &pool->jobs[k];
+    if( job->state != UNLOCK_ST_KDF || job->kp.algo != KDF_WD )
+      continue;
+    kj[n].salt = job->kp.wd_salt;
+    kj[n].password = pool->passwd;
+    kj[n++].iterations = job->kp.iterations;
+  }
+  if( sw.verbose && n )
+    printf( "Deriving %d key(s) in one batch (%s SHA-256 code)\n", n,
+	sha256_impl_name(  ) );
+  kdf_hash_passwords( kj, n );
+  for( n = k = 0; k < pool->njobs; k++ )
+  {
+    job = &pool->jobs[k];
+    if( job->state != UNLOCK_ST_KDF || job->kp.algo != KDF_WD )
+      continue;
+    memcpy( job->key, kj[n++].digest, KDF_DIGEST_SIZE );
+    job->have_key = true;
+  }
+  memset( kj, 0, pool->njobs * sizeof( *kj ) );
+  free( kj );
+}
+
+// Builds the UNLOCK command of a drive, from the batch key if it has one
+static int
+unlock_prep( struct unlock_job *job )
+{
+  struct scsi_op_t *op = &job->op;
+
+  if( !job->have_key )
+  {
+    // block 1 is still in op->reply
+    return prep_unlock( op, job->pwblen, job->pool->passwd );
+  }
+  prep_unlock_key( op, job->pwblen, job->key );
+  memset( job->key, 0, sizeof( job->key ) );
+  return 0;
+}
+
+// Worker thread, first pass: status and block 1 of the next drive from
+// the pool until none is left
+static void  *
+unlock_read_worker( void *arg )
+{
+  struct unlock_pool *pool = arg;
+  struct unlock_job *job;
+  struct scsi_op_t *op;
+  int           k;
+
+  while( ( k = __atomic_fetch_add( &pool->next, 1, __ATOMIC_RELAXED ) ) <
+      pool->njobs )
+  {
+    job = &pool->jobs[k];
+    op = &job->op;
+    job->t0 = scsi_clock_ns(  );
+    job->result = UNLOCK_NO_STATUS;
+    if( scsi_op_init( op, job->device_name ) )
+    {
+      job->state = UNLOCK_ST_DONE;
+      job->ns = scsi_clock_ns(  ) - job->t0;
+      continue;
+    }
+    op->stats = cmd_stats;
+    if( scsi_session_open( op ) || !get_encryption_status( op ) )
+      unlock_job_done( job, UNLOCK_NO_STATUS );
+    else if( unlock_check_status( job ) )
+    {
+      if( read_handy_store( op, 1, 1 ) )
+	unlock_check_block1( job );
+      else
+	unlock_job_done( job, UNLOCK_FAILED );
+    }
+  }
+  return NULL;
+}
+
+// Worker thread, second pass: unlocks the drives whose key is derived,
+// deriving the scrypt ones here
+static void  *
+unlock_worker( void *arg )
+{
+  struct unlock_pool *pool = arg;
+  struct unlock_job *job;
+  int           k;
+
+  while( ( k = __atomic_fetch_add( &pool->next, 1, __ATOMIC_RELAXED ) ) <
+      pool->njobs )
+  {
+    job = &pool->jobs[k];
+    if( job->state != UNLOCK_ST_KDF )
+      continue;
+    if( unlock_prep( job ) || scsi_xfer( &job->op ) )
+      unlock_job_done( job, UNLOCK_FAILED );
+    else
+      unlock_job_done( job, UNLOCK_OK );
+  }
+  return NULL;
+}
+
+// Runs fn over the pool on up to MAX_UNLOCK_THREADS threads
+static void
+unlock_run_pool( struct unlock_pool *pool, void *( *fn ) ( void * ) )
+{
+  pthread_t     threads[MAX_UNLOCK_THREADS];
+  int           k, nthreads;
+
+  pool->next = 0;
+  nthreads = pool->njobs < MAX_UNLOCK_THREADS ? pool->njobs :
+      MAX_UNLOCK_THREADS;
+  for( k = 0; k < nthreads; k++ )
+  {
+    if( pthread_create( &threads[k], NULL, fn, pool ) )
+      break;
+  }
+  nthreads = k;
+  if( nthreads == 0 )		// no threads at all, do it ourselves
+    fn( pool );
+  for( k = 0; k < nthreads; k++ )
+    pthread_join( threads[k], NULL );
+}
+
+// Deferred step of a drive: its own key derivation, off the epoll thread
+static int
+unlock_kdf( struct scsi_op_t *op )
+{
+  return unlock_prep( op->priv );
+}
+
+// Completion callback stepping one drive through status -> block 1 ->
+// key derivation -> unlock. WD scheme drives stop before the derivation
+// and wait for the batch; scrypt ones derive on a loop worker.
+static void
+unlock_step( struct scsi_op_t *op, int ret )
+{
+  struct unlock_job *job = op->priv;
+
+  switch ( job->state )
+  {
+    case UNLOCK_ST_STATUS:
+      if( ret || op->reply[0] != 0x45 )
+      {
+	unlock_job_done( job, UNLOCK_NO_STATUS );
+	return;
+      }
+      if( !unlock_check_status( job ) )
+	return;
+      prep_handy_store( op, false, 1, 1 );
+      job->state = UNLOCK_ST_BLOCK1;
+      break;
+    case UNLOCK_ST_BLOCK1:
+      if( ret )
+      {
+	unlock_job_done( job, UNLOCK_FAILED );
+	return;
+      }
+      if( !unlock_check_block1( job ) || job->kp.algo == KDF_WD )
+	return;
+      sg_async_defer( &job->pool->loop, op, unlock_kdf, unlock_step );
+      return;
+    case UNLOCK_ST_KDF:
+      if( ret )
+      {
+	unlock_job_done( job, UNLOCK_FAILED );
+	return;
+      }
+      job->state = UNLOCK_ST_UNLOCK;
+      break;
+    case UNLOCK_ST_UNLOCK:
+      unlock_job_done( job, ret ? UNLOCK_FAILED : UNLOCK_OK );
+      return;
+    case UNLOCK_ST_DONE:
+      return;
+  }
+  if( scsi_xfer_submit( &job->pool->loop, op, unlock_step ) )
+    unlock_job_done( job, UNLOCK_FAILED );
+}
+
+// Start every unlock state machine and run them from one epoll loop up to
+// the key derivation, derive the WD scheme keys in one batch, then run
+// the unlocks
+static void
+unlock_all_async( struct unlock_pool *pool )
+{
+  struct unlock_job *job;
+  struct scsi_op_t *op;
+  int           k;
+
+  if( sg_async_init( &pool->loop ) )
+    return;
+  for( k = 0; k < pool->njobs; k++ )
+  {
+    job = &pool->jobs[k];
+    op = &job->op;
+    job->pool = pool;
+    job->result = UNLOCK_NO_STATUS;
+    job->state = UNLOCK_ST_STATUS;
+    job->t0 = scsi_clock_ns(  );
+    if( !find_sg_node( job->device_name, job->sg_node,
+	    sizeof( job->sg_node ) ) )
+      strncpy( job->sg_node, job->device_name, sizeof( job->sg_node ) - 1 );
+    if( scsi_op_init( op, job->sg_node ) )
+    {
+      job->state = UNLOCK_ST_DONE;
+      job->ns = scsi_clock_ns(  ) - job->t0;
+      continue;
+    }
+    op->priv = job;
+    op->stats = cmd_stats;
+    if( scsi_session_open( op ) || sg_async_add( &pool->loop, op ) )
+    {
+      unlock_job_done( job, UNLOCK_NO_STATUS );
+      continue;
+    }
+    prep_encryption_status( op );
+    if( scsi_xfer_submit( &pool->loop, op, unlock_step ) )
+      unlock_job_done( job, UNLOCK_NO_STATUS );
+  }
+  sg_async_run( &pool->loop, -1 );
+  unlock_derive_batch( pool );
+  for( k = 0; k < pool->njobs; k++ )
+  {
+    job = &pool->jobs[k];
+    if( job->state != UNLOCK_ST_KDF )
+      continue;
+    if( unlock_prep( job ) )
+      unlock_job_done( job, UNLOCK_FAILED );
+    else
+    {
+      job->state = UNLOCK_ST_UNLOCK;
+      if( scsi_xfer_submit( &pool->loop, &job->op, unlock_step ) )
+	unlock_job_done( job, UNLOCK_FAILED );
+    }
+  }
+  sg_async_run( &pool->loop, -1 );
+  sg_async_fini( &pool->loop );
+  // whatever the loop gave up on
+  for( k = 0; k < pool->njobs; k++ )
+    if( pool->jobs[k].state != UNLOCK_ST_DONE )
+      unlock_job_done( &pool->jobs[k], pool->jobs[k].result );
+}
+
+// Unlock every attached WD Passport with one passphrase
+static int
+unlock_all_drives( void )
 {
-  WD_GET_ENCRYPTION_STATUS( cdb );
-  sg_put_unaligned_be16( 48, &cdb[7] );
-  op->dir_inout = false;
-  op->data_len = MAX_SCSI_XFER;
-  if( !scsi_xfer( op ) && reply[0] == 0x45 )
-    return 1;
-  return 0;
+  struct unlock_pool pool;
+  struct unlock_job *job;
+  char        **devices, passwd[65];
+  int           k, unlocked = 0, failed = 0;
+  uint64_t      t0;
+
+  memset( &pool, 0, sizeof( pool ) );
+  pool.njobs = passport_devices( &devices );
+  if( pool.njobs == 0 )
+  {
+    printf( "No WD Passport device found.\n" );
+    return -1;
+  }
+  printf( "Found %d WD Passport device(s).\n", pool.njobs );
+  if( NULL == readpassphrase( "Please enter current disk password: ",
+      passwd, 65, RPP_ECHO_OFF ) )
+  {
+    free_passport_devices( devices );
+    return -1;
+  }
+  pool.passwd = passwd;
+  pool.jobs = calloc( pool.njobs, sizeof( struct unlock_job ) );
+  if( pool.jobs == NULL )
+  {
+    free_passport_devices( devices );
+    return -1;
+  }
+  for( k = 0; k < pool.njobs; k++ )
+  {
+    pool.jobs[k].device_name = devices[k];
+    pool.jobs[k].pool = &pool;
+  }
+
+  t0 = scsi_clock_ns(  );
+  if( sw.async )
+    unlock_all_async( &pool );
+  else
+  {
+    unlock_run_pool( &pool, unlock_read_worker );
+    unlock_derive_batch( &pool );
+    unlock_run_pool( &pool, unlock_worker );
+  }
+  t0 = scsi_clock_ns(  ) - t0;
+  memset( passwd, 0, sizeof( passwd ) );
+
+  for( k = 0; k < pool.njobs; k++ )
+  {
+    job = &pool.jobs[k];
+    printf( "%s: ", job->device_name );
+    switch ( job->result )
+    {
+      case UNLOCK_OK:
+	printf( "unlocked" );
+	unlocked++;
+	break;
+      case UNLOCK_NOT_LOCKED:
+	printf( "not locked (%s)", sec_status_to_str( job->security ) );
+	break;
+      case UNLOCK_FAILED:
+	printf( "error unlocking drive" );
+	failed++;
+	break;
+      case UNLOCK_NO_STATUS:
+	printf( "cannot get encryption status" );
+	failed++;
+	break;
+    }
+    printf( " [%" PRIu64 " ms]\n", job->ns / 1000000 );
+  }
+  printf( "%d of %d drive(s) unlocked in %" PRIu64 " ms\n", unlocked,
+      pool.njobs, t0 / 1000000 );
+  free( pool.jobs );
+  free_passport_devices( devices );
+  return failed ? -1 : 0;
 }
 
-int
-main( int argc, char *argv[] )
+struct backup_pool
+{
+  char        **devices;
+  int           ndevices;
+  int           next;
+  int           failed;
+};
+
+static void  *
+backup_worker( void *arg )
 {
+  struct backup_pool *pool = arg;
   struct scsi_op_t opts, *op = &opts;
-  char          set_label[33], *get_label;
-  char          set_hint[102], *get_hint;
-  int           c;
+  int           k;
 
-  parse_cmd_line( argc, argv );
-  memset( op, 0, sizeof( opts ) );
-  if( ( op->device_name = find_passport_device(  ) ) == NULL )
+  while( ( k = __atomic_fetch_add( &pool->next, 1, __ATOMIC_RELAXED ) ) <
+      pool->ndevices )
   {
-    printf( "No WD Passport device found.\n" );
+    if( scsi_op_init( op, pool->devices[k] ) )
+    {
+      __atomic_fetch_add( &pool->failed, 1, __ATOMIC_RELAXED );
+      continue;
+    }
+    op->stats = cmd_stats;
+    if( scsi_session_open( op ) || !backup_handy( op, handy_image ) )
+      __atomic_fetch_add( &pool->failed, 1, __ATOMIC_RELAXED );
+    scsi_op_free( op );
+  }
+  return NULL;
+}
+
+// Save the handy store of every attached WD Passport, one file per serial
+static int
+backup_all_drives( void )
+{
+  struct backup_pool pool;
+  pthread_t     threads[MAX_UNLOCK_THREADS];
+  struct stat   st;
+  int           k, nthreads;
+  uint64_t      t0;
+
+  if( stat( handy_image, &st ) || !S_ISDIR( st.st_mode ) )
+  {
+    printf( "With --all, %s must be a directory\n", handy_image );
     return -1;
   }
-  printf( "WD Passport device: %s\n", op->device_name );
-  if( !get_encryption_status( op ) )
+  memset( &pool, 0, sizeof( pool ) );
+  pool.ndevices = passport_devices( &pool.devices );
+  if( pool.ndevices == 0 )
   {
-    printf( "Cannot get encryption status.\n" );
+    printf( "No WD Passport device found.\n" );
     return -1;
   }
-  if( sw.status )
+  t0 = scsi_clock_ns(  );
+  nthreads = pool.ndevices < MAX_UNLOCK_THREADS ? pool.ndevices :
+      MAX_UNLOCK_THREADS;
+  for( k = 0; k < nthreads; k++ )
   {
-    printf( "Security: %s\n", sec_status_to_str( reply[3] ) );
-    printf( "Cipher: %s\n", cipher_id_to_str( reply[4] ) );
+    if( pthread_create( &threads[k], NULL, backup_worker, &pool ) )
+      break;
   }
-  if( sw.unlock )
+  nthreads = k;
+  if( nthreads == 0 )
+    backup_worker( &pool );
+  for( k = 0; k < nthreads; k++ )
+    pthread_join( threads[k], NULL );
+  printf( "%d of %d drive(s) saved in %" PRIu64 " ms\n",
+      pool.ndevices - pool.failed, pool.ndevices,
+      ( scsi_clock_ns(  ) - t0 ) / 1000000 );
+  free_passport_devices( pool.devices );
+  return pool.failed ? -1 : 0;
+}
+
+static void
+trace_signal( int sig )
+{
+  trace_wanted = 1;
+}
+
+// Appends the decoded command trace to --trace
+static void
+trace_write( void )
+{
+  FILE         *f = stderr;
+
+  trace_wanted = 0;
+  if( strcmp( trace_file, "-" ) && NULL == ( f = fopen( trace_file, "a" ) ) )
   {
-    if( unlock_drive( op ) )
-      printf( "Drive unlocked successfully.\n" );
-    else
-      printf( "Error unlocking drive.\n" );
-    return 0;
+    pr2serr( "cannot write %s: %s\n", trace_file, strerror( errno ) );
+    return;
   }
-  if( sw.getlabel )
+  scsi_trace_dump( f );
+  if( f != stderr )
+    fclose( f );
+}
+
+// Query the lock state of a registry entry and unlock it if asked to
+static void
+monitor_check( struct passport_entry *ent, char *passwd )
+{
+  struct scsi_op_t opts, *op = &opts;
+
+  if( scsi_op_init( op, ent->block_node ) )
+    return;
+  if( !scsi_session_open( op ) && get_encryption_status( op ) )
   {
-    get_label = read_handy_store_block2( op );
-    if( get_label )
-      printf( "Disk label: %s\n", get_label );
-    else
-      printf( "Disk label was not yet set\n" );
-    return 0;
+    ent->security = op->reply[3];
+    printf( "%s (%s): %s\n", ent->block_node, ent->hctl,
+	sec_status_to_str( ent->security ) );
+    if( passwd && ent->security == 1 )
+    {
+      if( unlock_drive( op, passwd ) && get_encryption_status( op ) )
+	ent->security = op->reply[3];
+      printf( "%s (%s): %s\n", ent->block_node, ent->hctl,
+	  ent->security == 2 ? "unlocked" : "error unlocking drive" );
+    }
   }
-  if( sw.setlabel )
+  else
+    printf( "%s (%s): cannot get encryption status\n", ent->block_node,
+	ent->hctl );
+  fflush( stdout );
+  scsi_op_free( op );
+}
+
+static void
+monitor_event( struct passport_registry *reg, struct passport_entry *ent,
+    enum hotplug_event ev, void *passwd )
+{
+  switch ( ev )
   {
-    if( NULL == readpassphrase( "Please enter new disk label: ",
-	set_label, 33, RPP_ECHO_ON ) )
-      return 0;
-    if( write_handy_store_block2( op, set_label ) )
+    case HOTPLUG_ADD:
+      printf( "WD Passport %s added\n", ent->hctl );
+      break;
+    case HOTPLUG_REMOVE:
+      printf( "WD Passport %s removed\n", ent->hctl );
+      break;
+    case HOTPLUG_CHANGE:
+      break;
+  }
+  fflush( stdout );
+  if( ev != HOTPLUG_REMOVE && ent->block_node[0] && ent->security < 0 )
+    monitor_check( ent, passwd );
+}
+
+// Watch kernel uevents and keep a live registry of attached Passports
+static int
+monitor_drives( void )
+{
+  struct passport_registry reg;
+  struct passport_entry *ent;
+  struct pollfd pfd;
+  char          passwd[65], *pw = NULL;
+  int           k;
+
+  registry_init( &reg );
+  if( hotplug_open( &reg ) )
+    return -1;
+  if( sw.unlock )
+  {
+    if( NULL == readpassphrase( "Please enter current disk password: ",
+	passwd, 65, RPP_ECHO_OFF ) )
     {
-      printf( "Disk label was set\n" );
-      return 1;
+      registry_free( &reg );
+      return -1;
     }
-    return 0;
+    pw = passwd;
   }
-  if( sw.gethint )
+  printf( "%d WD Passport device(s) attached.\n", registry_scan( &reg ) );
+  for( k = 0; k < REG_BUCKETS; k++ )
+    for( ent = reg.by_hctl[k]; ent; ent = ent->next )
+      if( ent->block_node[0] )
+	monitor_check( ent, pw );
+  fflush( stdout );
+  pfd.fd = reg.nl_fd;
+  pfd.events = POLLIN;
+  while( 1 )
   {
-    get_hint = read_handy_store_block1( op );
-    if( get_hint )
-      printf( "Password hint: %s\n", get_hint );
+    if( poll( &pfd, 1, -1 ) < 0 && errno != EINTR )
+      break;
+    if( trace_wanted )
+      trace_write(  );
+    if( hotplug_process( &reg, monitor_event, pw ) < 0 )
+      break;
+  }
+  if( pw )
+    memset( passwd, 0, sizeof( passwd ) );
+  registry_free( &reg );
+  return -1;
+}
+
+// Unchanged polls double a drive's interval up to this multiple of --watch
+#define WATCH_BACKOFF_MAX 8
+// States of a watched drive besides the SECURITY STATUS byte
+#define WATCH_NO_STATUS -1
+#define WATCH_ABSENT -2
+
+// Per drive state of --watch, hung off the registry entry
+struct watch_drive
+{
+  struct scsi_op_t op;
+  int           state;		// last reported, WATCH_* or security
+  uint8_t       cipher;
+  struct scsi_stats_t stats;	// for --prom
+  unsigned int  interval_ms;
+  uint64_t      due_ns;
+};
+
+static unsigned int watch_seed;
+
+static const char *
+watch_state_str( int state )
+{
+  if( state == WATCH_ABSENT )
+    return "absent";
+  if( state == WATCH_NO_STATUS )
+    return "no status";
+  return sec_status_to_str( state );
+}
+
+static void
+watch_report( struct passport_entry *ent, int from, int to )
+{
+  char          stamp[32];
+  time_t        now = time( NULL );
+
+  strftime( stamp, sizeof( stamp ), "%Y-%m-%dT%H:%M:%S",
+      localtime( &now ) );
+  if( sw.json )
+  {
+    printf( "{\"time\": \"%s\", \"device\": ", stamp );
+    if( ent->block_node[0] )
+      json_string( stdout, ent->block_node );
     else
-      printf( "Password hint was not yet set\n" );
-    return 0;
+      printf( "null" );
+    printf( ", \"hctl\": " );
+    json_string( stdout, ent->hctl );
+    printf( ", \"from\": " );
+    json_string( stdout, watch_state_str( from ) );
+    printf( ", \"to\": " );
+    json_string( stdout, watch_state_str( to ) );
+    printf( "}\n" );
   }
-  if( sw.sethint )
+  else
+    printf( "%s %s (%s): %s -> %s\n", stamp,
+	ent->block_node[0] ? ent->block_node : "-", ent->hctl,
+	watch_state_str( from ), watch_state_str( to ) );
+  fflush( stdout );
+}
+
+// Next poll: the base interval after a change, otherwise twice the last
+// one up to the cap, spread by +-25% so drives on one bus drift apart
+static void
+watch_schedule( struct watch_drive *d, bool changed )
+{
+  unsigned int  ms;
+
+  if( changed || d->interval_ms == 0 )
+    d->interval_ms = watch_ms;
+  else if( d->interval_ms < watch_ms * WATCH_BACKOFF_MAX )
+    d->interval_ms = d->interval_ms * 2 > watch_ms * WATCH_BACKOFF_MAX ?
+	watch_ms * WATCH_BACKOFF_MAX : d->interval_ms * 2;
+  ms = d->interval_ms * 3 / 4 +
+      rand_r( &watch_seed ) % ( d->interval_ms / 2 + 1 );
+  d->due_ns = scsi_clock_ns(  ) + ms * 1000000ULL;
+}
+
+// One ENCRYPTION STATUS over the drive's open handle
+static void
+watch_poll( struct passport_entry *ent, struct watch_drive *d )
+{
+  int           state = WATCH_NO_STATUS;
+  bool          changed;
+
+  if( !ent->block_node[0] )
   {
-    if( NULL == readpassphrase( "Please enter a password hint: ",
-	set_hint, 102, RPP_ECHO_ON ) )
-      return 0;
-    if( write_handy_store_block1( op, 0, set_hint ) )
+    // no block device (yet), wait for its uevent
+    d->due_ns = UINT64_MAX;
+    return;
+  }
+  if( !scsi_session_open( &d->op ) && get_encryption_status( &d->op ) )
+  {
+    state = d->op.reply[3];
+    d->cipher = d->op.reply[4];
+  }
+  else
+    scsi_session_close( &d->op );	// reopened by the next poll
+  ent->security = state;
+  changed = state != d->state;
+  if( changed )
+    watch_report( ent, d->state, state );
+  d->state = state;
+  watch_schedule( d, changed );
+}
+
+static void
+watch_event( struct passport_registry *reg, struct passport_entry *ent,
+    enum hotplug_event ev, void *arg )
+{
+  struct watch_drive *d = ent->priv;
+
+  if( d == NULL )
+  {
+    if( ev == HOTPLUG_REMOVE || NULL == ( d = calloc( 1, sizeof( *d ) ) ) )
+      return;
+    // device_name follows the entry's block node across re-plugs
+    if( scsi_op_init( &d->op, ent->block_node ) )
     {
-      printf( "Password hint was set\n" );
-      return 1;
+      free( d );
+      return;
     }
-    return 0;
+    scsi_stats_init( &d->stats );
+    d->op.stats = &d->stats;
+    d->state = WATCH_ABSENT;
+    ent->priv = d;
+  }
+  // any event may mean a new node behind the handle: reopen and poll now
+  scsi_session_close( &d->op );
+  if( ev == HOTPLUG_REMOVE )
+  {
+    if( d->state != WATCH_ABSENT )
+      watch_report( ent, d->state, WATCH_ABSENT );
+    scsi_op_free( &d->op );
+    free( d );
+    ent->priv = NULL;
+    return;
   }
-  if( sw.newsalt )
+  watch_poll( ent, d );
+}
+
+static const char *const prom_results[SCSI_STATS_RESULTS] = {
+  "good", "status", "sense", "transport_error", "os_error", "not_issued"
+};
+
+// Security states exported as an enum gauge, WATCH_NO_STATUS last
+static const int prom_states[] = {
+  0x00, 0x01, 0x02, 0x06, 0x07, WATCH_NO_STATUS
+};
+
+static void
+prom_drive( FILE *f, struct passport_entry *ent, struct watch_drive *d )
+{
+  struct scsi_opcode_stats_t *os;
+  char          labels[128];
+  uint64_t      n;
+  int           k, b;
+
+  snprintf( labels, sizeof( labels ), "hctl=\"%s\",device=\"%s\"",
+      ent->hctl, ent->block_node );
+  for( k = 0; k < SG_ARRAY_SIZE( prom_states ); k++ )
+    fprintf( f, "wd_passport_security{%s,state=\"%s\"} %d\n", labels,
+	watch_state_str( prom_states[k] ), d->state == prom_states[k] );
+  if( d->state >= 0 )
+    fprintf( f, "wd_passport_cipher_info{%s,cipher=\"%s\",id=\"0x%02x\"}"
+	" 1\n", labels, cipher_id_to_str( d->cipher ), d->cipher );
+  for( k = 0; k < d->stats.nops; k++ )
   {
-    if( reply[3] != 0 )
+    os = &d->stats.op[k];
+    for( b = 0; b < SCSI_STATS_RESULTS; b++ )
+      if( os->results[b] )
+	fprintf( f, "wd_passport_scsi_commands_total{%s,opcode=\"0x%02x\","
+	    "action=\"0x%02x\",result=\"%s\"} %" PRIu64 "\n", labels,
+	    os->opcode, os->action, prom_results[b], os->results[b] );
+    for( n = 0, b = 0; b <= SCSI_STATS_BUCKETS; b++ )
     {
-      printf( "Device has to be unprotected to perform this operation.\n" );
-      return 0;
+      n += os->buckets[b];
+      if( b < SCSI_STATS_BUCKETS )
+	fprintf( f, "wd_passport_scsi_command_seconds_bucket{%s,"
+	    "opcode=\"0x%02x\",action=\"0x%02x\",le=\"%g\"} %" PRIu64
+	    "\n", labels, os->opcode, os->action,
+	    scsi_stats_bounds_ns[b] / 1e9, n );
+      else
+	fprintf( f, "wd_passport_scsi_command_seconds_bucket{%s,"
+	    "opcode=\"0x%02x\",action=\"0x%02x\",le=\"+Inf\"} %" PRIu64
+	    "\n", labels, os->opcode, os->action, n );
     }
-    if( write_handy_store_block1( op, 1, NULL ) )
+    fprintf( f, "wd_passport_scsi_command_seconds_sum{%s,opcode=\"0x%02x\","
+	"action=\"0x%02x\"} %.9f\n", labels, os->opcode, os->action,
+	os->sum_ns / 1e9 );
+    fprintf( f, "wd_passport_scsi_command_seconds_count{%s,"
+	"opcode=\"0x%02x\",action=\"0x%02x\"} %" PRIu64 "\n", labels,
+	os->opcode, os->action, n );
+  }
+}
+
+// Writes the metrics of every watched drive to a temporary file renamed
+// over --prom, so the node exporter never reads a partial file
+static void
+prom_write( struct passport_registry *reg )
+{
+  struct passport_entry *ent;
+  char          tmp[PATH_MAX];
+  FILE         *f;
+  int           k, err;
+
+  snprintf( tmp, sizeof( tmp ), "%s.%d.tmp", prom_file, getpid(  ) );
+  if( NULL == ( f = fopen( tmp, "w" ) ) )
+  {
+    pr2serr( "cannot write %s: %s\n", tmp, strerror( errno ) );
+    return;
+  }
+  fprintf( f, "# HELP wd_passport_security Security state of the drive, "
+      "1 for the current one.\n# TYPE wd_passport_security gauge\n"
+      "# HELP wd_passport_cipher_info Cipher of the drive.\n"
+      "# TYPE wd_passport_cipher_info gauge\n"
+      "# HELP wd_passport_scsi_commands_total SCSI commands by opcode, "
+      "action and pass-through result.\n"
+      "# TYPE wd_passport_scsi_commands_total counter\n"
+      "# HELP wd_passport_scsi_command_seconds SCSI command latency.\n"
+      "# TYPE wd_passport_scsi_command_seconds histogram\n" );
+  for( k = 0; k < REG_BUCKETS; k++ )
+    for( ent = reg->by_hctl[k]; ent; ent = ent->next )
+      if( ent->priv && ent->block_node[0] )
+	prom_drive( f, ent, ent->priv );
+  err = ferror( f );
+  if( fclose( f ) || err || rename( tmp, prom_file ) )
+  {
+    pr2serr( "cannot write %s: %s\n", prom_file, strerror( errno ) );
+    unlink( tmp );
+  }
+}
+
+// Poll every attached Passport over a persistent handle, print transitions
+static int
+watch_drives( void )
+{
+  struct passport_registry reg;
+  struct passport_entry *ent;
+  struct watch_drive *d;
+  struct pollfd pfd;
+  uint64_t      now, next;
+  int           k, timeout, polls;
+
+  registry_init( &reg );
+  if( hotplug_open( &reg ) )
+    return -1;
+  watch_seed = scsi_clock_ns(  ) ^ getpid(  );
+  registry_scan( &reg );
+  for( k = 0; k < REG_BUCKETS; k++ )
+    for( ent = reg.by_hctl[k]; ent; ent = ent->next )
+      watch_event( &reg, ent, HOTPLUG_ADD, NULL );
+  pfd.fd = reg.nl_fd;
+  pfd.events = POLLIN;
+  pfd.revents = POLLIN;		// write the first metrics right away
+  while( 1 )
+  {
+    now = scsi_clock_ns(  );
+    next = UINT64_MAX;
+    polls = pfd.revents;
+    for( k = 0; k < REG_BUCKETS; k++ )
+      for( ent = reg.by_hctl[k]; ent; ent = ent->next )
+	if( ( d = ent->priv ) )
+	{
+	  if( d->due_ns <= now )
+	  {
+	    watch_poll( ent, d );
+	    polls++;
+	  }
+	  if( d->due_ns < next )
+	    next = d->due_ns;
+	}
+    if( prom_file && polls )
+      prom_write( &reg );
+    now = scsi_clock_ns(  );
+    timeout = next == UINT64_MAX ? -1 :
+	next <= now ? 0 : ( next - now + 999999 ) / 1000000;
+    pfd.revents = 0;
+    if( poll( &pfd, 1, timeout ) < 0 && errno != EINTR )
+      break;
+    if( trace_wanted )
+      trace_write(  );
+    if( pfd.revents & POLLIN &&
+	hotplug_process( &reg, watch_event, NULL ) < 0 )
+      break;
+  }
+  for( k = 0; k < REG_BUCKETS; k++ )
+    for( ent = reg.by_hctl[k]; ent; ent = ent->next )
+      if( ( d = ent->priv ) )
+      {
+	scsi_op_free( &d->op );
+	free( d );
+	ent->priv = NULL;
+      }
+  registry_free( &reg );
+  return -1;
+}
+
+// One request to wd-passportd; returns its result, WDPD_E_PROTO if lost
+static int
+wdpd_call( int fd, struct wdpd_request *req, struct wdpd_reply *rep )
+{
+  int           len;
+
+  req->magic = WDPD_MAGIC;
+  req->version = WDPD_VERSION;
+  len = send( fd, req, sizeof( *req ), 0 );
+  memset( req->passwd, 0, sizeof( req->passwd ) );
+  memset( req->new_passwd, 0, sizeof( req->new_passwd ) );
+  if( len != sizeof( *req ) ||
+      recv( fd, rep, sizeof( *rep ), 0 ) != sizeof( *rep ) ||
+      rep->magic != WDPD_MAGIC )
+    return WDPD_E_PROTO;
+  return rep->result;
+}
+
+// The operations of --socket, run by the daemon on its first drive
+static int
+socket_operations( void )
+{
+  struct sockaddr_un addr;
+  struct wdpd_request req;
+  struct wdpd_reply rep;
+  char          sec_passwd[65];
+  int           fd, ret, failed = 0;
+
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  snprintf( addr.sun_path, sizeof( addr.sun_path ), "%s", wdpd_socket );
+  fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+  if( fd < 0 || connect( fd, ( struct sockaddr * ) &addr, sizeof( addr ) ) )
+  {
+    printf( "Cannot connect to %s: %s\n", wdpd_socket, strerror( errno ) );
+    if( fd >= 0 )
+      close( fd );
+    return -1;
+  }
+  memset( &req, 0, sizeof( req ) );
+  if( sw.status )
+  {
+    req.op = WDPD_LIST;
+    // one reply per drive, then WDPD_END
+    for( ret = wdpd_call( fd, &req, &rep ); ret != WDPD_END;
+	ret = recv( fd, &rep, sizeof( rep ), 0 ) == sizeof( rep ) ?
+	rep.result : WDPD_E_PROTO )
     {
-      printf( "Generating and storing new salt.\n" );
-      return 1;
+      if( ret != WDPD_OK && ret != WDPD_E_IO )
+      {
+	printf( "Bad reply from %s\n", wdpd_socket );
+	failed++;
+	break;
+      }
+      printf( "%s (%s): Security: %s", rep.block_node, rep.hctl,
+	  rep.security < 0 ? "unknown" : rep.text );
+      if( rep.security >= 0 )
+	printf( ", Cipher: %s [%u ms ago]", cipher_id_to_str( rep.cipher ),
+	    rep.status_age_ms );
+      printf( "\n" );
     }
-    return 0;
   }
-  if( sw.newpasswd )
+  if( sw.unlock )
   {
-    if( change_password( op, SET_PASSWD ) )
-      printf( "Password was set successfully.\n" );
+    req.op = WDPD_UNLOCK;
+    if( NULL == readpassphrase( "Please enter current disk password: ",
+	req.passwd, 65, RPP_ECHO_OFF ) )
+      failed++;
+    else if( wdpd_call( fd, &req, &rep ) == WDPD_OK )
+      printf( "Drive unlocked successfully.\n" );
     else
-      printf( "Error setting new password.\n" );
-    return 0;
+    {
+      printf( "Error unlocking drive.\n" );
+      failed++;
+    }
   }
-  if( sw.changepasswd )
+  if( sw.getlabel )
   {
-    if( change_password( op, CHANGE_PASSWD ) )
-      printf( "Password changed successfully.\n" );
+    req.op = WDPD_LABEL;
+    if( wdpd_call( fd, &req, &rep ) != WDPD_OK )
+      failed++;
+    else if( rep.text[0] )
+      printf( "Disk label: %.33s\n", rep.text );
     else
-      printf( "Error changing password.\n" );
-    return 0;
+      printf( "Disk label was not yet set\n" );
   }
-  if( sw.disableencryption )
+  if( sw.gethint )
   {
-    if( change_password( op, DISABLE_ENCRYPTION ) )
-      printf( "Security is disabled (no password).\n" );
+    req.op = WDPD_HINT;
+    if( wdpd_call( fd, &req, &rep ) != WDPD_OK )
+      failed++;
+    else if( rep.text[0] )
+      printf( "Password hint: %.102s\n", rep.text );
     else
-      printf( "Security disabled operation failed.\n" );
-    return 0;
+      printf( "Password hint was not yet set\n" );
   }
-  if( sw.erase )
+  if( sw.changepasswd )
   {
-    printf( "!!! All data on %s will be lost !!!\n", op->device_name );
-    printf( "Are you sure you want to continue? [y/N] " );
-    fflush( stdout );
-    c = getchar(  );
-    c |= 0x20;
-    if( c == 'y' )
+    req.op = WDPD_CHANGE_PASSWD;
+    ret = WDPD_E_FAILED;
+    if( readpassphrase( "Please enter current disk password: ",
+	    req.passwd, 65, RPP_ECHO_OFF ) &&
+	readpassphrase( "Please enter new disk password: ",
+	    req.new_passwd, 65, RPP_ECHO_OFF ) &&
+	readpassphrase( "Retype new disk password: ",
+	    sec_passwd, 65, RPP_ECHO_OFF ) )
     {
-      if( secure_erase_drive( op ) )
-	printf
-	    ( "Device erased. You need to create a new partition on the device.\n" );
+      if( strcmp( req.new_passwd, sec_passwd ) )
+	printf( "Passwords don't match\n" );
       else
-	printf( "Something went wrong.\n" );
+	ret = wdpd_call( fd, &req, &rep );
     }
+    memset( &req, 0, sizeof( req ) );
+    memset( sec_passwd, 0, sizeof( sec_passwd ) );
+    if( ret == WDPD_OK )
+      printf( "Password changed successfully.\n" );
     else
-      printf( "Ok, nevermind.\n" );
-    return 0;
+    {
+      printf( "Error changing password.\n" );
+      failed++;
+    }
   }
-  return 0;
+  close( fd );
+  return failed ? 1 : 0;
+}
+
+int
+main( int argc, char *argv[] )
+{
+  struct scsi_op_t opts, *op = &opts;
+  char         *device_name;
+  int           ret;
+  unsigned int  hits;
+  uint64_t      t0;
+
+  // installed as wd-passportd too: wd-passportd [SOCKET]
+  device_name = strrchr( argv[0], '/' );
+  if( 0 == strcmp( device_name ? device_name + 1 : argv[0], "wd-passportd" ) )
+    return daemon_main( argc > 1 ? argv[1] : WDPD_SOCKET );
+  parse_cmd_line( argc, argv );
+  if( trace_file )
+  {
+    atexit( trace_write );
+    signal( SIGUSR1, trace_signal );
+  }
+  if( record_file )
+  {
+    if( scsi_record_open( record_file ) )
+      return -1;
+    atexit( scsi_record_close );
+  }
+  if( sw.daemon )
+    return daemon_main( wdpd_socket );
+  if( wdpd_socket )
+    return socket_operations(  );
+  if( sw.monitor )
+    return monitor_drives(  );
+  if( sw.watch )
+    return watch_drives(  );
+  if( sw.stats || sw.json )
+  {
+    scsi_stats_init( &cmd_stats_buf );
+    cmd_stats = &cmd_stats_buf;
+  }
+  if( sw.all )
+  {
+    ret = sw.backup ? backup_all_drives(  ) : unlock_all_drives(  );
+    if( sw.stats )
+      stats_report( stdout, cmd_stats );
+    return ret;
+  }
+  if( sw.json && json_open(  ) )
+    return -1;
+  t0 = scsi_clock_ns(  );
+  if( wd_emu_count(  ) )
+    device_name = WD_EMU_PREFIX "0";
+  else if( scsi_replay_active(  ) )
+    device_name = scsi_replay_device( 0 );
+  else
+    device_name = find_passport_device(  );
+  discovery_ns = scsi_clock_ns(  ) - t0;
+  if( device_name == NULL )
+  {
+    printf( "No WD Passport device found.\n" );
+    if( json_out )
+      fprintf( json_out, "{\n  \"device\": null,\n  \"error\": "
+	  "\"no WD Passport device found\"\n}\n" );
+    return -1;
+  }
+  printf( "WD Passport device: %s\n", device_name );
+  if( scsi_op_init( op, device_name ) )
+    return -1;
+  op->stats = cmd_stats;
+  if( json_out )
+  {
+    op->cmd_log = json_commands;
+    op->cmd_log_size = JSON_MAX_COMMANDS;
+  }
+  if( scsi_session_open( op ) )
+  {
+    if( json_out )
+      json_report( op, NULL, "cannot open the device", 0 );
+    scsi_op_free( op );
+    return -1;
+  }
+  ret = run_operations( op );
+  hits = op->handy_cache.hits;
+  scsi_op_free( op );
+  if( sw.verbose )
+    pr2serr( "Session: open %" PRIu64 " us, %u commands in %" PRIu64
+        " us, close %" PRIu64 " us, %u handy blocks from cache\n",
+        op->timing.open_ns / 1000, op->timing.commands,
+        op->timing.total_xfer_ns / 1000, op->timing.close_ns / 1000,
+        hits );
+  if( sw.stats )
+    stats_report( stdout, cmd_stats );
+  return ret;
 }
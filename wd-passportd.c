@@ -0,0 +1,607 @@
+// wd-passportd: keeps the registry of attached WD Passports and an open
+// session per drive, and answers the requests of inc/wdpd.h on a UNIX
+// socket. Drive state comes from the registry, kept current by uevents,
+// so status requests never scan sysfs or reopen a device. The poll loop
+// rereads the status of every idle drive each WDPD_POLL_MS and status
+// requests are answered from that, unless they ask for WDPD_REFRESH.
+// Requests are served one at a time from that loop, except unlocks and
+// password changes: their key derivation takes long, so each runs in a
+// worker thread that owns the drive's session until it reports back.
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "sg_pt_linux.h"
+#include "sg_pr2serr.h"
+#include "hotplug.h"
+#include "passport.h"
+#include "wdpd.h"
+#include "scsi_trace.h"
+
+#define WDPD_MAX_CLIENTS 64
+
+// Per drive state hung off the registry entry. While busy a worker owns
+// op and the fields below it; the poll loop only reads ent->security.
+struct wdpd_drive
+{
+  struct passport_entry *ent;	// NULL once the entry went away
+  bool          busy;
+  char          node[64];	// op.device_name, outlives the entry
+  struct scsi_op_t op;
+  uint8_t       cipher;
+  uint16_t      pwblen;
+  uint64_t      status_ns;	// when ent->security was read, 0 if never
+  uint64_t      due_ns;		// next reread by the poll loop
+};
+
+// An unlock or password change handed to a worker thread
+struct wdpd_job
+{
+  struct wdpd_drive *d;
+  int           fd;		// client waiting for the reply
+  struct wdpd_request req;
+  int           result;
+  int           security;	// status after the operation, -1 if unknown
+};
+
+static volatile sig_atomic_t wdpd_stop, wdpd_trace;
+// workers write their finished job here, read by the poll loop
+static int    wdpd_done[2] = { -1, -1 };
+static int    wdpd_jobs;
+
+static void
+wdpd_signal( int sig )
+{
+  if( sig == SIGUSR1 )
+    wdpd_trace = 1;
+  else
+    wdpd_stop = 1;
+}
+
+static void
+drive_free( struct passport_entry *ent )
+{
+  struct wdpd_drive *d = ent->priv;
+
+  if( d == NULL )
+    return;
+  ent->priv = NULL;
+  d->ent = NULL;
+  if( d->busy )			// freed when its worker reports back
+    return;
+  scsi_op_free( &d->op );
+  free( d );
+}
+
+// Reads the encryption status, left in op->reply; returns SECURITY
+// STATUS or -1. The handy blocks are read again after it, as whatever
+// changed the status may have rewritten them too. Safe in a worker: it
+// does not touch the entry.
+static int
+drive_status( struct wdpd_drive *d )
+{
+  handy_cache_drop( &d->op );
+  d->due_ns = scsi_clock_ns(  ) + WDPD_POLL_MS * 1000000ULL;
+  if( scsi_session_open( &d->op ) || !get_encryption_status( &d->op ) )
+  {
+    // the next request opens the device again
+    scsi_session_close( &d->op );
+    d->status_ns = 0;
+    return -1;
+  }
+  d->cipher = d->op.reply[4];
+  d->pwblen = ( d->op.reply[6] << 8 ) | d->op.reply[7];
+  d->status_ns = scsi_clock_ns(  );
+  return d->op.reply[3];
+}
+
+// Reads the encryption status into the entry; leaves it in op->reply
+static int
+drive_query( struct passport_entry *ent, struct wdpd_drive *d )
+{
+  ent->security = drive_status( d );
+  return ent->security >= 0;
+}
+
+// The drive state of an entry, created when its block node is known
+static struct wdpd_drive *
+drive_get( struct passport_entry *ent )
+{
+  struct wdpd_drive *d = ent->priv;
+
+  if( d || !ent->block_node[0] )
+    return d;
+  if( ( d = calloc( 1, sizeof( *d ) ) ) == NULL )
+    return NULL;
+  snprintf( d->node, sizeof( d->node ), "%s", ent->block_node );
+  if( scsi_op_init( &d->op, d->node ) )
+  {
+    free( d );
+    return NULL;
+  }
+  d->ent = ent;
+  ent->priv = d;
+  drive_query( ent, d );
+  return d;
+}
+
+static void
+wdpd_event( struct passport_registry *reg, struct passport_entry *ent,
+    enum hotplug_event ev, void *arg )
+{
+  struct wdpd_drive *d = ent->priv;
+
+  // a drive in use by a worker is checked when the worker reports back
+  if( d && d->busy && ev != HOTPLUG_REMOVE )
+    return;
+  // a new or vanished block node invalidates the session and its cache
+  drive_free( ent );
+  if( ev == HOTPLUG_REMOVE )
+    printf( "WD Passport %s removed\n", ent->hctl );
+  else if( drive_get( ent ) )
+    printf( "WD Passport %s (%s): %s\n", ent->hctl, ent->block_node,
+	ent->security < 0 ? "no status" :
+	sec_status_to_str( ent->security ) );
+  fflush( stdout );
+}
+
+// The drive named by a request: HCTL, block node, or "" for the first one
+static struct passport_entry *
+wdpd_lookup( struct passport_registry *reg, const char *device )
+{
+  struct passport_entry *ent;
+  int           k;
+
+  if( device[0] )
+  {
+    if( ( ent = registry_lookup( reg, device ) ) )
+      return ent;
+    return registry_lookup_node( reg, device );
+  }
+  for( k = 0; k < REG_BUCKETS; k++ )
+    for( ent = reg->by_hctl[k]; ent; ent = ent->next )
+      if( ent->block_node[0] )
+	return ent;
+  return NULL;
+}
+
+static void
+reply_init( struct wdpd_reply *rep, int result )
+{
+  memset( rep, 0, sizeof( *rep ) );
+  rep->magic = WDPD_MAGIC;
+  rep->version = WDPD_VERSION;
+  rep->result = result;
+  rep->security = -1;
+}
+
+// Fills the drive fields; text too unless it holds a label or hint
+static void
+reply_drive( struct wdpd_reply *rep, struct passport_entry *ent,
+    bool status_text )
+{
+  struct wdpd_drive *d = ent->priv;
+
+  snprintf( rep->hctl, sizeof( rep->hctl ), "%s", ent->hctl );
+  snprintf( rep->block_node, sizeof( rep->block_node ), "%s",
+      ent->block_node );
+  rep->security = ent->security;
+  if( d && !d->busy && d->status_ns )
+  {
+    rep->cipher = d->cipher;
+    rep->pwblen = d->pwblen;
+    rep->status_age_ms = ( scsi_clock_ns(  ) - d->status_ns ) / 1000000;
+  }
+  if( status_text && ent->security >= 0 )
+    snprintf( rep->text, sizeof( rep->text ), "%s",
+	sec_status_to_str( ent->security ) );
+}
+
+static void
+wdpd_send( int fd, const struct wdpd_reply *rep )
+{
+  if( send( fd, rep, sizeof( *rep ), MSG_NOSIGNAL ) < 0 && errno != EPIPE )
+    pr2serr( "wd-passportd: send: %s\n", strerror( errno ) );
+}
+
+// Runs a request other than unlock and password change on a drive and
+// fills the reply
+static int
+wdpd_drive_request( struct passport_entry *ent, struct wdpd_request *req,
+    struct wdpd_reply *rep )
+{
+  struct wdpd_drive *d = drive_get( ent );
+  struct scsi_op_t *op;
+
+  if( d == NULL )
+    return WDPD_E_IO;
+  if( d->busy )			// only the last status can be given
+    return req->op == WDPD_STATUS ? WDPD_OK : WDPD_E_BUSY;
+  op = &d->op;
+  // the status read drops the cached handy blocks too
+  if( req->flags & WDPD_REFRESH && !drive_query( ent, d ) )
+    return WDPD_E_IO;
+  switch ( req->op )
+  {
+    case WDPD_STATUS:
+      return WDPD_OK;
+    case WDPD_LABEL:
+      if( read_handy_store_block2( op, rep->text ) == NULL )
+	rep->text[0] = 0;
+      return WDPD_OK;
+    case WDPD_HINT:
+      if( read_handy_store_block1( op, rep->text ) == NULL )
+	rep->text[0] = 0;
+      return WDPD_OK;
+  }
+  return WDPD_E_PROTO;
+}
+
+// Worker thread: runs the unlock or password change of a job, KDF
+// included, on the session of its drive
+static void  *
+wdpd_worker( void *arg )
+{
+  struct wdpd_job *job = arg;
+  struct wdpd_drive *d = job->d;
+  int           ok;
+
+  job->result = WDPD_E_IO;
+  job->security = -1;
+  // the KDF parameters and salt must be the drive's, not a cached copy
+  handy_cache_drop( &d->op );
+  // both need the current status in op->reply
+  if( drive_status( d ) >= 0 )
+  {
+    if( job->req.op == WDPD_UNLOCK )
+      ok = unlock_drive( &d->op, job->req.passwd );
+    else
+      ok = change_password_to( &d->op, CHANGE_PASSWD, job->req.passwd,
+	  job->req.new_passwd );
+    job->result = ok ? WDPD_OK : WDPD_E_FAILED;
+    job->security = drive_status( d );
+  }
+  memset( job->req.passwd, 0, sizeof( job->req.passwd ) );
+  memset( job->req.new_passwd, 0, sizeof( job->req.new_passwd ) );
+  fflush( stdout );
+  if( write( wdpd_done[1], &job, sizeof( job ) ) != sizeof( job ) )
+    pr2serr( "wd-passportd: cannot report a finished job\n" );
+  return NULL;
+}
+
+// Hands an unlock or password change to a worker, which owns the drive
+// until wdpd_complete(). Returns WDPD_OK once started, else the result.
+static int
+wdpd_submit( struct passport_entry *ent, int fd, struct wdpd_request *req )
+{
+  struct wdpd_drive *d = drive_get( ent );
+  struct wdpd_job *job;
+  pthread_attr_t attr;
+  pthread_t     tid;
+  int           err;
+
+  if( d == NULL )
+    return WDPD_E_IO;
+  if( d->busy )
+    return WDPD_E_BUSY;
+  if( ( job = calloc( 1, sizeof( *job ) ) ) == NULL )
+    return WDPD_E_IO;
+  job->d = d;
+  job->fd = fd;
+  job->req = *req;
+  d->busy = true;
+  pthread_attr_init( &attr );
+  pthread_attr_setdetachstate( &attr, PTHREAD_CREATE_DETACHED );
+  err = pthread_create( &tid, &attr, wdpd_worker, job );
+  pthread_attr_destroy( &attr );
+  if( err )
+  {
+    pr2serr( "wd-passportd: pthread_create: %s\n", strerror( err ) );
+    d->busy = false;
+    memset( job, 0, sizeof( *job ) );
+    free( job );
+    return WDPD_E_IO;
+  }
+  wdpd_jobs++;
+  return WDPD_OK;
+}
+
+// Takes back the drive of a finished job and answers its client
+static void
+wdpd_complete( struct wdpd_job *job )
+{
+  struct wdpd_drive *d = job->d;
+  struct wdpd_reply rep;
+
+  wdpd_jobs--;
+  d->busy = false;
+  reply_init( &rep, job->result );
+  if( d->ent )
+  {
+    d->ent->security = job->security;
+    reply_drive( &rep, d->ent, true );
+    // the block node changed meanwhile: reopen on the next request
+    if( strcmp( d->node, d->ent->block_node ) )
+      drive_free( d->ent );
+  }
+  else
+  {
+    // unplugged meanwhile: the drive state was only kept for the worker
+    rep.security = job->security;
+    scsi_op_free( &d->op );
+    free( d );
+  }
+  wdpd_send( job->fd, &rep );
+  free( job );
+}
+
+// Answers the request of client fd. Returns true if a worker answers it
+// instead, the client then waits for wdpd_complete().
+static bool
+wdpd_request( struct passport_registry *reg, int fd,
+    struct wdpd_request *req )
+{
+  struct wdpd_reply rep;
+  struct passport_entry *ent;
+  struct wdpd_drive *d;
+  int           k, result;
+  bool          pending = false;
+
+  if( req->magic != WDPD_MAGIC || req->version != WDPD_VERSION )
+  {
+    reply_init( &rep, WDPD_E_PROTO );
+    wdpd_send( fd, &rep );
+    return false;
+  }
+  req->device[sizeof( req->device ) - 1] = 0;
+  req->passwd[sizeof( req->passwd ) - 1] = 0;
+  req->new_passwd[sizeof( req->new_passwd ) - 1] = 0;
+  if( req->op == WDPD_LIST )
+  {
+    for( k = 0; k < REG_BUCKETS; k++ )
+      for( ent = reg->by_hctl[k]; ent; ent = ent->next )
+      {
+	result = WDPD_OK;
+	d = ent->priv;
+	if( d && d->busy )	// the last status stands in
+	  ;
+	else if( req->flags & WDPD_REFRESH &&
+	    ( ( d = drive_get( ent ) ) == NULL || !drive_query( ent, d ) ) )
+	  result = WDPD_E_IO;
+	reply_init( &rep, result );
+	reply_drive( &rep, ent, true );
+	wdpd_send( fd, &rep );
+      }
+    reply_init( &rep, WDPD_END );
+    wdpd_send( fd, &rep );
+    return false;
+  }
+  reply_init( &rep, WDPD_E_NODEV );
+  if( ( ent = wdpd_lookup( reg, req->device ) ) )
+  {
+    if( req->op != WDPD_UNLOCK && req->op != WDPD_CHANGE_PASSWD )
+      rep.result = wdpd_drive_request( ent, req, &rep );
+    else if( ( rep.result = wdpd_submit( ent, fd, req ) ) == WDPD_OK )
+      pending = true;
+    reply_drive( &rep, ent, req->op != WDPD_LABEL &&
+	req->op != WDPD_HINT );
+  }
+  memset( req->passwd, 0, sizeof( req->passwd ) );
+  memset( req->new_passwd, 0, sizeof( req->new_passwd ) );
+  if( !pending )
+    wdpd_send( fd, &rep );
+  return pending;
+}
+
+// Rereads the status of every idle drive that is due; returns the poll
+// timeout in ms until the next one, -1 if none
+static int
+wdpd_refresh( struct passport_registry *reg )
+{
+  struct passport_entry *ent;
+  struct wdpd_drive *d;
+  uint64_t      now, next = UINT64_MAX;
+  int           k;
+
+  for( k = 0; k < REG_BUCKETS; k++ )
+    for( ent = reg->by_hctl[k]; ent; ent = ent->next )
+      if( ( d = ent->priv ) && !d->busy )
+      {
+	if( d->due_ns <= scsi_clock_ns(  ) )
+	  drive_query( ent, d );
+	if( d->due_ns < next )
+	  next = d->due_ns;
+      }
+  now = scsi_clock_ns(  );
+  return next == UINT64_MAX ? -1 :
+      next <= now ? 0 : ( next - now + 999999 ) / 1000000;
+}
+
+static int
+wdpd_listen( const char *path )
+{
+  struct sockaddr_un addr;
+  struct stat   st;
+  int           fd;
+
+  if( strlen( path ) >= sizeof( addr.sun_path ) )
+  {
+    pr2serr( "wd-passportd: socket path too long\n" );
+    return -1;
+  }
+  memset( &addr, 0, sizeof( addr ) );
+  addr.sun_family = AF_UNIX;
+  strcpy( addr.sun_path, path );
+  // a stale socket of an earlier run is replaced, anything else kept
+  if( lstat( path, &st ) == 0 )
+  {
+    if( !S_ISSOCK( st.st_mode ) )
+    {
+      pr2serr( "wd-passportd: %s exists and is not a socket\n", path );
+      return -1;
+    }
+    unlink( path );
+  }
+  fd = socket( AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0 );
+  if( fd < 0 )
+    return -1;
+  // the socket carries passwords: root only
+  umask( 077 );
+  if( bind( fd, ( struct sockaddr * ) &addr, sizeof( addr ) ) ||
+      listen( fd, 16 ) )
+  {
+    pr2serr( "wd-passportd: %s: %s\n", path, strerror( errno ) );
+    close( fd );
+    return -1;
+  }
+  return fd;
+}
+
+int
+daemon_main( const char *socket_path )
+{
+  struct passport_registry reg;
+  struct passport_entry *ent;
+  struct wdpd_request req;
+  struct wdpd_job *job;
+  struct pollfd pfd[3 + WDPD_MAX_CLIENTS];
+  int           clients[WDPD_MAX_CLIENTS];
+  bool          waiting[WDPD_MAX_CLIENTS];	// for a worker's reply
+  int           nclients = 0, lfd, fd, k, n, timeout;
+  ssize_t       len;
+
+  // also reached through the setuid binary: the socket path is the caller's
+  if( getuid(  ) != 0 )
+  {
+    pr2serr( "wd-passportd: must be run by root\n" );
+    return -1;
+  }
+  if( pipe2( wdpd_done, O_CLOEXEC ) < 0 )
+  {
+    pr2serr( "wd-passportd: pipe: %s\n", strerror( errno ) );
+    return -1;
+  }
+  registry_init( &reg );
+  if( hotplug_open( &reg ) )
+    return -1;
+  if( ( lfd = wdpd_listen( socket_path ) ) < 0 )
+  {
+    registry_free( &reg );
+    return -1;
+  }
+  signal( SIGTERM, wdpd_signal );
+  signal( SIGINT, wdpd_signal );
+  signal( SIGUSR1, wdpd_signal );	// dump the command trace
+  signal( SIGPIPE, SIG_IGN );
+  printf( "wd-passportd: %d WD Passport device(s), listening on %s\n",
+      registry_scan( &reg ), socket_path );
+  for( k = 0; k < REG_BUCKETS; k++ )
+    for( ent = reg.by_hctl[k]; ent; ent = ent->next )
+      wdpd_event( &reg, ent, HOTPLUG_ADD, NULL );
+
+  while( !wdpd_stop )
+  {
+    if( wdpd_trace )
+    {
+      wdpd_trace = 0;
+      scsi_trace_dump( stderr );
+    }
+    timeout = wdpd_refresh( &reg );
+    pfd[0].fd = lfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = reg.nl_fd;
+    pfd[1].events = POLLIN;
+    pfd[2].fd = wdpd_done[0];
+    pfd[2].events = POLLIN;
+    for( k = 0; k < nclients; k++ )
+    {
+      // a client waiting for a worker is not read until it is answered
+      pfd[3 + k].fd = waiting[k] ? -1 : clients[k];
+      pfd[3 + k].events = POLLIN;
+    }
+    if( poll( pfd, 3 + nclients, timeout ) < 0 )
+    {
+      if( errno == EINTR )
+	continue;
+      break;
+    }
+    if( pfd[1].revents && hotplug_process( &reg, wdpd_event, NULL ) < 0 )
+      break;
+    if( pfd[2].revents &&
+	read( wdpd_done[0], &job, sizeof( job ) ) == sizeof( job ) )
+    {
+      for( k = 0; k < nclients; k++ )
+	if( clients[k] == job->fd )
+	  waiting[k] = false;
+      wdpd_complete( job );
+    }
+    // serve the clients; a closed one is replaced by the last
+    n = nclients;
+    for( k = n - 1; k >= 0; k-- )
+    {
+      if( !pfd[3 + k].revents )
+	continue;
+      len = recv( clients[k], &req, sizeof( req ), 0 );
+      if( len == sizeof( req ) )
+	waiting[k] = wdpd_request( &reg, clients[k], &req );
+      else if( len < 0 && errno == EINTR )
+	continue;
+      else
+      {
+	if( len > 0 )		// wrong size: answer, then hang up
+	{
+	  struct wdpd_reply rep;
+
+	  reply_init( &rep, WDPD_E_PROTO );
+	  wdpd_send( clients[k], &rep );
+	}
+	close( clients[k] );
+	clients[k] = clients[--nclients];
+	waiting[k] = waiting[nclients];
+      }
+      memset( &req, 0, sizeof( req ) );
+    }
+    if( pfd[0].revents &&
+	( fd = accept4( lfd, NULL, NULL, SOCK_CLOEXEC ) ) >= 0 )
+    {
+      if( nclients < WDPD_MAX_CLIENTS )
+      {
+	waiting[nclients] = false;
+	clients[nclients++] = fd;
+      }
+      else
+	close( fd );
+    }
+  }
+
+  // the workers still answer their clients
+  while( wdpd_jobs > 0 )
+  {
+    len = read( wdpd_done[0], &job, sizeof( job ) );
+    if( len == sizeof( job ) )
+      wdpd_complete( job );
+    else if( len >= 0 || errno != EINTR )
+      break;
+  }
+  for( k = 0; k < nclients; k++ )
+    close( clients[k] );
+  close( lfd );
+  unlink( socket_path );
+  for( k = 0; k < REG_BUCKETS; k++ )
+    for( ent = reg.by_hctl[k]; ent; ent = ent->next )
+      drive_free( ent );
+  registry_free( &reg );
+  return 0;
+}